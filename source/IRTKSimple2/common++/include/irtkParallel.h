@@ -39,6 +39,8 @@ extern int tbb_no_threads;
 #  include <tbb/tick_count.h>
 #  include <tbb/concurrent_queue.h>
 #  include <tbb/mutex.h>
+#  include <tbb/enumerable_thread_specific.h>
+#  include <tbb/task_arena.h>
 using namespace tbb;
 // Otherwise, use dummy implementations of TBB classes/functions which allows
 // developers to write parallelizable code as if TBB was available and yet
@@ -137,8 +139,110 @@ using namespace tbb;
   }
 
   struct split {};
+
+  template <typename T>
+  class enumerable_thread_specific
+  {
+    T _local;
+  public:
+    typedef T *iterator;
+    T &local() { return _local; }
+    iterator begin() { return &_local; }
+    iterator end()   { return &_local + 1; }
+  };
+
+  class task_arena
+  {
+  public:
+    static const int automatic = -1;
+    task_arena(int = automatic) {}
+    template <class F> void execute(const F &f) { f(); }
+  };
 #endif
 
+/// Persistent pool of worker threads for parallel_for and parallel_reduce
+///
+/// Unlike task_scheduler_init, which starts and stops the TBB workers each
+/// time a parallel section is entered, the threads of an arena are started
+/// once and reused by every loop executed through it. Each arena has its own
+/// concurrency, so several of them can be used in one process.
+///
+/// @code
+/// irtkTaskArena arena(4);
+/// arena.ParallelFor(blocked_range<size_t>(0, n), body);
+/// arena.Execute(functor); // e.g. a registration using parallel_reduce
+/// @endcode
+class irtkTaskArena
+{
+  /// Maximum number of threads, task_arena::automatic for all cores
+  int _threads;
+
+  /// Created on first use and whenever the number of threads changes
+  task_arena *_arena;
+
+  template <class Range, class Body>
+  struct ForFunctor
+  {
+    const Range &range;
+    const Body &body;
+    ForFunctor(const Range &r, const Body &b) : range(r), body(b) {}
+    void operator()() const { parallel_for(range, body); }
+  };
+
+  template <class Range, class Body>
+  struct ReduceFunctor
+  {
+    const Range &range;
+    Body &body;
+    ReduceFunctor(const Range &r, Body &b) : range(r), body(b) {}
+    void operator()() const { parallel_reduce(range, body); }
+  };
+
+  task_arena &Arena();
+
+public:
+
+  /// Constructor, threads <= 0 uses all cores
+  irtkTaskArena(int threads = task_arena::automatic);
+
+  /// Copy constructor, the copy gets its own threads
+  irtkTaskArena(const irtkTaskArena &);
+
+  /// Assignment operator, only copies the number of threads
+  irtkTaskArena &operator=(const irtkTaskArena &);
+
+  /// Destructor
+  ~irtkTaskArena();
+
+  /// Set the maximum number of threads, threads <= 0 uses all cores
+  void SetNumberOfThreads(int threads);
+
+  /// Maximum number of threads, task_arena::automatic for all cores
+  int GetNumberOfThreads() const;
+
+  /// Execute a function object inside the arena, parallel_for and
+  /// parallel_reduce called by it run on the threads of the arena
+  template <class F>
+  void Execute(const F &f)
+  {
+    Arena().execute(f);
+  }
+
+  /// Execute parallel_for inside the arena
+  template <class Range, class Body>
+  void ParallelFor(const Range &range, const Body &body)
+  {
+    Arena().execute(ForFunctor<Range, Body>(range, body));
+  }
+
+  /// Execute parallel_reduce inside the arena
+  template <class Range, class Body>
+  void ParallelReduce(const Range &range, Body &body)
+  {
+    Arena().execute(ReduceFunctor<Range, Body>(range, body));
+  }
+};
+
 /// Preprocessor flag to over all remove timing code from binary must be
 /// defined non-zero before any include statement if timing should be used
 #ifndef USE_TIMING
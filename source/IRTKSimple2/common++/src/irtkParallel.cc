@@ -10,6 +10,8 @@
 
 =========================================================================*/
 
+#include <cstddef>
+
 #include <irtkParallel.h>
 
 // Default: No debugging of execution time
@@ -24,3 +26,49 @@ int tbb_no_threads = task_scheduler_init::automatic;
 #else
 int tbb_no_threads = 1;
 #endif
+
+irtkTaskArena::irtkTaskArena(int threads)
+:
+  _threads(threads > 0 ? threads : int(task_arena::automatic)),
+  _arena(NULL)
+{
+}
+
+irtkTaskArena::irtkTaskArena(const irtkTaskArena &other)
+:
+  _threads(other._threads),
+  _arena(NULL)
+{
+}
+
+irtkTaskArena &irtkTaskArena::operator=(const irtkTaskArena &other)
+{
+  if (this != &other) SetNumberOfThreads(other._threads);
+  return *this;
+}
+
+irtkTaskArena::~irtkTaskArena()
+{
+  delete _arena;
+}
+
+void irtkTaskArena::SetNumberOfThreads(int threads)
+{
+  if (threads <= 0) threads = task_arena::automatic;
+  if (threads != _threads) {
+    delete _arena;
+    _arena   = NULL;
+    _threads = threads;
+  }
+}
+
+int irtkTaskArena::GetNumberOfThreads() const
+{
+  return _threads;
+}
+
+task_arena &irtkTaskArena::Arena()
+{
+  if (_arena == NULL) _arena = new task_arena(_threads);
+  return *_arena;
+}
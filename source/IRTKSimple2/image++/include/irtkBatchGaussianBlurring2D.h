@@ -0,0 +1,81 @@
+/*=========================================================================
+
+  Library   : Image Registration Toolkit (IRTK)
+  Module    : $Id$
+  Copyright : Imperial College, Department of Computing
+              Visual Information Processing (VIP), 2008 onwards
+  Date      : $Date$
+  Version   : $Revision$
+  Changes   : $Author$
+
+=========================================================================*/
+
+#ifndef _IRTKBATCHGAUSSIANBLURRING2D_H
+
+#define _IRTKBATCHGAUSSIANBLURRING2D_H
+
+#include <vector>
+
+/**
+ * Class for Gaussian blurring of many 2D images in one call
+ *
+ * Blurs 2D images (z = 1) in place with the same result as
+ * irtkGaussianBlurring: a sampled Gaussian kernel of radius 4 sigma,
+ * normalised by the kernel weights inside the image at the borders. The
+ * kernels and border normalisation are computed once and reused as long as
+ * the image size and pixel size stay the same. Rows are filtered along x and
+ * then along y one row at a time, both passes run over contiguous rows so the
+ * compiler can vectorize them, and no transposes are needed.
+ *
+ * An instance keeps a row buffer and must not be shared between threads.
+ */
+
+template <class VoxelType> class irtkBatchGaussianBlurring2D : public irtkObject
+{
+
+protected:
+
+  /// Sigma (standard deviation of Gaussian kernel)
+  double _Sigma;
+
+  /// Image size and pixel size the kernels were computed for
+  int _x, _y;
+  double _dx, _dy;
+
+  /// Kernels along x and y, their radius and the sum of their weights
+  /// inside the image at each position
+  std::vector<double> _kernelX, _kernelY, _normX, _normY;
+  int _radiusX, _radiusY;
+
+  /// Result of the pass along x and accumulator of the pass along y
+  std::vector<double> _tmp, _row;
+
+  /// Compute kernels for the size and pixel size of an image
+  void Initialize(irtkGenericImage<VoxelType> *);
+
+  /// Blur one image
+  void Run(irtkGenericImage<VoxelType> *);
+
+public:
+
+  /// Constructor
+  irtkBatchGaussianBlurring2D(double = 0);
+
+  /// Destructor
+  ~irtkBatchGaussianBlurring2D();
+
+  /// Blur n images in place
+  void Run(irtkGenericImage<VoxelType> **, int);
+
+  /// Set sigma, the kernels are recomputed if it changes
+  void SetSigma(double);
+
+  /// Get sigma
+  GetMacro(Sigma, double);
+
+  /// Returns the name of the class
+  virtual const char *NameOfClass();
+
+};
+
+#endif
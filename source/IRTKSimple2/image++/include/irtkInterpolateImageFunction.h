@@ -102,6 +102,7 @@ inline void irtkInterpolateImageFunction::Inside(double &x1, double &y1, double
 
 #include <irtkNearestNeighborInterpolateImageFunction.h>
 #include <irtkLinearInterpolateImageFunction.h>
+#include <irtkLinearInterpolateImageKernel.h>
 #include <irtkBSplineInterpolateImageFunction.h>
 #include <irtkCSplineInterpolateImageFunction.h>
 #include <irtkShapeBasedInterpolateImageFunction.h>
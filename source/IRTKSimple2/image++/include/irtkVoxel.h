@@ -6,8 +6,11 @@
 
 typedef unsigned char  irtkBytePixel;
 typedef short          irtkGreyPixel;
+#ifdef IRTK_SINGLE_PRECISION
+typedef float          irtkRealPixel;
+#else
 typedef double         irtkRealPixel;
-//typedef float         irtkRealPixel;
+#endif
 
 #define MIN_GREY (double)std::numeric_limits<short>::min()
 #define MAX_GREY (double)std::numeric_limits<short>::max()
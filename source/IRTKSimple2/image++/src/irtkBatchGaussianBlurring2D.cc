@@ -0,0 +1,142 @@
+/*=========================================================================
+
+  Library   : Image Registration Toolkit (IRTK)
+  Module    : $Id$
+  Copyright : Imperial College, Department of Computing
+              Visual Information Processing (VIP), 2008 onwards
+  Date      : $Date$
+  Version   : $Revision$
+  Changes   : $Author$
+
+=========================================================================*/
+
+#include <irtkImage.h>
+
+#include <irtkBatchGaussianBlurring2D.h>
+
+/// Kernel of irtkGaussianBlurring for sigma in pixels and its weights inside
+/// a line of n pixels at each position
+static void irtkBatchGaussianKernel(double sigma, int n, std::vector<double> &kernel, std::vector<double> &norm, int &radius)
+{
+  int i, k;
+
+  radius = round(4 * sigma);
+  kernel.resize(2 * radius + 1);
+  for (k = -radius; k <= radius; k++) {
+    kernel[k + radius] = exp(-k * k / (2 * sigma * sigma));
+  }
+
+  norm.assign(n, 0);
+  for (i = 0; i < n; i++) {
+    for (k = max(-radius, -i); k <= min(radius, n - 1 - i); k++) {
+      norm[i] += kernel[k + radius];
+    }
+  }
+}
+
+template <class VoxelType> irtkBatchGaussianBlurring2D<VoxelType>::irtkBatchGaussianBlurring2D(double Sigma)
+{
+  _Sigma   = Sigma;
+  _x       = 0;
+  _y       = 0;
+  _dx      = 0;
+  _dy      = 0;
+  _radiusX = 0;
+  _radiusY = 0;
+}
+
+template <class VoxelType> irtkBatchGaussianBlurring2D<VoxelType>::~irtkBatchGaussianBlurring2D(void)
+{
+}
+
+template <class VoxelType> const char *irtkBatchGaussianBlurring2D<VoxelType>::NameOfClass()
+{
+  return "irtkBatchGaussianBlurring2D";
+}
+
+template <class VoxelType> void irtkBatchGaussianBlurring2D<VoxelType>::SetSigma(double Sigma)
+{
+  if (Sigma != _Sigma) {
+    _Sigma = Sigma;
+    _x = 0;
+  }
+}
+
+template <class VoxelType> void irtkBatchGaussianBlurring2D<VoxelType>::Initialize(irtkGenericImage<VoxelType> *image)
+{
+  double xsize, ysize, zsize;
+
+  if ((image->GetZ() != 1) || (image->GetT() != 1)) {
+    cerr << this->NameOfClass() << "::Run: Images must be 2D" << endl;
+    exit(1);
+  }
+
+  image->GetPixelSize(&xsize, &ysize, &zsize);
+  if ((image->GetX() == _x) && (image->GetY() == _y) && (xsize == _dx) && (ysize == _dy)) return;
+
+  _x  = image->GetX();
+  _y  = image->GetY();
+  _dx = xsize;
+  _dy = ysize;
+  irtkBatchGaussianKernel(_Sigma / _dx, _x, _kernelX, _normX, _radiusX);
+  irtkBatchGaussianKernel(_Sigma / _dy, _y, _kernelY, _normY, _radiusY);
+  _tmp.resize(_x * _y);
+  _row.resize(_x);
+}
+
+template <class VoxelType> void irtkBatchGaussianBlurring2D<VoxelType>::Run(irtkGenericImage<VoxelType> *image)
+{
+  int i, j, k;
+
+  this->Initialize(image);
+
+  VoxelType *ptr = image->GetPointerToVoxels();
+
+  // Blur along x, kernel offsets outside and pixels inside
+  for (j = 0; j < _y; j++) {
+    const VoxelType *in = ptr + j * _x;
+    double *out = &_tmp[j * _x];
+    for (i = 0; i < _x; i++) out[i] = 0;
+    for (k = -_radiusX; k <= _radiusX; k++) {
+      double w = _kernelX[k + _radiusX];
+      int i0 = max(0, -k), i1 = min(_x, _x - k);
+      for (i = i0; i < i1; i++) {
+        out[i] += w * in[i + k];
+      }
+    }
+    for (i = 0; i < _x; i++) out[i] /= _normX[i];
+  }
+
+  // Blur along y, one output row from whole input rows
+  for (j = 0; j < _y; j++) {
+    double *acc = &_row[0];
+    for (i = 0; i < _x; i++) acc[i] = 0;
+    for (k = max(-_radiusY, -j); k <= min(_radiusY, _y - 1 - j); k++) {
+      double w = _kernelY[k + _radiusY];
+      const double *in = &_tmp[(j + k) * _x];
+      for (i = 0; i < _x; i++) {
+        acc[i] += w * in[i];
+      }
+    }
+    VoxelType *out = ptr + j * _x;
+    for (i = 0; i < _x; i++) {
+      double val = acc[i] / _normY[j];
+      if (val > voxel_limits<VoxelType>::max()) val = voxel_limits<VoxelType>::max();
+      if (val < voxel_limits<VoxelType>::min()) val = voxel_limits<VoxelType>::min();
+      out[i] = static_cast<VoxelType>(val);
+    }
+  }
+}
+
+template <class VoxelType> void irtkBatchGaussianBlurring2D<VoxelType>::Run(irtkGenericImage<VoxelType> **images, int n)
+{
+  for (int i = 0; i < n; i++) {
+    this->Run(images[i]);
+  }
+}
+
+template class irtkBatchGaussianBlurring2D<unsigned char>;
+template class irtkBatchGaussianBlurring2D<short>;
+template class irtkBatchGaussianBlurring2D<unsigned short>;
+template class irtkBatchGaussianBlurring2D<float>;
+template class irtkBatchGaussianBlurring2D<double>;
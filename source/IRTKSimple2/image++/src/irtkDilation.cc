@@ -82,5 +82,5 @@ template <class VoxelType> void irtkDilation<VoxelType>::Run()
 
 template class irtkDilation<irtkBytePixel>;
 template class irtkDilation<irtkGreyPixel>;
-template class irtkDilation<irtkRealPixel>;
 template class irtkDilation<float>;
+template class irtkDilation<double>;
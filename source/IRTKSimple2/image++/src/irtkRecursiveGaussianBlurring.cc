@@ -0,0 +1,208 @@
+/*=========================================================================
+
+  Library   : Image Registration Toolkit (IRTK)
+  Module    : $Id$
+  Copyright : Imperial College, Department of Computing
+              Visual Information Processing (VIP), 2008 onwards
+  Date      : $Date$
+  Version   : $Revision$
+  Changes   : $Author$
+
+=========================================================================*/
+
+#include <irtkImage.h>
+
+#include <irtkGaussianBlurring.h>
+
+#include <irtkRecursiveGaussianBlurring.h>
+
+#include <vector>
+
+/// Recursive filter of one axis: gain, feedback coefficients, the matrix
+/// initialising the backward pass from the end of the forward pass and the
+/// response to a line of ones
+class irtkRecursiveGaussianFilter
+{
+
+public:
+
+  double _B, _a[3], _M[9];
+
+  std::vector<double> _norm;
+
+  irtkRecursiveGaussianFilter(double sigma, int n) {
+    // Young and van Vliet, 1995
+    double q;
+    if (sigma >= 2.5) {
+      q = 0.98711 * sigma - 0.96330;
+    } else {
+      q = 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    }
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    _a[0] = (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0;
+    _a[1] = -(1.4281 * q * q + 1.26661 * q * q * q) / b0;
+    _a[2] = 0.422205 * q * q * q / b0;
+    _B = 1 - (_a[0] + _a[1] + _a[2]);
+
+    // Backward states beyond the end of a line for unit forward states and
+    // zero input, run until the response has decayed
+    // (entries 0, 1, 2 are the last three voxels of the line)
+    int i, j, k, tail = int(30 * q) + 30;
+    std::vector<double> w(tail + 3), y(tail + 6);
+    for (k = 0; k < 3; k++) {
+      w.assign(tail + 3, 0);
+      y.assign(tail + 6, 0);
+      w[2 - k] = 1;
+      for (i = 3; i < tail + 3; i++) {
+        w[i] = _a[0] * w[i-1] + _a[1] * w[i-2] + _a[2] * w[i-3];
+      }
+      for (i = tail + 2; i >= 3; i--) {
+        y[i] = _B * w[i] + _a[0] * y[i+1] + _a[1] * y[i+2] + _a[2] * y[i+3];
+      }
+      for (j = 0; j < 3; j++) {
+        _M[3 * j + k] = y[3 + j];
+      }
+    }
+
+    // Divisor of the normalisation
+    _norm.assign(n, 1);
+    Filter(&_norm[0], n);
+  }
+
+  /// Filter a line in place, zeros outside
+  void Filter(double *x, int n) const {
+    int i;
+    double w1 = 0, w2 = 0, w3 = 0;
+    for (i = 0; i < n; i++) {
+      x[i] = _B * x[i] + _a[0] * w1 + _a[1] * w2 + _a[2] * w3;
+      w3 = w2;
+      w2 = w1;
+      w1 = x[i];
+    }
+    double y1 = _M[0] * x[n-1] + _M[1] * (n > 1 ? x[n-2] : 0) + _M[2] * (n > 2 ? x[n-3] : 0);
+    double y2 = _M[3] * x[n-1] + _M[4] * (n > 1 ? x[n-2] : 0) + _M[5] * (n > 2 ? x[n-3] : 0);
+    double y3 = _M[6] * x[n-1] + _M[7] * (n > 1 ? x[n-2] : 0) + _M[8] * (n > 2 ? x[n-3] : 0);
+    for (i = n - 1; i >= 0; i--) {
+      x[i] = _B * x[i] + _a[0] * y1 + _a[1] * y2 + _a[2] * y3;
+      y3 = y2;
+      y2 = y1;
+      y1 = x[i];
+    }
+  }
+
+};
+
+/// Filters the lines of one axis of a buffer in parallel
+class irtkMultiThreadedRecursiveGaussian
+{
+
+  /// Filter of the axis
+  const irtkRecursiveGaussianFilter *_filter;
+
+  /// Buffer, number of voxels of a line and step between them
+  double *_data;
+  int _n, _stride;
+
+public:
+
+  irtkMultiThreadedRecursiveGaussian(const irtkRecursiveGaussianFilter *filter, double *data, int n, int stride) {
+    _filter = filter;
+    _data   = data;
+    _n      = n;
+    _stride = stride;
+  }
+
+  void operator()(const blocked_range<int> &r) const {
+    int i, l;
+    std::vector<double> line(_n);
+    for (l = r.begin(); l != r.end(); l++) {
+      // Lines along x are contiguous, others start in the planes below
+      double *p = _data + (_stride == 1 ? l * _n : (l % _stride) + (l / _stride) * _stride * _n);
+      for (i = 0; i < _n; i++) line[i] = p[i * _stride];
+      _filter->Filter(&line[0], _n);
+      for (i = 0; i < _n; i++) p[i * _stride] = line[i] / _filter->_norm[i];
+    }
+  }
+
+};
+
+template <class VoxelType> irtkRecursiveGaussianBlurring<VoxelType>::irtkRecursiveGaussianBlurring(double Sigma)
+{
+  _Sigma = Sigma;
+}
+
+template <class VoxelType> irtkRecursiveGaussianBlurring<VoxelType>::~irtkRecursiveGaussianBlurring(void)
+{
+}
+
+template <class VoxelType> bool irtkRecursiveGaussianBlurring<VoxelType>::RequiresBuffering(void)
+{
+  return false;
+}
+
+template <class VoxelType> const char *irtkRecursiveGaussianBlurring<VoxelType>::NameOfClass()
+{
+  return "irtkRecursiveGaussianBlurring";
+}
+
+template <class VoxelType> void irtkRecursiveGaussianBlurring<VoxelType>::Run()
+{
+  int i, t, axis;
+  double size[3];
+
+  // Do the initial set up
+  this->Initialize();
+
+  // Get voxel dimensions
+  this->_input->GetPixelSize(&size[0], &size[1], &size[2]);
+  int dim[3] = { this->_input->GetX(), this->_input->GetY(), this->_input->GetZ() };
+
+  // The recursive filter needs sigma of at least 0.5 voxels
+  for (axis = 0; axis < 3; axis++) {
+    if ((dim[axis] > 1) && (this->_Sigma / size[axis] < 0.5)) {
+      irtkGaussianBlurring<VoxelType> blurring(this->_Sigma);
+      blurring.SetInput (this->_input);
+      blurring.SetOutput(this->_output);
+      blurring.Run();
+      return;
+    }
+  }
+
+  int n = dim[0] * dim[1] * dim[2];
+  int stride[3] = { 1, dim[0], dim[0] * dim[1] };
+  std::vector<double> buffer(n);
+
+  for (t = 0; t < this->_input->GetT(); t++) {
+
+    // Copy the frame, the output may be the input
+    VoxelType *ptr = this->_input->GetPointerToVoxels(0, 0, 0, t);
+    for (i = 0; i < n; i++) buffer[i] = ptr[i];
+
+    // Blur along the axes with more than one voxel
+    for (axis = 0; axis < 3; axis++) {
+      if (dim[axis] > 1) {
+        irtkRecursiveGaussianFilter filter(this->_Sigma / size[axis], dim[axis]);
+        parallel_for(blocked_range<int>(0, n / dim[axis]),
+                     irtkMultiThreadedRecursiveGaussian(&filter, &buffer[0], dim[axis], stride[axis]));
+      }
+    }
+
+    // Write the frame with the clamping of PutAsDouble
+    ptr = this->_output->GetPointerToVoxels(0, 0, 0, t);
+    for (i = 0; i < n; i++) {
+      double val = buffer[i];
+      if (val > voxel_limits<VoxelType>::max()) val = voxel_limits<VoxelType>::max();
+      if (val < voxel_limits<VoxelType>::min()) val = voxel_limits<VoxelType>::min();
+      ptr[i] = static_cast<VoxelType>(val);
+    }
+  }
+
+  // Do the final cleaning up
+  this->Finalize();
+}
+
+template class irtkRecursiveGaussianBlurring<unsigned char>;
+template class irtkRecursiveGaussianBlurring<short>;
+template class irtkRecursiveGaussianBlurring<unsigned short>;
+template class irtkRecursiveGaussianBlurring<float>;
+template class irtkRecursiveGaussianBlurring<double>;
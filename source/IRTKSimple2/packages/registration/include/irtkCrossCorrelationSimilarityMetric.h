@@ -38,6 +38,9 @@ public:
   /// Add sample
   virtual void Add(int, int);
 
+  /// Add sample without rounding the source intensity
+  virtual void AddSample(int, double);
+
   /// Remove sample
   virtual void Delete(int, int);
 
@@ -81,6 +84,16 @@ inline void irtkCrossCorrelationSimilarityMetric::Add(int x, int y)
   _n++;
 }
 
+inline void irtkCrossCorrelationSimilarityMetric::AddSample(int x, double y)
+{
+  _xy += x*y;
+  _x  += x;
+  _x2 += x*x;
+  _y  += y;
+  _y2 += y*y;
+  _n++;
+}
+
 inline void irtkCrossCorrelationSimilarityMetric::Delete(int x, int y)
 {
   _xy -= x*y;
@@ -26,6 +26,11 @@
 class irtkImageAffineRegistrationWithPadding : public irtkImageRigidRegistrationWithPadding
 {
 
+protected:
+
+  /// The analytic gradient covers the six rigid parameters only
+  virtual bool UseAnalyticGradient();
+
 public:
 
   /** Sets the output for the registration filter. The output must be a affine
@@ -48,6 +53,11 @@ inline const char *irtkImageAffineRegistrationWithPadding::NameOfClass()
   return "irtkImageAffineRegistrationWithPadding";
 }
 
+inline bool irtkImageAffineRegistrationWithPadding::UseAnalyticGradient()
+{
+  return false;
+}
+
 inline void irtkImageAffineRegistrationWithPadding::Print()
 {
   _transformation->Print();
@@ -41,11 +41,13 @@ class irtkImageRegistration : public irtkRegistration
 #ifdef HAS_TBB
 
   friend class irtkMultiThreadedImageRigidRegistrationEvaluate;
-  friend class irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate;
   friend class irtkMultiThreadedImageRigidRegistrationEvaluate2D;
 
 #endif
 
+  friend class irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate;
+  friend class irtkImageRigidRegistrationWithPaddingGradient;
+
   /// Interface to input file stream
   friend istream& operator>> (istream&, irtkImageRegistration*);
 
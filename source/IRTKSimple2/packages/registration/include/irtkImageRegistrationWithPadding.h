@@ -18,23 +18,66 @@
  * Generic for image registration extended by source padding
 **/
 
+class irtkSourcePyramid;
+
 class irtkImageRegistrationWithPadding : public irtkImageRegistration
 {
 
+  friend class irtkSourcePyramid;
+
 protected:
 
   /// Padding value of source image
   short  _SourcePadding;
+
+  /// Prepared source levels shared with other registrations, not owned
+  const irtkSourcePyramid *_SourcePyramid;
+
+  /// Target and source converted from real valued inputs
+  irtkGreyImage _ScaledTarget, _ScaledSource;
+
+  /// Scale of the intensities of real valued inputs
+  double _IntensityScale;
   
   //irtkGreyImage *tmp_target, *tmp_source;
 
+  /** Blur, resample and shift the source for a multiresolution level and
+   *  rescale it to histogram bins if the similarity measure needs them.
+   *  Returns the number of source bins, or 0 for other measures.
+   */
+  virtual int InitializeSource(int, irtkGreyImage *, irtkGreyPixel &, irtkGreyPixel &);
+
+  /// Whether the source gradient is needed at each level
+  virtual bool UseAnalyticGradient();
+
   /// Overload initial set up for the registration at a multiresolution level
   virtual void Initialize(int);
 
 public:
   irtkImageRegistrationWithPadding();
+
+  using irtkImageRegistration::SetInput;
+
+  /** Sets real valued target and source. Both are converted once with a
+   *  common intensity scale which uses half of the grey range, so that
+   *  interpolated intensities and histogram bins keep their precision.
+   *  Padding values are compared with the scaled intensities, padding
+   *  at or below zero is not affected by the scale and negative
+   *  intensities stay at or below -1.
+   */
+  virtual void SetInput(irtkRealImage *, irtkRealImage *);
+
+  /// Scale of the intensities of real valued inputs, 1 for grey inputs
+  virtual GetMacro(IntensityScale, double);
+
+  /** Use the levels of a source pyramid instead of preparing the source
+   *  again. The pyramid must have been built from the same source and with
+   *  the same source parameters, and must outlive the registration.
+   */
+  virtual void SetSourcePyramid(const irtkSourcePyramid *);
 };
 
+#include <irtkSourcePyramid.h>
 #include <irtkImageRigidRegistrationWithPadding.h>
 
 #endif
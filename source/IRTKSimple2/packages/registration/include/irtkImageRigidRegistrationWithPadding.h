@@ -22,11 +22,38 @@
 class irtkImageRigidRegistrationWithPadding : public irtkImageRegistrationWithPadding
 {
 
+  friend class irtkImageRigidRegistrationWithPaddingGradient;
+
 protected:
 
+  /// Compute the gradient of the similarity measure analytically
+  bool _AnalyticGradient;
+
+  /// Gradient of the source image in voxel units, one frame per axis
+  irtkGenericImage<float> *_SourceGradient;
+
+  /// Storage of the source gradient when no source pyramid is shared
+  irtkGenericImage<float> _SourceGradientImage;
+
+  /// Whether the analytic gradient supports the registration settings
+  virtual bool UseAnalyticGradient();
+
+  /// Initial set up for the registration at a multiresolution level
+  virtual void Initialize(int);
+
   /// Evaluate the similarity measure for a given transformation.
   virtual double Evaluate();
 
+  /** Evaluate the gradient of the similarity measure for the current
+   *  transformation. SSD, CC and NMI are differentiated analytically in one
+   *  pass over the target, NMI with a cubic B-spline Parzen window for the
+   *  source. Other measures use finite differences. The pass is a
+   *  parallel_reduce like Evaluate() and runs on the threads of the calling
+   *  task arena, callers limiting the threads run the registration through
+   *  irtkTaskArena::Execute().
+   */
+  virtual double EvaluateGradient(float, float *);
+
   //// Initial set up for the registration
   //virtual void Initialize();
 
@@ -35,6 +62,13 @@ protected:
 
 public:
 
+  /// Constructor
+  irtkImageRigidRegistrationWithPadding();
+
+  /// Switch between the analytic gradient and finite differences
+  virtual SetMacro(AnalyticGradient, bool);
+  virtual GetMacro(AnalyticGradient, bool);
+
   /** Sets the output for the registration filter. The output must be a rigid
    *  transformation. The current parameters of the rigid transformation are
    *  used as initial guess for the rigid registration. After execution of the
@@ -62,6 +96,12 @@ public:
 
 };
 
+inline irtkImageRigidRegistrationWithPadding::irtkImageRigidRegistrationWithPadding()
+{
+  _AnalyticGradient = true;
+  _SourceGradient   = NULL;
+}
+
 inline void irtkImageRigidRegistrationWithPadding::SetOutput(irtkTransformation *transformation)
 {
   if (strcmp(transformation->NameOfClass(), "irtkRigidTransformation") != 0) {
@@ -0,0 +1,377 @@
+/*=========================================================================
+
+  Library   : Image Registration Toolkit (IRTK)
+  Module    : $Id$
+  Copyright : Imperial College, Department of Computing
+              Visual Information Processing (VIP), 2008 onwards
+  Date      : $Date$
+  Version   : $Revision$
+  Changes   : $Author$
+
+=========================================================================*/
+
+#ifndef _IRTKIMAGERIGIDREGISTRATIONWITHPADDINGGRADIENT_H
+
+#define _IRTKIMAGERIGIDREGISTRATIONWITHPADDINGGRADIENT_H
+
+#include <vector>
+
+/**
+ * Analytic gradient of the similarity measure of a rigid registration.
+ *
+ * One pass over the target accumulates the sums of SSD and CC, or the
+ * Parzen window joint histogram of NMI, together with their derivatives
+ * with respect to the rigid parameters. The derivative of a source sample
+ * is the interpolated source image gradient times the derivative of the
+ * transformed position, which is affine in the target voxel. The body can
+ * be run serially or with parallel_reduce over target slices.
+ */
+
+class irtkImageRigidRegistrationWithPaddingGradient
+{
+
+public:
+
+  /// Number of rigid parameters
+  static const int DOFS = 6;
+
+protected:
+
+  /// Pointer to image registration class
+  irtkImageRigidRegistrationWithPadding *_filter;
+
+  /// Target voxel to source voxel transformation
+  double _matrix[3][4];
+
+  /// Its derivatives with respect to the rigid parameters
+  double _derivative[DOFS][3][4];
+
+  /// Number of histogram bins of target and source, NMI only
+  int _nbins_x, _nbins_y;
+
+  /// Cubic B-spline and its derivative
+  static inline double BSpline(double);
+  static inline double BSplineDerivative(double);
+
+public:
+
+  /// Number of samples and sums of target x and source y values
+  double _n, _x, _y, _x2, _y2, _xy;
+
+  /// Sums of the derivatives dy of the source values, of x*dy and of y*dy
+  double _dy[DOFS], _xdy[DOFS], _ydy[DOFS];
+
+  /// Parzen window joint histogram and its derivatives, NMI only
+  std::vector<double> _histogram;
+  std::vector<double> _dhistogram;
+
+  irtkImageRigidRegistrationWithPaddingGradient(irtkImageRigidRegistrationWithPadding *filter);
+
+#ifdef HAS_TBB
+  irtkImageRigidRegistrationWithPaddingGradient(irtkImageRigidRegistrationWithPaddingGradient &r, split);
+
+  void join(irtkImageRigidRegistrationWithPaddingGradient &rhs);
+#endif
+
+  /// Accumulate the samples of target slices k1 to k2-1
+  void Run(int k1, int k2);
+
+#ifdef HAS_TBB
+  void operator()(const blocked_range<int> &r) {
+    this->Run(r.begin(), r.end());
+  }
+#endif
+
+  /// Reset all sums
+  void Reset();
+
+  /// Derivatives of the similarity measure with respect to the rigid parameters
+  void Gradient(double *dx);
+
+};
+
+inline double irtkImageRigidRegistrationWithPaddingGradient::BSpline(double t)
+{
+  t = fabs(t);
+  if (t < 1) return 2.0 / 3.0 - t * t + 0.5 * t * t * t;
+  if (t < 2) return (2 - t) * (2 - t) * (2 - t) / 6.0;
+  return 0;
+}
+
+inline double irtkImageRigidRegistrationWithPaddingGradient::BSplineDerivative(double t)
+{
+  double a = fabs(t);
+  if (a < 1) return -2 * t + 1.5 * t * a;
+  if (a < 2) return (t > 0 ? -0.5 : 0.5) * (2 - a) * (2 - a);
+  return 0;
+}
+
+inline irtkImageRigidRegistrationWithPaddingGradient::irtkImageRigidRegistrationWithPaddingGradient(irtkImageRigidRegistrationWithPadding *filter)
+{
+  int i, j, d;
+
+  _filter = filter;
+
+  // Target voxel to source voxel transformation
+  irtkHomogeneousTransformation *transformation = (irtkHomogeneousTransformation *)_filter->_transformation;
+  irtkMatrix w2s = _filter->_source->GetWorldToImageMatrix();
+  irtkMatrix t2w = _filter->_target->GetImageToWorldMatrix();
+  irtkMatrix m = w2s * transformation->GetMatrix() * t2w;
+  for (i = 0; i < 3; i++) {
+    for (j = 0; j < 4; j++) {
+      _matrix[i][j] = m(i, j);
+    }
+  }
+
+  // The derivative of a transformed world point is affine in the point,
+  // recover it from the Jacobian at the origin and the unit vectors
+  for (d = 0; d < DOFS; d++) {
+    double origin[3], axis[3];
+    irtkMatrix dm(4, 4);
+    transformation->JacobianDOFs(origin, d, 0, 0, 0);
+    for (j = 0; j < 3; j++) {
+      transformation->JacobianDOFs(axis, d, j == 0, j == 1, j == 2);
+      for (i = 0; i < 3; i++) {
+        dm(i, j) = axis[i] - origin[i];
+      }
+    }
+    for (i = 0; i < 3; i++) {
+      dm(i, 3) = origin[i];
+    }
+    m = w2s * dm * t2w;
+    for (i = 0; i < 3; i++) {
+      for (j = 0; j < 4; j++) {
+        _derivative[d][i][j] = m(i, j);
+      }
+    }
+  }
+
+  // Parzen window joint histogram for NMI
+  _nbins_x = _nbins_y = 0;
+  if (_filter->_SimilarityMeasure == NMI) {
+    irtkHistogramSimilarityMetric *metric = dynamic_cast<irtkHistogramSimilarityMetric *>(_filter->_metric);
+    _nbins_x = metric->NumberOfBinsX();
+    _nbins_y = metric->NumberOfBinsY();
+  }
+
+  this->Reset();
+}
+
+#ifdef HAS_TBB
+inline irtkImageRigidRegistrationWithPaddingGradient::irtkImageRigidRegistrationWithPaddingGradient(irtkImageRigidRegistrationWithPaddingGradient &r, split)
+{
+  _filter = r._filter;
+  memcpy(_matrix, r._matrix, sizeof(_matrix));
+  memcpy(_derivative, r._derivative, sizeof(_derivative));
+  _nbins_x = r._nbins_x;
+  _nbins_y = r._nbins_y;
+  this->Reset();
+}
+
+inline void irtkImageRigidRegistrationWithPaddingGradient::join(irtkImageRigidRegistrationWithPaddingGradient &rhs)
+{
+  int d;
+  unsigned int i;
+
+  _n  += rhs._n;
+  _x  += rhs._x;
+  _y  += rhs._y;
+  _x2 += rhs._x2;
+  _y2 += rhs._y2;
+  _xy += rhs._xy;
+  for (d = 0; d < DOFS; d++) {
+    _dy[d]  += rhs._dy[d];
+    _xdy[d] += rhs._xdy[d];
+    _ydy[d] += rhs._ydy[d];
+  }
+  for (i = 0; i < _histogram.size(); i++) {
+    _histogram[i] += rhs._histogram[i];
+  }
+  for (i = 0; i < _dhistogram.size(); i++) {
+    _dhistogram[i] += rhs._dhistogram[i];
+  }
+}
+#endif
+
+inline void irtkImageRigidRegistrationWithPaddingGradient::Reset()
+{
+  int d;
+
+  _n = _x = _y = _x2 = _y2 = _xy = 0;
+  for (d = 0; d < DOFS; d++) {
+    _dy[d] = _xdy[d] = _ydy[d] = 0;
+  }
+  _histogram.assign(_nbins_x * _nbins_y, 0);
+  _dhistogram.assign(DOFS * _nbins_x * _nbins_y, 0);
+}
+
+inline void irtkImageRigidRegistrationWithPaddingGradient::Run(int k1, int k2)
+{
+  int i, j, k, d, l;
+  double s[3], ds[DOFS][3], dy[DOFS];
+
+  irtkGreyImage *target = _filter->_target;
+  // The analytic gradient is only used with linear interpolation
+  irtkLinearInterpolateImageKernel<irtkGreyPixel> interpolator(_filter->_source);
+  const irtkGenericImage<float> &gradient = *_filter->_SourceGradient;
+  int X = gradient.GetX(), Y = gradient.GetY(), Z = gradient.GetZ();
+  int frame = X * Y * Z;
+  const float *pg = gradient.GetPointerToVoxels();
+
+  for (k = k1; k < k2; k++) {
+    irtkGreyPixel *ptr2target = target->GetPointerToVoxels(0, 0, k);
+    for (j = 0; j < target->GetY(); j++) {
+      for (i = 0; i < target->GetX(); i++, ptr2target++) {
+        // Check whether reference point is valid
+        if (*ptr2target < 0) continue;
+
+        // Check whether transformed point is inside source volume
+        for (l = 0; l < 3; l++) {
+          s[l] = _matrix[l][0] * i + _matrix[l][1] * j + _matrix[l][2] * k + _matrix[l][3];
+        }
+        if ((s[0] <= _filter->_source_x1) || (s[0] >= _filter->_source_x2) ||
+            (s[1] <= _filter->_source_y1) || (s[1] >= _filter->_source_y2) ||
+            (s[2] <= _filter->_source_z1) || (s[2] >= _filter->_source_z2)) continue;
+
+        double y = interpolator.EvaluateInside(s[0], s[1], s[2]);
+        if (y < 0) continue;
+
+        // Linear interpolation of the source gradient
+        int x0 = (int)floor(s[0]), y0 = (int)floor(s[1]), z0 = (int)floor(s[2]);
+        double fx = s[0] - x0, fy = s[1] - y0, fz = s[2] - z0;
+        int x1 = (x0 < X - 1) ? x0 + 1 : x0;
+        int y1 = (y0 < Y - 1) ? y0 + 1 : y0;
+        int z1 = (z0 < Z - 1) ? z0 + 1 : z0;
+        int corner[8] = { (z0 * Y + y0) * X + x0, (z0 * Y + y0) * X + x1,
+                          (z0 * Y + y1) * X + x0, (z0 * Y + y1) * X + x1,
+                          (z1 * Y + y0) * X + x0, (z1 * Y + y0) * X + x1,
+                          (z1 * Y + y1) * X + x0, (z1 * Y + y1) * X + x1 };
+        double weight[8] = { (1 - fx) * (1 - fy) * (1 - fz), fx * (1 - fy) * (1 - fz),
+                             (1 - fx) * fy * (1 - fz), fx * fy * (1 - fz),
+                             (1 - fx) * (1 - fy) * fz, fx * (1 - fy) * fz,
+                             (1 - fx) * fy * fz, fx * fy * fz };
+        double g[3] = { 0, 0, 0 };
+        for (l = 0; l < 8; l++) {
+          g[0] += weight[l] * pg[corner[l]];
+          g[1] += weight[l] * pg[corner[l] + frame];
+          g[2] += weight[l] * pg[corner[l] + 2 * frame];
+        }
+
+        // Derivatives of the source value
+        for (d = 0; d < DOFS; d++) {
+          for (l = 0; l < 3; l++) {
+            ds[d][l] = _derivative[d][l][0] * i + _derivative[d][l][1] * j + _derivative[d][l][2] * k + _derivative[d][l][3];
+          }
+          dy[d] = g[0] * ds[d][0] + g[1] * ds[d][1] + g[2] * ds[d][2];
+        }
+
+        double x = *ptr2target;
+        _n++;
+        _x  += x;
+        _y  += y;
+        _x2 += x * x;
+        _y2 += y * y;
+        _xy += x * y;
+        for (d = 0; d < DOFS; d++) {
+          _dy[d]  += dy[d];
+          _xdy[d] += x * dy[d];
+          _ydy[d] += y * dy[d];
+        }
+
+        if (_nbins_x > 0) {
+          // Target bin and source bins within the support of the window,
+          // bins outside the histogram are folded onto its border
+          int a = (int)x;
+          if (a > _nbins_x - 1) a = _nbins_x - 1;
+          int b0 = (int)floor(y);
+          for (l = b0 - 1; l <= b0 + 2; l++) {
+            double w  = BSpline(y - l);
+            double dw = BSplineDerivative(y - l);
+            int b = l;
+            if (b < 0) b = 0;
+            if (b > _nbins_y - 1) b = _nbins_y - 1;
+            int index = b * _nbins_x + a;
+            _histogram[index] += w;
+            for (d = 0; d < DOFS; d++) {
+              _dhistogram[d * _nbins_x * _nbins_y + index] += dw * dy[d];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+inline void irtkImageRigidRegistrationWithPaddingGradient::Gradient(double *dx)
+{
+  int a, b, d;
+
+  for (d = 0; d < DOFS; d++) dx[d] = 0;
+  if (_n == 0) return;
+
+  switch (_filter->_SimilarityMeasure) {
+  case SSD:
+    // -sum (x-y)^2 / n
+    for (d = 0; d < DOFS; d++) {
+      dx[d] = -2 * (_ydy[d] - _xdy[d]) / _n;
+    }
+    break;
+  case CC: {
+    // cov / sqrt(var_x * var_y)
+    double cov  = _xy - _x * _y / _n;
+    double varx = _x2 - _x * _x / _n;
+    double vary = _y2 - _y * _y / _n;
+    if ((varx <= 0) || (vary <= 0)) return;
+    double cc = cov / sqrt(varx * vary);
+    for (d = 0; d < DOFS; d++) {
+      double dcov  = _xdy[d] - _x * _dy[d] / _n;
+      double dvary = 2 * (_ydy[d] - _y * _dy[d] / _n);
+      dx[d] = dcov / sqrt(varx * vary) - 0.5 * cc * dvary / vary;
+    }
+    break;
+  }
+  case NMI: {
+    // (H(X) + H(Y)) / H(X,Y), the window sums to one for each sample so
+    // the derivatives of the probabilities sum to zero
+    int nbins = _nbins_x * _nbins_y;
+    std::vector<double> px(_nbins_x, 0), py(_nbins_y, 0), dpy(_nbins_y);
+    for (b = 0; b < _nbins_y; b++) {
+      for (a = 0; a < _nbins_x; a++) {
+        px[a] += _histogram[b * _nbins_x + a] / _n;
+        py[b] += _histogram[b * _nbins_x + a] / _n;
+      }
+    }
+    double hx = 0, hy = 0, hxy = 0;
+    for (a = 0; a < _nbins_x; a++) {
+      if (px[a] > 0) hx -= px[a] * log(px[a]);
+    }
+    for (b = 0; b < _nbins_y; b++) {
+      if (py[b] > 0) hy -= py[b] * log(py[b]);
+    }
+    for (a = 0; a < nbins; a++) {
+      double p = _histogram[a] / _n;
+      if (p > 0) hxy -= p * log(p);
+    }
+    if (hxy <= 0) return;
+    for (d = 0; d < DOFS; d++) {
+      const double *dp = &_dhistogram[d * nbins];
+      double dhy = 0, dhxy = 0;
+      for (b = 0; b < _nbins_y; b++) {
+        dpy[b] = 0;
+        for (a = 0; a < _nbins_x; a++) {
+          double p = _histogram[b * _nbins_x + a] / _n;
+          dpy[b] += dp[b * _nbins_x + a] / _n;
+          if (p > 0) dhxy -= dp[b * _nbins_x + a] / _n * log(p);
+        }
+        if (py[b] > 0) dhy -= dpy[b] * log(py[b]);
+      }
+      dx[d] = (dhy * hxy - (hx + hy) * dhxy) / (hxy * hxy);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+#endif
@@ -10,9 +10,29 @@
 
 =========================================================================*/
 
-#ifdef HAS_TBB
-
-extern tbb::concurrent_bounded_queue<irtkSimilarityMetric *> sim_queue;
+#ifndef _IRTKMULTITHREADEDIMAGERIGIDREGISTRATIONWITHPADDING_H
+
+#define _IRTKMULTITHREADEDIMAGERIGIDREGISTRATIONWITHPADDING_H
+
+#include <vector>
+
+/**
+ * Evaluation of the similarity metric over blocks of target slices, run
+ * serially or with parallel_reduce.
+ *
+ * Each body accumulates into its own metric, the metrics are combined when
+ * the bodies are joined. The metrics are not taken from sim_queue: several
+ * registrations with different metrics or numbers of bins run concurrently
+ * (stack and package registrations), so a queued metric may not match.
+ * The transformed position of each voxel is computed as in the serial path,
+ * so integer histograms are the same as the serial ones.
+ *
+ * The loop over the target is instantiated for the interpolation kernel.
+ * Linear interpolation uses irtkLinearInterpolateImageKernel on the grey
+ * source, other modes call the interpolator through the generic adapter.
+ * The source positions of a row are collected first and interpolated in
+ * one batch, the samples are added to the metric in the original order.
+ */
 
 class irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate
 {
@@ -23,51 +43,22 @@ class irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate
   /// Pointer to metric
   irtkSimilarityMetric *_metric;
 
-public:
-
-  irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate(irtkImageRigidRegistrationWithPadding *filter) {
-    // Initialize filter
-    _filter = filter;
-
-    // Initialize metric
-    _metric = filter->_metric;
-    _metric->Reset();
-  }
-
-  irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate(irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate &r, split) {
-
-    // Initialize filter
-    _filter = r._filter;
-
-    // Copy similarity metrictry_pop
-//    if (sim_queue.pop_if_present(_metric) == false) {
-    if (sim_queue.try_pop(_metric) == false) {
-      _metric = irtkSimilarityMetric::New(_filter->_metric);
-    }
-
-    // Reset similarity metric
-    _metric->Reset();
-  }
-
-  ~irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate() {
-    if (_metric != _filter->_metric) sim_queue.push(_metric);
-  }
-
-  void join(irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate &rhs) {
-    // Combine metrics
-    _metric->Combine(rhs._metric);
-  }
-
-  void operator()(const blocked_range<int> &r) {
-    int i, j, k, t;
+  /// Accumulate the samples of target slices k1 to k2-1
+  template <class Kernel> void Run(int k1, int k2, const Kernel &kernel) {
+    int i, j, k, t, n, l;
 
     // Create iterator
     irtkHomogeneousTransformationIterator iterator((irtkHomogeneousTransformation *)_filter->_transformation);
 
+    // Target values and source positions of a row
+    int X = _filter->_target->GetX();
+    std::vector<int> x(X);
+    std::vector<double> sx(X), sy(X), sz(X), value(X);
+
     // Loop over all voxels in the target (reference) volume
 
     for (t = 0; t < _filter->_target->GetT(); t++) {
-      for (k = r.begin(); k != r.end(); k++) {
+      for (k = k1; k < k2; k++) {
 
         // Initialize iterator
         iterator.Initialize(_filter->_target, _filter->_source, 0, 0, k);
@@ -76,19 +67,20 @@ public:
         irtkGreyPixel *ptr2target = _filter->_target->GetPointerToVoxels(0, 0, k, t);
 
         for (j = 0; j < _filter->_target->GetY(); j++) {
-          for (i = 0; i < _filter->_target->GetX(); i++) {
+          n = 0;
+          for (i = 0; i < X; i++) {
             // Check whether reference point is valid
             if (*ptr2target >= 0) {
               // Check whether transformed point is inside source volume
               if ((iterator._x > _filter->_source_x1) && (iterator._x < _filter->_source_x2) &&
                   (iterator._y > _filter->_source_y1) && (iterator._y < _filter->_source_y2) &&
                   (iterator._z > _filter->_source_z1) && (iterator._z < _filter->_source_z2)) {
-                // Add sample to metric
-                //_metric->Add(*ptr2target, round(_filter->_interpolator->EvaluateInside(iterator._x, iterator._y, iterator._z, t)));
-                double value = _filter->_interpolator->EvaluateInside(iterator._x, iterator._y, iterator._z, t);
-	            if (value >= 0)
-                  _metric->Add(*ptr2target, round(value));
-             }
+                x[n]  = *ptr2target;
+                sx[n] = iterator._x;
+                sy[n] = iterator._y;
+                sz[n] = iterator._z;
+                n++;
+              }
               iterator.NextX();
             } else {
               // Advance iterator by offset
@@ -98,12 +90,67 @@ public:
             }
             ptr2target++;
           }
+
+          // Add samples to metric
+          kernel.EvaluateInside(n, &sx[0], &sy[0], &sz[0], &value[0], t);
+          for (l = 0; l < n; l++) {
+            if (value[l] >= 0)
+              _metric->AddSample(x[l], value[l]);
+          }
           iterator.NextY();
         }
-        iterator.NextZ();
       }
     }
   }
+
+public:
+
+  irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate(irtkImageRigidRegistrationWithPadding *filter) {
+    // Initialize filter
+    _filter = filter;
+
+    // Initialize metric
+    _metric = filter->_metric;
+    _metric->Reset();
+  }
+
+#ifdef HAS_TBB
+  irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate(irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate &r, split) {
+
+    // Initialize filter
+    _filter = r._filter;
+
+    // Copy similarity metric
+    _metric = irtkSimilarityMetric::New(_filter->_metric);
+
+    // Reset similarity metric
+    _metric->Reset();
+  }
+#endif
+
+  ~irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate() {
+    if (_metric != _filter->_metric) delete _metric;
+  }
+
+#ifdef HAS_TBB
+  void join(irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate &rhs) {
+    // Combine metrics
+    _metric->Combine(rhs._metric);
+  }
+
+  void operator()(const blocked_range<int> &r) {
+    this->Run(r.begin(), r.end());
+  }
+#endif
+
+  /// Accumulate the samples of target slices k1 to k2-1
+  void Run(int k1, int k2) {
+    if (_filter->_InterpolationMode == Interpolation_Linear) {
+      this->Run(k1, k2, irtkLinearInterpolateImageKernel<irtkGreyPixel>(_filter->_source));
+    } else {
+      this->Run(k1, k2, irtkInterpolateImageFunctionKernel(_filter->_interpolator));
+    }
+  }
 };
 
 #endif
@@ -38,6 +38,9 @@ public:
   /// Add sample
   virtual void Add(int, int);
 
+  /// Add sample without rounding the source intensity
+  virtual void AddSample(int, double);
+
   /// Remove sample
   virtual void Delete(int, int);
 
@@ -73,6 +76,12 @@ inline void irtkSSDSimilarityMetric::Add(int x, int y)
   _n++;
 }
 
+inline void irtkSSDSimilarityMetric::AddSample(int x, double y)
+{
+  _ssd += (x-y)*(x-y);
+  _n++;
+}
+
 inline void irtkSSDSimilarityMetric::Delete(int x, int y)
 {
   _ssd -= (x-y)*(x-y);
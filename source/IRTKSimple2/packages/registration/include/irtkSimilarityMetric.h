@@ -39,6 +39,9 @@ public:
   /// Add sample
   virtual void Add(int, int) = 0;
 
+  /// Add sample with an interpolated, real valued source intensity
+  virtual void AddSample(int, double);
+
   /// Remove sample
   virtual void Delete(int, int) = 0;
 
@@ -70,6 +73,11 @@ inline irtkSimilarityMetric::~irtkSimilarityMetric()
 {
 }
 
+inline void irtkSimilarityMetric::AddSample(int x, double y)
+{
+  this->Add(x, round(y));
+}
+
 #include <irtkSSDSimilarityMetric.h>
 #include <irtkCrossCorrelationSimilarityMetric.h>
 //#include <irtkMLSimilarityMetric.h>
@@ -0,0 +1,145 @@
+/*=========================================================================
+
+  Library   : Image Registration Toolkit (IRTK)
+  Module    : $Id$
+  Copyright : Imperial College, Department of Computing
+              Visual Information Processing (VIP), 2008 onwards
+  Date      : $Date$
+  Version   : $Revision$
+  Changes   : $Author$
+
+=========================================================================*/
+
+#ifndef _IRTKSOURCEPYRAMID_H
+
+#define _IRTKSOURCEPYRAMID_H
+
+/**
+ * Multiresolution levels of a registration source prepared once.
+ *
+ * Each level holds the blurred, resampled and shifted source exactly as
+ * irtkImageRegistrationWithPadding prepares it, its number of histogram
+ * bins, an initialized interpolator and, if the registration uses the
+ * analytic gradient, the source gradient. Registrations of many targets
+ * against the same source share the pyramid through SetSourcePyramid()
+ * and only read it, so one pyramid serves concurrent registrations.
+ */
+
+class irtkSourcePyramid : public irtkObject
+{
+
+protected:
+
+  /// Number of levels
+  int _NumberOfLevels;
+
+  /// Similarity measure the levels were prepared for
+  irtkSimilarityMeasure _SimilarityMeasure;
+
+  /// Prepared source of each level
+  irtkGreyImage *_image[MAX_NO_RESOLUTIONS];
+
+  /// Range of the source of each level before shifting
+  irtkGreyPixel _min[MAX_NO_RESOLUTIONS], _max[MAX_NO_RESOLUTIONS];
+
+  /// Number of source bins of each level, 0 if no histogram is used
+  int _nbins[MAX_NO_RESOLUTIONS];
+
+  /// Interpolator of each level
+  irtkInterpolateImageFunction *_interpolator[MAX_NO_RESOLUTIONS];
+
+  /// Source gradient of each level in voxel units, or NULL
+  irtkGenericImage<float> *_gradient[MAX_NO_RESOLUTIONS];
+
+public:
+
+  /// Constructor
+  irtkSourcePyramid();
+
+  /// Destructor
+  virtual ~irtkSourcePyramid();
+
+  /** Prepare all levels of a source with the parameters of a registration,
+   *  which only need to be set up, e.g. with GuessParameterSliceToVolume().
+   */
+  virtual void Initialize(irtkImageRegistrationWithPadding *, irtkGreyImage *);
+
+  /// Free all levels
+  virtual void Clear();
+
+  /// Gradient of a source in voxel units, padding is -1
+  static void Gradient(irtkGreyImage *, irtkGenericImage<float> *);
+
+  /// Number of levels
+  int GetNumberOfLevels() const;
+
+  /// Similarity measure the levels were prepared for
+  irtkSimilarityMeasure GetSimilarityMeasure() const;
+
+  /// Prepared source of a level, must not be modified
+  irtkGreyImage *GetImage(int) const;
+
+  /// Range of the source of a level before shifting
+  irtkGreyPixel GetMin(int) const;
+  irtkGreyPixel GetMax(int) const;
+
+  /// Number of source bins of a level
+  int GetNumberOfBins(int) const;
+
+  /// Interpolator of a level, must not be modified
+  irtkInterpolateImageFunction *GetInterpolator(int) const;
+
+  /// Source gradient of a level, or NULL
+  irtkGenericImage<float> *GetGradient(int) const;
+
+  /// Returns the name of the class
+  virtual const char *NameOfClass();
+
+};
+
+inline int irtkSourcePyramid::GetNumberOfLevels() const
+{
+  return _NumberOfLevels;
+}
+
+inline irtkSimilarityMeasure irtkSourcePyramid::GetSimilarityMeasure() const
+{
+  return _SimilarityMeasure;
+}
+
+inline irtkGreyImage *irtkSourcePyramid::GetImage(int level) const
+{
+  return _image[level];
+}
+
+inline irtkGreyPixel irtkSourcePyramid::GetMin(int level) const
+{
+  return _min[level];
+}
+
+inline irtkGreyPixel irtkSourcePyramid::GetMax(int level) const
+{
+  return _max[level];
+}
+
+inline int irtkSourcePyramid::GetNumberOfBins(int level) const
+{
+  return _nbins[level];
+}
+
+inline irtkInterpolateImageFunction *irtkSourcePyramid::GetInterpolator(int level) const
+{
+  return _interpolator[level];
+}
+
+inline irtkGenericImage<float> *irtkSourcePyramid::GetGradient(int level) const
+{
+  return _gradient[level];
+}
+
+inline const char *irtkSourcePyramid::NameOfClass()
+{
+  return "irtkSourcePyramid";
+}
+
+#endif
@@ -166,6 +166,8 @@ extern void irtkPadding(irtkGreyImage &, irtkGreyPixel);
 //extern void irtkPadding(irtkGreyImage **, irtkGreyPixel, irtkBSplineFreeFormTransformationPeriodic *, int, double*);
 //extern void irtkPadding(irtkGreyImage *, irtkGreyPixel, irtkBSplineFreeFormTransformationPeriodic *, int, double*);
 extern int  irtkCalculateNumberOfBins(irtkGreyImage *, int, int, int);
+extern double irtkCalculateIntensityScale(irtkRealImage *, irtkRealImage * = NULL);
+extern void irtkConvertToGrey(irtkRealImage *, irtkGreyImage *, double);
 extern double GuessResolution(double, double);
 extern double GuessResolution(double, double, double);
 extern int GuessPadding(irtkGreyImage &);
@@ -21,8 +21,119 @@ extern irtkGreyImage *tmp_target, *tmp_source;
 irtkImageRegistrationWithPadding::irtkImageRegistrationWithPadding() : irtkImageRegistration()
 {
   _SourcePadding   = MIN_GREY;
+  _SourcePyramid   = NULL;
+  _IntensityScale  = 1;
 }
 
+void irtkImageRegistrationWithPadding::SetInput(irtkRealImage *target, irtkRealImage *source)
+{
+  if ((target == NULL) || (source == NULL)) {
+    cerr << this->NameOfClass() << "::SetInput: Missing target or source" << endl;
+    exit(1);
+  }
+
+  _IntensityScale = irtkCalculateIntensityScale(target, source);
+  irtkConvertToGrey(target, &_ScaledTarget, _IntensityScale);
+  irtkConvertToGrey(source, &_ScaledSource, _IntensityScale);
+  this->irtkImageRegistration::SetInput(&_ScaledTarget, &_ScaledSource);
+}
+
+
+int irtkImageRegistrationWithPadding::InitializeSource(int level, irtkGreyImage *source,
+    irtkGreyPixel &source_min, irtkGreyPixel &source_max)
+{
+  int i, j, k, t;
+  double dx, dy, dz, temp;
+
+  // Blur image if necessary
+  if (_SourceBlurring[level] > 0) {
+    cout << "Blurring source ... ";
+    irtkGaussianBlurringWithPadding<irtkGreyPixel> blurring(_SourceBlurring[level],_SourcePadding);
+    blurring.SetInput (source);
+    blurring.SetOutput(source);
+    blurring.Run();
+    cout << "done" << endl;
+  }
+
+  source->GetPixelSize(&dx, &dy, &dz);
+  temp = fabs(_SourceResolution[0][0]-dx) + fabs(_SourceResolution[0][1]-dy) + fabs(_SourceResolution[0][2]-dz);
+
+  if (level > 0 || temp > 0.000001) {
+    cout << "Resampling source ... ";
+    // Create resampling filter
+    irtkResamplingWithPadding<irtkGreyPixel> resample(_SourceResolution[level][0],
+        _SourceResolution[level][1],
+        _SourceResolution[level][2], _SourcePadding);
+
+    resample.SetInput (source);
+    resample.SetOutput(source);
+    resample.Run();
+    cout << "done" << endl;
+  }
+
+  // Find out the min and max values in source image, ignoring padding
+  source_max = MIN_GREY;
+  source_min = MAX_GREY;
+  for (t = 0; t < source->GetT(); t++) {
+    for (k = 0; k < source->GetZ(); k++) {
+      for (j = 0; j < source->GetY(); j++) {
+        for (i = 0; i < source->GetX(); i++) {
+          if (source->Get(i, j, k, t) > _SourcePadding){
+            if (source->Get(i, j, k, t) > source_max)
+              source_max = source->Get(i, j, k, t);
+            if (source->Get(i, j, k, t) < source_min)
+              source_min = source->Get(i, j, k, t);
+	  } else {
+	    source->Put(i, j, k, t, _SourcePadding);
+	  }
+        }
+      }
+    }
+  }
+
+  // Check whether dynamic range of data is not to large
+  if (source_max - source_min > MAX_GREY) {
+    cerr << this->NameOfClass()
+         << "::Initialize: Dynamic range of source is too large" << endl;
+    exit(1);
+  } else {
+    for (t = 0; t < source->GetT(); t++) {
+      for (k = 0; k < source->GetZ(); k++) {
+        for (j = 0; j < source->GetY(); j++) {
+          for (i = 0; i < source->GetX(); i++) {
+            if (source->Get(i, j, k, t) > _SourcePadding) {
+              source->Put(i, j, k, t, source->Get(i, j, k, t) - source_min);
+	    } else {
+	      source->Put(i, j, k, t, -1);
+	    }
+          }
+        }
+      }
+    }
+  }
+
+  // Rescale image by an integer factor if necessary
+  switch (_SimilarityMeasure) {
+  case JE:
+  case MI:
+  case NMI:
+  case CR_XY:
+  case CR_YX:
+    return irtkCalculateNumberOfBins(source, _NumberOfBins, source_min, source_max);
+  default:
+    return 0;
+  }
+}
+
+void irtkImageRegistrationWithPadding::SetSourcePyramid(const irtkSourcePyramid *pyramid)
+{
+  _SourcePyramid = pyramid;
+}
+
+bool irtkImageRegistrationWithPadding::UseAnalyticGradient()
+{
+  return false;
+}
 
 void irtkImageRegistrationWithPadding::Initialize(int level)
 {
@@ -31,15 +142,30 @@ void irtkImageRegistrationWithPadding::Initialize(int level)
   irtkGreyPixel target_min, target_max, target_nbins;
   irtkGreyPixel source_min, source_max, source_nbins;
 
-  // Copy source and target to temp space
+  // Copy target to temp space and swap
   tmp_target = new irtkGreyImage(*_target);
-  tmp_source = new irtkGreyImage(*_source);
-
-  // Swap source and target with temp space copies
   swap(tmp_target, _target);
-  swap(tmp_source, _source);
 
-  // Blur images if necessary
+  // Swap source with the shared level of the pyramid or a prepared copy
+  if (_SourcePyramid != NULL) {
+    if ((level >= _SourcePyramid->GetNumberOfLevels()) ||
+        (_SourcePyramid->GetSimilarityMeasure() != _SimilarityMeasure)) {
+      cerr << this->NameOfClass()
+           << "::Initialize: Source pyramid does not match the registration parameters" << endl;
+      exit(1);
+    }
+    tmp_source   = _SourcePyramid->GetImage(level);
+    source_min   = _SourcePyramid->GetMin(level);
+    source_max   = _SourcePyramid->GetMax(level);
+    source_nbins = _SourcePyramid->GetNumberOfBins(level);
+    swap(tmp_source, _source);
+  } else {
+    tmp_source = new irtkGreyImage(*_source);
+    swap(tmp_source, _source);
+    source_nbins = this->InitializeSource(level, _source, source_min, source_max);
+  }
+
+  // Blur image if necessary
   if (_TargetBlurring[level] > 0) {
     cout << "Blurring target ... ";
     irtkGaussianBlurringWithPadding<irtkGreyPixel> blurring(_TargetBlurring[level], _TargetPadding);
@@ -49,15 +175,6 @@ void irtkImageRegistrationWithPadding::Initialize(int level)
     cout << "done" << endl;
   }
 
-  if (_SourceBlurring[level] > 0) {
-    cout << "Blurring source ... ";
-    irtkGaussianBlurringWithPadding<irtkGreyPixel> blurring(_SourceBlurring[level],_SourcePadding);
-    blurring.SetInput (_source);
-    blurring.SetOutput(_source);
-    blurring.Run();
-    cout << "done" << endl;
-  }
-
   _target->GetPixelSize(&dx, &dy, &dz);
   temp = fabs(_TargetResolution[0][0]-dx) + fabs(_TargetResolution[0][1]-dy) + fabs(_TargetResolution[0][2]-dz);
 
@@ -74,22 +191,6 @@ void irtkImageRegistrationWithPadding::Initialize(int level)
     cout << "done" << endl;
   }
 
-  _source->GetPixelSize(&dx, &dy, &dz);
-  temp = fabs(_SourceResolution[0][0]-dx) + fabs(_SourceResolution[0][1]-dy) + fabs(_SourceResolution[0][2]-dz);
-
-  if (level > 0 || temp > 0.000001) {
-    cout << "Resampling source ... ";
-    // Create resampling filter
-    irtkResamplingWithPadding<irtkGreyPixel> resample(_SourceResolution[level][0],
-        _SourceResolution[level][1],
-        _SourceResolution[level][2], _SourcePadding);
-
-    resample.SetInput (_source);
-    resample.SetOutput(_source);
-    resample.Run();
-    cout << "done" << endl;
-  }
-
   // Find out the min and max values in target image, ignoring padding
   target_max = MIN_GREY;
   target_min = MAX_GREY;
@@ -110,26 +211,6 @@ void irtkImageRegistrationWithPadding::Initialize(int level)
     }
   }
 
-  // Find out the min and max values in source image, ignoring padding
-  source_max = MIN_GREY;
-  source_min = MAX_GREY;
-  for (t = 0; t < _source->GetT(); t++) {
-    for (k = 0; k < _source->GetZ(); k++) {
-      for (j = 0; j < _source->GetY(); j++) {
-        for (i = 0; i < _source->GetX(); i++) {
-          if (_source->Get(i, j, k, t) > _SourcePadding){
-            if (_source->Get(i, j, k, t) > source_max)
-              source_max = _source->Get(i, j, k, t);
-            if (_source->Get(i, j, k, t) < source_min)
-              source_min = _source->Get(i, j, k, t);
-	  } else {
-	    _source->Put(i, j, k, t, _SourcePadding);
-	  }
-        }
-      }
-    }
-  }
-
   // Check whether dynamic range of data is not to large
   if (target_max - target_min > MAX_GREY) {
     cerr << this->NameOfClass()
@@ -151,113 +232,45 @@ void irtkImageRegistrationWithPadding::Initialize(int level)
     }
   }
 
-    if (source_max - source_min > MAX_GREY) {
-      cerr << this->NameOfClass()
-           << "::Initialize: Dynamic range of source is too large" << endl;
-      exit(1);
-    } else {
-      for (t = 0; t < _source->GetT(); t++) {
-        for (k = 0; k < _source->GetZ(); k++) {
-          for (j = 0; j < _source->GetY(); j++) {
-            for (i = 0; i < _source->GetX(); i++) {
-              if (_source->Get(i, j, k, t) > _SourcePadding) {
-                _source->Put(i, j, k, t, _source->Get(i, j, k, t) - source_min);
-	      } else {
-		_source->Put(i, j, k, t, -1);  
-	      }
-            }
-          }
-        }
-      }
-    }
-
-/*if ((_SimilarityMeasure == SSD) || (_SimilarityMeasure == CC) ||
-      (_SimilarityMeasure == LC)  || (_SimilarityMeasure == K) || (_SimilarityMeasure == ML)) {
-    if (source_max - target_min > MAX_GREY) {
-      cerr << this->NameOfClass()
-           << "::Initialize: Dynamic range of source is too large" << endl;
-      exit(1);
-    } else {
-      for (t = 0; t < _source->GetT(); t++) {
-        for (k = 0; k < _source->GetZ(); k++) {
-          for (j = 0; j < _source->GetY(); j++) {
-            for (i = 0; i < _source->GetX(); i++) {
-              _source->Put(i, j, k, t, _source->Get(i, j, k, t) - source_min);
-            }
-          }
-        }
-      }
-    }
-  } else {
-  
-    if (source_max - source_min > MAX_GREY) {
-      cerr << this->NameOfClass()
-           << "::Initialize: Dynamic range of source is too large" << endl;
-      exit(1);
-    } else {
-      for (t = 0; t < _source->GetT(); t++) {
-        for (k = 0; k < _source->GetZ(); k++) {
-          for (j = 0; j < _source->GetY(); j++) {
-            for (i = 0; i < _source->GetX(); i++) {
-              _source->Put(i, j, k, t, _source->Get(i, j, k, t) - source_min);
-            }
-          }
-        }
-      }
-    }
-  }
-  */
-
   // Pad target image if necessary
   irtkPadding(*_target, _TargetPadding);
 
-  // Allocate memory for metric
+  // Allocate memory for metric, the source is already rescaled to its bins
   switch (_SimilarityMeasure) {
   case SSD:
     _metric = new irtkSSDSimilarityMetric;
     break;
   case CC:
-    // Rescale images by an integer factor if necessary
     _metric = new irtkCrossCorrelationSimilarityMetric;
     break;
   case JE:
     // Rescale images by an integer factor if necessary
     target_nbins = irtkCalculateNumberOfBins(_target, _NumberOfBins,
                    target_min, target_max);
-    source_nbins = irtkCalculateNumberOfBins(_source, _NumberOfBins,
-                   source_min, source_max);
     _metric = new irtkJointEntropySimilarityMetric(target_nbins, source_nbins);
     break;
   case MI:
     // Rescale images by an integer factor if necessary
     target_nbins = irtkCalculateNumberOfBins(_target, _NumberOfBins,
                    target_min, target_max);
-    source_nbins = irtkCalculateNumberOfBins(_source, _NumberOfBins,
-                   source_min, source_max);
     _metric = new irtkMutualInformationSimilarityMetric(target_nbins, source_nbins);
     break;
   case NMI:
     // Rescale images by an integer factor if necessary
     target_nbins = irtkCalculateNumberOfBins(_target, _NumberOfBins,
                    target_min, target_max);
-    source_nbins = irtkCalculateNumberOfBins(_source, _NumberOfBins,
-                   source_min, source_max);
     _metric = new irtkNormalisedMutualInformationSimilarityMetric(target_nbins, source_nbins);
     break;
   case CR_XY:
     // Rescale images by an integer factor if necessary
     target_nbins = irtkCalculateNumberOfBins(_target, _NumberOfBins,
                    target_min, target_max);
-    source_nbins = irtkCalculateNumberOfBins(_source, _NumberOfBins,
-                   source_min, source_max);
     _metric = new irtkCorrelationRatioXYSimilarityMetric(target_nbins, source_nbins);
     break;
   case CR_YX:
     // Rescale images by an integer factor if necessary
     target_nbins = irtkCalculateNumberOfBins(_target, _NumberOfBins,
                    target_min, target_max);
-    source_nbins = irtkCalculateNumberOfBins(_source, _NumberOfBins,
-                   source_min, source_max);
     _metric = new irtkCorrelationRatioYXSimilarityMetric(target_nbins, source_nbins);
     break;
   case LC:
@@ -268,8 +281,6 @@ void irtkImageRegistrationWithPadding::Initialize(int level)
     // Rescale images by an integer factor if necessary
     target_nbins = irtkCalculateNumberOfBins(_target, _NumberOfBins,
                    target_min, target_max);
-    source_nbins = irtkCalculateNumberOfBins(_source, _NumberOfBins,
-                   source_min, source_max);
     _metric = new irtkKappaSimilarityMetric(target_nbins, source_nbins);
     break;
 #endif
@@ -282,13 +293,18 @@ void irtkImageRegistrationWithPadding::Initialize(int level)
     break;
   }
 
-  // Setup the interpolator - currently only linear supported
-  //_interpolator = irtkInterpolateImageFunction::New(Interpolation_Linear, _source);
-  _interpolator = irtkInterpolateImageFunction::New(_InterpolationMode, _source);
+  if (_SourcePyramid != NULL) {
+    // The interpolator of a shared level is only read
+    _interpolator = _SourcePyramid->GetInterpolator(level);
+  } else {
+    // Setup the interpolator - currently only linear supported
+    //_interpolator = irtkInterpolateImageFunction::New(Interpolation_Linear, _source);
+    _interpolator = irtkInterpolateImageFunction::New(_InterpolationMode, _source);
 
-  // Setup interpolation for the source image
-  _interpolator->SetInput(_source);
-  _interpolator->Initialize();
+    // Setup interpolation for the source image
+    _interpolator->SetInput(_source);
+    _interpolator->Initialize();
+  }
 
   // Calculate the source image domain in which we can interpolate
   _interpolator->Inside(_source_x1, _source_y1, _source_z1,
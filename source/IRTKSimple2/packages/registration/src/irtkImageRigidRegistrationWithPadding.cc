@@ -18,6 +18,8 @@
 
 #include <irtkMultiThreadedImageRigidRegistrationWithPadding.h>
 
+#include <irtkImageRigidRegistrationWithPaddingGradient.h>
+
 void irtkImageRigidRegistrationWithPadding::GuessParameter()
 {
   int i;
@@ -533,74 +535,22 @@ void irtkImageRigidRegistrationWithPadding::Finalize()
 */
 double irtkImageRigidRegistrationWithPadding::Evaluate()
 {
-
-//  #ifndef HAS_TBB
-  int i, j, k, t;
-//  #endif
-
-  // Pointer to reference data
-  irtkGreyPixel *ptr2target;
-
   // Print debugging information
   this->Debug("irtkImageRigidRegistrationWithPadding::Evaluate");
 
   // Invert transformation
   //((irtkRigidTransformation *)_transformation)->Invert();
 
-  // Create iterator
-  irtkHomogeneousTransformationIterator
-  iterator((irtkHomogeneousTransformation *)_transformation);
-
   // Initialize metric
   _metric->Reset();
 
-  // Pointer to voxels in target image
-  ptr2target = _target->GetPointerToVoxels();
-
-// #ifdef HAS_TBB
-//   irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate evaluate(this);
-//   parallel_reduce(blocked_range<int>(0, _target->GetZ(), 20), evaluate);
-// #else
-
-
-  for (t = 0; t < _target->GetT(); t++) {
-
-    // Initialize iterator
-    iterator.Initialize(_target, _source);
-
-    // Loop over all voxels in the target (reference) volume
-    for (k = 0; k < _target->GetZ(); k++) {
-      for (j = 0; j < _target->GetY(); j++) {
-        for (i = 0; i < _target->GetX(); i++) {
-          // Check whether reference point is valid
-          if (*ptr2target >= 0) {
-            // Check whether transformed point is inside source volume
-            if ((iterator._x > _source_x1) && (iterator._x < _source_x2) &&
-                (iterator._y > _source_y1) && (iterator._y < _source_y2) &&
-                (iterator._z > _source_z1) && (iterator._z < _source_z2)) {
-              // Add sample to metric. Note: only linear interpolation supported at present
-	      //double value = (static_cast<irtkLinearInterpolateImageFunction*> (_interpolator))->EvaluateWithPadding(-1,iterator._x, iterator._y, iterator._z, t);
-	      double value = _interpolator->EvaluateInside(iterator._x, iterator._y, iterator._z, t);
-	      if (value >= 0)
-                _metric->Add(*ptr2target, round(value));
-            }
-            iterator.NextX();
-          } else {
-            // Advance iterator by offset
-            iterator.NextX(*ptr2target * -1);
-            i          -= (*ptr2target) + 1;
-            ptr2target -= (*ptr2target) + 1;
-          }
-          ptr2target++;
-        }
-        iterator.NextY();
-      }
-      iterator.NextZ();
-    }
-  }
-
-//  #endif
-
+  irtkMultiThreadedImageRigidRegistrationWithPaddingEvaluate evaluate(this);
+#ifdef HAS_TBB
+  // Stacks have few slices, a block of one slice still has enough voxels
+  parallel_reduce(blocked_range<int>(0, _target->GetZ(), 1), evaluate);
+#else
+  evaluate.Run(0, _target->GetZ());
+#endif
 
   // Invert transformation
   //((irtkRigidTransformation *)_transformation)->Invert();
@@ -608,3 +558,74 @@ double irtkImageRigidRegistrationWithPadding::Evaluate()
   // Evaluate similarity measure
   return _metric->Evaluate();
 }
+
+bool irtkImageRigidRegistrationWithPadding::UseAnalyticGradient()
+{
+  return _AnalyticGradient &&
+         ((_SimilarityMeasure == SSD) || (_SimilarityMeasure == CC) || (_SimilarityMeasure == NMI)) &&
+         (_InterpolationMode == Interpolation_Linear) &&
+         (_target->GetT() == 1) && (_source->GetT() == 1);
+}
+
+void irtkImageRigidRegistrationWithPadding::Initialize(int level)
+{
+  // Call base class
+  this->irtkImageRegistrationWithPadding::Initialize(level);
+
+  _SourceGradient = NULL;
+  if (this->UseAnalyticGradient() == false) return;
+
+  // Gradient of the source image once per level
+  if (_SourcePyramid != NULL) {
+    _SourceGradient = _SourcePyramid->GetGradient(level);
+  }
+  if (_SourceGradient == NULL) {
+    irtkSourcePyramid::Gradient(_source, &_SourceGradientImage);
+    _SourceGradient = &_SourceGradientImage;
+  }
+}
+
+double irtkImageRigidRegistrationWithPadding::EvaluateGradient(float step, float *dx)
+{
+  int i;
+  double norm, gradient[irtkImageRigidRegistrationWithPaddingGradient::DOFS];
+
+  if ((this->UseAnalyticGradient() == false) || (_SourceGradient == NULL)) {
+    return this->irtkImageRegistration::EvaluateGradient(step, dx);
+  }
+
+  // Print debugging information
+  this->Debug("irtkImageRigidRegistrationWithPadding::EvaluateGradient");
+
+  irtkImageRigidRegistrationWithPaddingGradient evaluate(this);
+#ifdef HAS_TBB
+  // Same blocks as Evaluate(), in the task arena of the caller
+  parallel_reduce(blocked_range<int>(0, _target->GetZ(), 1), evaluate);
+#else
+  evaluate.Run(0, _target->GetZ());
+#endif
+  evaluate.Gradient(gradient);
+
+  // Scale as the central differences of the base class, s(p+step)-s(p-step)
+  norm = 0;
+  for (i = 0; i < _transformation->NumberOfDOFs(); i++) {
+    if (_transformation->irtkTransformation::GetStatus(i) == _Active) {
+      dx[i] = 2 * step * gradient[i];
+    } else {
+      dx[i] = 0;
+    }
+    norm += dx[i] * dx[i];
+  }
+
+  // Normalize vector
+  norm = sqrt(norm);
+  for (i = 0; i < _transformation->NumberOfDOFs(); i++) {
+    if (norm > 0) {
+      dx[i] /= norm;
+    } else {
+      dx[i] = 0;
+    }
+  }
+
+  return norm;
+}
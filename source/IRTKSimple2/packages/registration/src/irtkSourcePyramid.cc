@@ -0,0 +1,105 @@
+/*=========================================================================
+
+  Library   : Image Registration Toolkit (IRTK)
+  Module    : $Id$
+  Copyright : Imperial College, Department of Computing
+              Visual Information Processing (VIP), 2008 onwards
+  Date      : $Date$
+  Version   : $Revision$
+  Changes   : $Author$
+
+=========================================================================*/
+
+#include <irtkRegistration.h>
+
+#include <irtkSourcePyramid.h>
+
+#include <irtkGradientImageFilter.h>
+
+irtkSourcePyramid::irtkSourcePyramid()
+{
+  int i;
+
+  _NumberOfLevels    = 0;
+  _SimilarityMeasure = NMI;
+  for (i = 0; i < MAX_NO_RESOLUTIONS; i++) {
+    _image[i]        = NULL;
+    _min[i]          = 0;
+    _max[i]          = 0;
+    _nbins[i]        = 0;
+    _interpolator[i] = NULL;
+    _gradient[i]     = NULL;
+  }
+}
+
+irtkSourcePyramid::~irtkSourcePyramid()
+{
+  this->Clear();
+}
+
+void irtkSourcePyramid::Clear()
+{
+  int i;
+
+  for (i = 0; i < _NumberOfLevels; i++) {
+    delete _interpolator[i];
+    delete _gradient[i];
+    delete _image[i];
+    _image[i]        = NULL;
+    _interpolator[i] = NULL;
+    _gradient[i]     = NULL;
+  }
+  _NumberOfLevels = 0;
+}
+
+void irtkSourcePyramid::Initialize(irtkImageRegistrationWithPadding *registration, irtkGreyImage *source)
+{
+  int level;
+
+  this->Clear();
+
+  if (source == NULL) {
+    cerr << "irtkSourcePyramid::Initialize: No source image" << endl;
+    exit(1);
+  }
+
+  _NumberOfLevels    = registration->_NumberOfLevels;
+  _SimilarityMeasure = registration->_SimilarityMeasure;
+
+  for (level = 0; level < _NumberOfLevels; level++) {
+    _image[level] = new irtkGreyImage(*source);
+    _nbins[level] = registration->InitializeSource(level, _image[level], _min[level], _max[level]);
+
+    // Setup interpolation for the source image
+    _interpolator[level] = irtkInterpolateImageFunction::New(registration->_InterpolationMode, _image[level]);
+    _interpolator[level]->SetInput(_image[level]);
+    _interpolator[level]->Initialize();
+
+    if (registration->UseAnalyticGradient()) {
+      _gradient[level] = new irtkGenericImage<float>;
+      this->Gradient(_image[level], _gradient[level]);
+    }
+  }
+}
+
+void irtkSourcePyramid::Gradient(irtkGreyImage *source, irtkGenericImage<float> *output)
+{
+  int i, n;
+
+  // Gradient in mm, padding is -1
+  irtkGenericImage<float> image(*source);
+  irtkGradientImageFilter<float> gradient(irtkGradientImageFilter<float>::GRADIENT_VECTOR);
+  gradient.SetInput(&image);
+  gradient.SetOutput(output);
+  gradient.SetPadding(-1);
+  gradient.Run();
+
+  // Convert from mm to voxel units
+  n = source->GetNumberOfVoxels();
+  float *ptr = output->GetPointerToVoxels();
+  for (i = 0; i < n; i++) {
+    ptr[i]         *= source->GetXSize();
+    ptr[i + n]     *= source->GetYSize();
+    ptr[i + 2 * n] *= source->GetZSize();
+  }
+}
@@ -473,6 +473,55 @@ int irtkCalculateNumberOfBins(irtkGreyImage *image, int maxbin, int min, int max
     return nbins;
 }
 
+double irtkCalculateIntensityScale(irtkRealImage *image1, irtkRealImage *image2)
+{
+    int i;
+    double max;
+    irtkRealPixel *ptr;
+
+    // Find the largest absolute intensity of both images
+    max = 0;
+    ptr = image1->GetPointerToVoxels();
+    for (i = 0; i < image1->GetNumberOfVoxels(); i++) {
+        if (fabs(*ptr) > max) max = fabs(*ptr);
+        ptr++;
+    }
+    if (image2 != NULL) {
+        ptr = image2->GetPointerToVoxels();
+        for (i = 0; i < image2->GetNumberOfVoxels(); i++) {
+            if (fabs(*ptr) > max) max = fabs(*ptr);
+            ptr++;
+        }
+    }
+
+    // Map it to half of the grey range, the other half leaves room for
+    // intensities of other images converted with the same scale
+    if (max == 0) return 1;
+    return MAX_GREY / 2 / max;
+}
+
+void irtkConvertToGrey(irtkRealImage *input, irtkGreyImage *output, double scale)
+{
+    int i;
+    double value;
+
+    output->Initialize(input->GetImageAttributes());
+
+    // Scale and round intensities, clamped to the grey range. Negative
+    // intensities are padding and stay at or below -1 for scales below 0.5
+    irtkRealPixel *ptr1 = input->GetPointerToVoxels();
+    irtkGreyPixel *ptr2 = output->GetPointerToVoxels();
+    for (i = 0; i < input->GetNumberOfVoxels(); i++) {
+        value = round(*ptr1 * scale);
+        if ((*ptr1 < 0) && (value > -1)) value = -1;
+        if (value < MIN_GREY) value = MIN_GREY;
+        if (value > MAX_GREY) value = MAX_GREY;
+        *ptr2 = value;
+        ptr1++;
+        ptr2++;
+    }
+}
+
 int read_line(istream &in, char *buffer1, char *&buffer2)
 {
     char c;
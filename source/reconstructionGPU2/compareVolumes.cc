@@ -0,0 +1,105 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#include <irtkImage.h>
+
+#include <cmath>
+#include <iostream>
+
+//compares a reconstruction against a reference, e.g. a single precision
+//build against the double precision one
+
+void usage()
+{
+  cerr << "Usage: compareVolumes [reference] [volume] <mask>\n\n";
+  cerr << "Reports the difference of [volume] to [reference] over the voxels of <mask>,\n";
+  cerr << "or over all voxels which are not padding (-1) in [reference].\n\n";
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    usage();
+  }
+
+  //read in double precision independent of irtkRealPixel
+  irtkGenericImage<double> reference, volume, mask;
+  reference.Read(argv[1]);
+  volume.Read(argv[2]);
+  bool have_mask = (argc > 3);
+  if (have_mask)
+    mask.Read(argv[3]);
+
+  if (!(reference.GetImageAttributes() == volume.GetImageAttributes())) {
+    cerr << "Reference and volume have different dimensions." << endl;
+    exit(1);
+  }
+  if (have_mask && (mask.GetNumberOfVoxels() != reference.GetNumberOfVoxels())) {
+    cerr << "Mask has a different number of voxels." << endl;
+    exit(1);
+  }
+
+  double *pr = reference.GetPointerToVoxels();
+  double *pv = volume.GetPointerToVoxels();
+  double *pm = have_mask ? mask.GetPointerToVoxels() : NULL;
+
+  int num = 0;
+  double min = 0, max = 0;
+  double max_diff = 0, sum_abs = 0, sum_sq = 0, sum_ref_sq = 0;
+  for (int i = 0; i < reference.GetNumberOfVoxels(); i++) {
+    bool inside = have_mask ? (pm[i] > 0) : (pr[i] != -1);
+    if (!inside)
+      continue;
+
+    double diff = fabs(pv[i] - pr[i]);
+    if ((num == 0) || (pr[i] < min)) min = pr[i];
+    if ((num == 0) || (pr[i] > max)) max = pr[i];
+    if (diff > max_diff) max_diff = diff;
+    sum_abs += diff;
+    sum_sq += diff * diff;
+    sum_ref_sq += pr[i] * pr[i];
+    num++;
+  }
+
+  if (num == 0) {
+    cerr << "No voxels to compare." << endl;
+    exit(1);
+  }
+
+  double rms = sqrt(sum_sq / num);
+  cout << "Voxels compared:        " << num << endl;
+  cout << "Reference range:        " << min << " .. " << max << endl;
+  cout << "Max absolute error:     " << max_diff << endl;
+  cout << "Mean absolute error:    " << sum_abs / num << endl;
+  cout << "RMS error:              " << rms << endl;
+  if (sum_ref_sq > 0)
+    cout << "Relative RMS error:     " << rms / sqrt(sum_ref_sq / num) << endl;
+  if ((rms > 0) && (max > min))
+    cout << "PSNR:                   " << 20 * log10((max - min) / rms) << " dB" << endl;
+
+  return EXIT_SUCCESS;
+}
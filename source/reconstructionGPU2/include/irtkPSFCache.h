@@ -0,0 +1,96 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#ifndef _irtkPSFCache_H
+#define _irtkPSFCache_H
+
+#include <irtkImage.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+/*
+
+Cache of discretized slice PSFs
+
+The PSF only depends on the slice voxel size, the resolution of the
+reconstructed volume and the quality factor, so all slices of a stack share
+one kernel. Besides the normalized PSF samples the kernel stores their
+offsets in slice image coordinates, so a slice only needs to add its pixel
+position and apply its own transformation.
+
+*/
+
+struct irtkPSFKernel
+{
+  /// Discretized PSF in slice space, normalized to sum 1
+  irtkRealImage PSF;
+
+  /// Number of PSF samples in each direction
+  int xDim, yDim, zDim;
+
+  /// Size of the transformed PSF in volume voxels
+  int dim;
+
+  /// PSF values, one per sample in loop order x, y, z (z fastest)
+  std::vector<double> values;
+
+  /// Sample offsets in slice image coordinates, three per sample
+  std::vector<double> offsets;
+};
+
+class irtkPSFCache
+{
+
+protected:
+
+  struct Key
+  {
+    double dx, dy, dz, res, quality;
+    bool operator<(const Key& k) const;
+  };
+
+  /// Kernels built so far, entries are never removed
+  std::map<Key, irtkPSFKernel> _kernels;
+
+  /// Guards _kernels
+  std::mutex _mutex;
+
+  /// Build the kernel for a slice voxel size and a volume resolution
+  static void Build(irtkPSFKernel& kernel, double dx, double dy, double dz, double res, double quality);
+
+public:
+
+  /// Kernel for slice voxel size (dx,dy,dz), volume resolution res and quality factor. Thread safe.
+  const irtkPSFKernel& Get(double dx, double dy, double dz, double res, double quality);
+
+  /// Number of kernels in the cache
+  int GetNumberOfKernels();
+
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#ifndef _irtkProfiler_H
+#define _irtkProfiler_H
+
+#include <irtkParallel.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+
+Hierarchical profiler of the CPU reconstruction
+
+Stages are timed by irtkProfileScope objects. A scope opened while another
+one is open on the same thread becomes its child, stages are identified by
+their path, e.g. "Iteration/Superresolution/ParallelSuperresolution".
+Counters (slices, coefficients, voxels, bytes, ...) added with Count() belong
+to the innermost open scope of the calling thread.
+
+Parallel stages additionally record the time every thread spends in the
+body of the loop. The rest of the wall time of the stage times the number of
+threads of the arena is reported as idle time.
+
+Nothing is recorded unless the profiler was enabled. Results are written as
+a JSON summary per stage and as a Chrome trace (chrome://tracing or
+ui.perfetto.dev) with one row per thread.
+
+*/
+
+class irtkProfiler
+{
+
+  struct Stage
+  {
+    int calls;
+    double total, min, max;
+    std::map<std::string, double> counters;
+    /// Busy time of each thread in the loops of the stage
+    std::map<int, double> busy;
+    /// Wall time of the loops times the number of threads minus busy time
+    double idle;
+    Stage() : calls(0), total(0), min(0), max(0), idle(0) { }
+  };
+
+  struct Event
+  {
+    std::string name;
+    int thread;
+    double start, duration;
+  };
+
+  static bool _enabled;
+  static std::mutex _mutex;
+  static std::map<std::string, Stage> _stages;
+  static std::vector<Event> _events;
+
+public:
+
+  /// Start recording
+  static void Enable();
+
+  /// Whether stages are recorded
+  static bool IsEnabled();
+
+  /// Microseconds since the profiler was enabled
+  static double Now();
+
+  /// Small number identifying the calling thread, 0 for the first one
+  static int ThreadId();
+
+  /// Path of the innermost open scope of the calling thread
+  static const std::string& CurrentPath();
+
+  /// Add to a counter of the innermost open scope of the calling thread
+  static void Count(const char* counter, double value);
+
+  /// Write the summary of all stages
+  static void WriteJSON(const char* filename);
+
+  /// Write all scopes and loop chunks in Chrome trace event format
+  static void WriteChromeTrace(const char* filename);
+
+  friend class irtkProfileScope;
+
+};
+
+/// Times a stage until it goes out of scope, a no-op if the profiler is off
+class irtkProfileScope
+{
+  bool _active;
+  std::string _name;
+  double _start;
+  /// Threads of a parallel stage, 0 for serial ones
+  int _threads;
+  std::map<int, double> _busy;
+
+  irtkProfileScope(const irtkProfileScope&);
+  irtkProfileScope& operator=(const irtkProfileScope&);
+
+public:
+
+  /// Open a scope, threads > 0 (or task_arena::automatic) for a parallel loop
+  explicit irtkProfileScope(const char* name, int threads = 0);
+
+  ~irtkProfileScope();
+
+  /// Record a chunk of the loop body executed by the calling thread, opens
+  /// the path of this scope on that thread while body runs
+  template <class Body, class Range>
+  void Chunk(Body& body, const Range& range);
+
+};
+
+/// parallel_for body that records its chunks in a scope
+template <class Body>
+class irtkProfiledBody
+{
+  const Body& _body;
+  irtkProfileScope& _scope;
+public:
+  irtkProfiledBody(const Body& body, irtkProfileScope& scope) : _body(body), _scope(scope) { }
+
+  template <class Range>
+  void operator()(const Range& range) const
+  {
+    _scope.Chunk(_body, range);
+  }
+};
+
+/// parallel_reduce body that records its chunks in a scope
+template <class Body>
+class irtkProfiledReduceBody
+{
+  Body *_body;
+  bool _owner;
+  irtkProfileScope& _scope;
+
+  irtkProfiledReduceBody& operator=(const irtkProfiledReduceBody&);
+
+public:
+  irtkProfiledReduceBody(Body& body, irtkProfileScope& scope) : _body(&body), _owner(false), _scope(scope) { }
+
+  irtkProfiledReduceBody(irtkProfiledReduceBody& x, split) :
+    _body(new Body(*x._body, split())), _owner(true), _scope(x._scope) { }
+
+  ~irtkProfiledReduceBody()
+  {
+    if (_owner)
+      delete _body;
+  }
+
+  template <class Range>
+  void operator()(const Range& range)
+  {
+    _scope.Chunk(*_body, range);
+  }
+
+  void join(irtkProfiledReduceBody& y)
+  {
+    _body->join(*y._body);
+  }
+};
+
+namespace irtkProfilerDetail
+{
+  /// Open scope paths of the calling thread
+  std::vector<std::string>& Stack();
+}
+
+template <class Body, class Range>
+void irtkProfileScope::Chunk(Body& body, const Range& range)
+{
+  std::vector<std::string>& stack = irtkProfilerDetail::Stack();
+  //counters and scopes inside the body belong to this stage
+  bool nested = stack.empty() || (stack.back() != _name);
+  if (nested)
+    stack.push_back(_name);
+  double start = irtkProfiler::Now();
+  body(range);
+  double duration = irtkProfiler::Now() - start;
+  if (nested)
+    stack.pop_back();
+
+  int thread = irtkProfiler::ThreadId();
+  std::lock_guard<std::mutex> lock(irtkProfiler::_mutex);
+  _busy[thread] += duration;
+  irtkProfiler::Event event;
+  event.name = _name.substr(_name.rfind('/') + 1);
+  event.thread = thread;
+  event.start = start;
+  event.duration = duration;
+  irtkProfiler::_events.push_back(event);
+}
+
+#endif
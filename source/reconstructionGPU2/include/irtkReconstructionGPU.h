@@ -31,11 +31,19 @@
 #include <irtkImage.h>
 #include <irtkTransformation.h>
 #include <irtkGaussianBlurring.h>
+#include <irtkRecursiveGaussianBlurring.h>
+#include <irtkBatchGaussianBlurring2D.h>
 
 #include "reconstruction_cuda2.cuh"
+#include "irtkSliceCoeffs.h"
+#include "irtkVolumeCoeffs.h"
+#include "irtkVoxelRuns.h"
+#include "irtkSliceStates.h"
+#include "irtkPSFCache.h"
 
 
 #include <vector>
+#include <map>
 using namespace std;
 
 /*
@@ -55,20 +63,76 @@ double value;
 //typedef std::vector<POINT3D> VOXELCOEFFS; 
 //typedef std::vector<std::vector<VOXELCOEFFS> > SLICECOEFFS;
 
+/// Volumes summing contributions of all slices stay in double precision,
+/// also when irtkRealPixel is float (IRTK_SINGLE_PRECISION)
+typedef irtkGenericImage<double> irtkAccumImage;
+
 class irtkReconstruction : public irtkObject
 {
 
 protected:
 
   //Structures to store the matrix of transformation between volume and slices
-  std::vector<SLICECOEFFS> _volcoeffs;
+  std::vector<irtkSliceCoeffs> _volcoeffs;
+  /// Transpose of _volcoeffs, only built for gather-based superresolution
+  irtkVolumeCoeffs _voxelcoeffs;
+  /// Gather superresolution updates per voxel instead of scattering per slice
+  bool _gather_superresolution;
+  /// Solve each superresolution step with preconditioned conjugate gradients
+  bool _cg_superresolution;
+  /// Iteration limit and relative residual tolerance of the CG solver
+  int _cg_max_iterations;
+  double _cg_tolerance;
+  /// Iterations done by the last CG solve
+  int _cg_iterations;
+  /// Measure how much each superresolution iteration changes the volume and the EM fit
+  bool _adaptive_stopping;
+  /// Relative volume update and change of the mean EM log-likelihood below which
+  /// the superresolution iterations are converged
+  double _stop_update_tolerance;
+  double _stop_em_tolerance;
+  /// Relative volume update of the last superresolution step
+  double _sr_update;
+  /// Mean EM log-likelihood of the last M step, its change to the one before
+  /// and whether there was a previous M step since InitializeRobustStatistics
+  double _em_objective;
+  double _em_change;
+  bool _em_objective_valid;
+  /// Transformations the slice-volume matrix of each slice was computed with
+  vector<irtkRigidTransformation> _coeffs_transformations;
+  /// Quality factor and volume geometry the slice-volume matrix was computed for
+  double _coeffs_quality_factor;
+  irtkImageAttributes _coeffs_attr;
+  /// Largest change in translation (mm) and rotation (degrees) for which the matrix of a slice is reused
+  double _coeffs_translation_tolerance;
+  double _coeffs_rotation_tolerance;
+  /// Number of slices whose matrix was reused by the last CoeffInit
+  int _coeffs_reused;
+  /// Discretized PSFs shared by slices of equal voxel size
+  irtkPSFCache _psf_cache;
+  /// Images allocated by the CPU EM steps since the last reset
+  int _slice_allocations;
+  /// Memory (bytes) the slice-volume matrix may keep resident, 0 for no limit
+  double _memory_budget;
+  /// Directory of the spill file
+  string _spill_dir;
+  /// File holding the spilled slice-volume matrix
+  irtkSpillFile _coeff_spill;
+  /// First slice of each batch processed while the matrix is spilled, followed by the number of slices
+  vector<size_t> _slice_batches;
+  /// Worker threads of the CPU functors, started once and reused by every stage
+  irtkTaskArena _arena;
+  /// One thread per GPU for the GPU slice-to-volume registration
+  irtkTaskArena _device_arena;
+  /// Minimum number of loop iterations per task of each CPU stage, 1 if not set
+  map<string, size_t> _grain_sizes;
 
   //SLICES
   /// Slices
   vector<irtkRealImage> _slices;
-  vector<irtkRealImage> _simulated_slices;
-  vector<irtkRealImage> _simulated_weights;
-  vector<irtkRealImage> _simulated_inside;
+  /// Voxel posteriors, bias fields, simulated slices and their weights and
+  /// inside flags of all slices, packed in one arena
+  irtkSliceStates _slice_states;
 
   vector<irtkRealImage> _slices_resampled;
 
@@ -90,6 +154,14 @@ protected:
   bool _template_created;
   /// Volume mask
   irtkRealImage _mask;
+  /// Volume mask at template resolution, for reconstructing at other resolutions
+  irtkRealImage _template_mask;
+  /// Runs of the voxels inside the mask
+  irtkVoxelRuns _mask_runs;
+  /// Runs of the voxels the slices can contribute to, the mask dilated by the
+  /// reach of the trilinear PSF interpolation in CoeffInit. Nothing outside
+  /// changes in the superresolution steps
+  irtkVoxelRuns _active_runs;
 
   /// Flag to say whether we have a mask
   bool _have_mask;
@@ -125,8 +197,6 @@ protected:
   float _mix_s_gpu;
   /// Step size for likelihood calculation
   double _step;
-  /// Voxel posteriors
-  vector<irtkRealImage> _weights;
   ///Slice posteriors
   vector<double> _slice_weight_cpu;
   vector<float> _slice_weight_gpu;
@@ -136,8 +206,9 @@ protected:
   double _sigma_bias;
   /* /// Blurring object for bias field */
   /* irtkGaussianBlurring<irtkRealPixel>* _gb; */
-  /// Slice-dependent bias fields
-  vector<irtkRealImage> _bias;
+  /// Blur for bias estimation with the recursive Gaussian instead of the
+  /// convolution, constant cost per voxel regardless of _sigma_bias
+  bool _recursive_bias_blurring;
 
   ///Slice-dependent scales
   vector<double> _scale_cpu;
@@ -194,6 +265,66 @@ protected:
   ///Uniform PDF
   inline double M(double m);
 
+  ///Whether a slice moved beyond the tolerance since its matrix was computed
+  bool CoeffsMoved(int inputIndex);
+
+  ///Runs of the mask and of the voxels reachable by the slices, after the mask
+  ///or the volume grid changed
+  void InitializeMaskRuns();
+
+  ///Resample the mask from template resolution to a volume grid and reset
+  ///the volume sized images of the previous grid
+  void InitializeResolution(const irtkImageAttributes& attr);
+
+  ///Bytes of slice-volume matrix coefficients not yet spilled
+  size_t ResidentCoeffsSize();
+
+  ///Move coefficients still in memory to the spill file
+  void SpillResidentCoeffs();
+
+  ///Map the spill file, compact it if needed and split the slices into batches
+  void MapSpilledCoeffs();
+
+  ///Whether slice loops run in batches over the spilled matrix
+  bool SliceBatchesValid();
+
+  ///Ask the OS to read or drop the spilled coefficients of a batch
+  void PrefetchSliceBatch(size_t batch);
+  void ReleaseSliceBatch(size_t batch);
+
+  ///Grain size of a CPU stage, named after its functor without "Parallel"
+  size_t GetGrainSize(const char* stage);
+
+  ///Loops of the functors over [begin, end), run in _arena with the grain
+  ///size of their stage
+  template <class Body> void ParallelFor(const char* stage, size_t begin, size_t end, const Body& body);
+  template <class Body> void ParallelReduce(const char* stage, size_t begin, size_t end, Body& body);
+
+  ///Loops of the functors over all slices, batch by batch when the
+  ///slice-volume matrix is spilled
+  template <class Body> void ParallelForSlices(const char* stage, const Body& body);
+  template <class Body> void ParallelReduceSlices(const char* stage, Body& body);
+
+  ///Gaussian blur of _sigma_bias used by the bias field estimation
+  void BlurBias(irtkRealImage& image);
+
+  ///BlurBias of n slices, with the kernels kept by the per-thread blurring
+  void BlurBiasSlices(irtkRealImage** slices, int n, irtkBatchGaussianBlurring2D<irtkRealPixel>& blurring);
+
+  ///Slice weights and slice-wise robust statistics from the slice potentials
+  void SliceRobustStatistics(vector<double>& slice_potential);
+
+  ///Relative change |after - before| / |before| of a volume
+  template <class VoxelType>
+  static double RelativeChange(const irtkGenericImage<VoxelType>& before, const irtkGenericImage<VoxelType>& after);
+
+  ///Store the mean EM log-likelihood of an M step and its change
+  void UpdateEMObjective(double objective);
+
+  ///Superresolution step solving the weighted least squares problem with
+  ///fixed robust statistics weights and edges by preconditioned CG
+  void SuperresolutionCG(int iter);
+
   int _directions[13][3];
 
   Reconstruction* reconstructionGPU;
@@ -229,6 +360,10 @@ public:
   ///Remember volumetric mask and smooth it if necessary
   void SetMask(irtkRealImage * mask, double sigma, double threshold = 0.5);
 
+  ///Resample the reconstruction and mask to an isotropic voxel size, the
+  ///field of view of the template is kept and the template voxel size restores it
+  void SetReconstructionResolution(double resolution);
+
 
   void SaveProbabilityMap(int i);
 
@@ -308,6 +443,19 @@ public:
   ///Calculate transformation matrix between slices and voxels
   void CoeffInit();
 
+  ///Reuse the matrix of slices which moved less than the given translation (mm) and rotation (degrees)
+  inline void SetCoeffsTolerance(double translation, double rotation);
+
+  ///Recompute the matrix of all slices at the next CoeffInit
+  inline void InvalidateCoeffs();
+
+  ///Number of slices whose matrix was reused by the last CoeffInit
+  inline int GetNumberOfReusedCoeffs();
+
+  ///Number of slice sized images allocated by the CPU EM steps since the last reset
+  inline int GetNumberOfSliceAllocations();
+  inline void ResetSliceAllocations();
+
   ///Reconstruction using weighted Gaussian PSF
   void GaussianReconstruction();
 
@@ -323,6 +471,10 @@ public:
   ///Perform E-step 
   void EStep();
 
+  ///Perform E-step and calculate bias fields and scales for the next
+  ///iteration in the same pass over each slice
+  void EStepBiasScale(bool bias);
+
   ///Calculate slice-dependent scale
   void Scale();
   void ScaleGPU();
@@ -366,6 +518,21 @@ public:
   void GetTransformations(vector<irtkRigidTransformation> &transformations);
   void SetTransformations(vector<irtkRigidTransformation> &transformations);
 
+  ///Write the state after outer iteration iter to a checkpoint file, together
+  ///with the stack registrations before and after cropping
+  void WriteCheckpoint(const char* filename, int iter, vector<irtkRigidTransformation>& initial_stack_transformations,
+    vector<irtkRigidTransformation>& stack_transformations);
+
+  ///Read the stack registrations of a checkpoint, returns its iteration.
+  ///stack_transformations must hold one transformation per stack of this run
+  int ReadCheckpointStacks(const char* filename, vector<irtkRigidTransformation>& initial_stack_transformations,
+    vector<irtkRigidTransformation>& stack_transformations);
+
+  ///Restore volume and slice transformations from a checkpoint, after the
+  ///slices and the mask were created. Scales, slice weights, bias fields and
+  ///EM parameters are initialized again by every iteration and not stored
+  void ReadCheckpoint(const char* filename);
+
   ///Save confidence map
   void SaveConfidenceMap();
 
@@ -400,6 +567,9 @@ public:
   ///Switch off global bias correction
   inline void GlobalBiasCorrectionOff();
 
+  ///Blur with the recursive Gaussian during bias estimation
+  inline void RecursiveBiasBlurringOn();
+
   ///Set lower threshold for low intensity cutoff during bias estimation
   inline void SetLowIntensityCutoff(double cutoff);
 
@@ -417,6 +587,35 @@ public:
 
   inline void UseAdaptiveRegularisation();
 
+  ///Use gather-based CPU superresolution
+  inline void GatherSuperresolutionOn();
+
+  ///Use the conjugate gradient CPU superresolution solver
+  inline void SuperresolutionCGOn(int max_iterations, double tolerance);
+
+  ///Number of iterations of the last CG superresolution solve
+  inline int GetNumberOfCGIterations();
+
+  ///Number of threads of the CPU stages, threads <= 0 uses all cores
+  inline void SetNumberOfThreads(int threads);
+
+  ///Minimum number of loop iterations (slices, stacks or volume planes) per
+  ///task of a CPU stage, e.g. "EStep" for ParallelEStep. Unknown stages are
+  ///an error
+  void SetGrainSize(const string& stage, size_t grain);
+
+  ///Measure volume update and EM log-likelihood change in every
+  ///superresolution iteration, see SuperresolutionConverged
+  inline void AdaptiveStoppingOn(double update_tolerance, double em_tolerance);
+
+  ///Whether the last superresolution step and M step changed the volume and
+  ///the EM log-likelihood less than the tolerances
+  bool SuperresolutionConverged();
+
+  ///Keep at most megabytes of the slice-volume matrix in memory and spill
+  ///the rest to a file in dir
+  inline void SetMemoryBudget(double megabytes, const string& dir);
+
   ///Write included/excluded/outside slices
   void Evaluate(int iter);
   void EvaluateGPU(int iter);
@@ -512,17 +711,23 @@ public:
   friend class ParallelStackRegistrations;
   friend class ParallelSliceToVolumeRegistration;
   friend class ParallelCoeffInit;
+  friend class ParallelGaussianReconstruction;
   friend class ParallelSuperresolution;
+  friend class ParallelSuperresolutionResidual;
+  friend class ParallelSuperresolutionGather;
+  friend class ParallelSuperresolutionCGNormal;
+  friend class ParallelSuperresolutionCGDiagonal;
+  friend class ParallelSuperresolutionCGRegularization;
   friend class ParallelMStep;
   friend class ParallelEStep;
   friend class ParallelBias;
   friend class ParallelScale;
+  friend class ParallelEStepBiasScale;
   friend class ParallelNormaliseBias;
   friend class ParallelSimulateSlices;
   friend class ParallelAverage;
   friend class ParallelSliceAverage;
-  friend class ParallelAdaptiveRegularization1;
-  friend class ParallelAdaptiveRegularization2;
+  friend class ParallelAdaptiveRegularization;
   friend class ParallelSliceToVolumeRegistrationGPU;
 };
 
@@ -563,6 +768,67 @@ inline void irtkReconstruction::UseAdaptiveRegularisation()
   _adaptive = true;
 }
 
+inline void irtkReconstruction::SetCoeffsTolerance(double translation, double rotation)
+{
+  _coeffs_translation_tolerance = translation;
+  _coeffs_rotation_tolerance = rotation;
+}
+
+inline void irtkReconstruction::InvalidateCoeffs()
+{
+  _coeffs_transformations.clear();
+}
+
+inline int irtkReconstruction::GetNumberOfReusedCoeffs()
+{
+  return _coeffs_reused;
+}
+
+inline int irtkReconstruction::GetNumberOfSliceAllocations()
+{
+  return _slice_allocations;
+}
+
+inline void irtkReconstruction::ResetSliceAllocations()
+{
+  _slice_allocations = 0;
+}
+
+inline void irtkReconstruction::GatherSuperresolutionOn()
+{
+  _gather_superresolution = true;
+}
+
+inline void irtkReconstruction::SuperresolutionCGOn(int max_iterations, double tolerance)
+{
+  _cg_superresolution = true;
+  _cg_max_iterations = max_iterations;
+  _cg_tolerance = tolerance;
+}
+
+inline int irtkReconstruction::GetNumberOfCGIterations()
+{
+  return _cg_iterations;
+}
+
+inline void irtkReconstruction::SetNumberOfThreads(int threads)
+{
+  _arena.SetNumberOfThreads(threads);
+}
+
+inline void irtkReconstruction::AdaptiveStoppingOn(double update_tolerance, double em_tolerance)
+{
+  _adaptive_stopping = true;
+  _stop_update_tolerance = update_tolerance;
+  _stop_em_tolerance = em_tolerance;
+}
+
+inline void irtkReconstruction::SetMemoryBudget(double megabytes, const string& dir)
+{
+  _memory_budget = megabytes * 1024 * 1024;
+  _spill_dir = dir;
+}
+
 inline void irtkReconstruction::DebugOff()
 {
   _debug = false;
@@ -593,6 +859,11 @@ inline void irtkReconstruction::GlobalBiasCorrectionOff()
   _global_bias_correction = false;
 }
 
+inline void irtkReconstruction::RecursiveBiasBlurringOn()
+{
+  _recursive_bias_blurring = true;
+}
+
 inline void irtkReconstruction::SetLowIntensityCutoff(double cutoff)
 {
   if (cutoff > 1) cutoff = 1;
@@ -0,0 +1,220 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#ifndef _irtkSliceCoeffs_H
+#define _irtkSliceCoeffs_H
+
+#include <vector>
+
+#include "recon_volumeHelper.cuh"
+#include "irtkSpillFile.h"
+
+/*
+
+Slice to volume matrix of one slice in compressed sparse row layout
+
+All PSF coefficients of a slice live in one contiguous array, ordered by
+slice pixel (i outer, j inner). The coefficients of pixel (i,j) are
+_coeffs[_offsets[i*Y+j]] ... _coeffs[_offsets[i*Y+j+1]-1]. Each coefficient
+is a POINT3D with 16 bit volume indices and a float weight.
+
+Under a memory budget the coefficients can be moved to a spill file with
+Spill(). The offsets stay in memory and the coefficients are read through the
+mapping of the file once Attach() was called. Initialize() brings the slice
+back to memory.
+
+*/
+
+class irtkSliceCoeffs
+{
+
+protected:
+
+  /// Slice dimensions
+  int _x, _y;
+
+  /// Index of the last pixel closed while filling
+  int _closed;
+
+  /// Start of each pixel in _coeffs, X*Y+1 entries
+  std::vector<unsigned int> _offsets;
+
+  /// Coefficients of all pixels of the slice
+  std::vector<POINT3D> _coeffs;
+
+  /// Whether the coefficients live in a spill file, their offset in it
+  /// and their address in its mapping
+  bool _spilled;
+  size_t _spill_offset;
+  const POINT3D *_spill_data;
+
+public:
+
+  irtkSliceCoeffs() : _x(0), _y(0), _closed(-1), _spilled(false), _spill_offset(0), _spill_data(NULL) { }
+
+  /// Clear and prepare for a slice of x by y pixels
+  inline void Initialize(int x, int y, size_t reserve = 0);
+
+  /// Append a coefficient to the pixel currently being filled
+  inline void Push(const POINT3D& p);
+
+  /// Finish pixel (i,j), pixels skipped since the last call stay empty
+  inline void ClosePixel(int i, int j);
+
+  /// Finish the slice, remaining pixels stay empty
+  inline void Finalize();
+
+  /// Slice dimensions
+  inline int GetX() const;
+  inline int GetY() const;
+
+  /// Number of coefficients of pixel (i,j)
+  inline unsigned int Size(int i, int j) const;
+
+  /// Pointer to the first coefficient of pixel (i,j)
+  inline const POINT3D* Begin(int i, int j) const;
+
+  /// Total number of coefficients of the slice
+  inline size_t GetNumberOfCoefficients() const;
+
+  /// Memory used by the slice in bytes, excluding spilled coefficients
+  inline size_t GetMemorySize() const;
+
+  /// Append the coefficients to a spill file and free their memory
+  inline void Spill(irtkSpillFile& file);
+
+  /// Read spilled coefficients through the current mapping of file
+  inline void Attach(const irtkSpillFile& file);
+
+  /// Whether the coefficients live in a spill file
+  inline bool IsSpilled() const;
+
+  /// Offset and size in bytes of the coefficients in the spill file
+  inline size_t GetSpillOffset() const;
+  inline size_t GetDataSize() const;
+
+};
+
+inline void irtkSliceCoeffs::Initialize(int x, int y, size_t reserve)
+{
+  _x = x;
+  _y = y;
+  _closed = -1;
+  _spilled = false;
+  _spill_data = NULL;
+  _offsets.assign(x * y + 1, 0);
+  _coeffs.clear();
+  if (reserve > 0)
+    _coeffs.reserve(reserve);
+}
+
+inline void irtkSliceCoeffs::Push(const POINT3D& p)
+{
+  _coeffs.push_back(p);
+}
+
+inline void irtkSliceCoeffs::ClosePixel(int i, int j)
+{
+  int index = i * _y + j;
+  //skipped pixels end where the previous closed pixel ended
+  unsigned int start = _offsets[_closed + 1];
+  for (int k = _closed + 1; k < index; k++)
+    _offsets[k + 1] = start;
+  _offsets[index + 1] = _coeffs.size();
+  _closed = index;
+}
+
+inline void irtkSliceCoeffs::Finalize()
+{
+  if ((_x > 0) && (_y > 0))
+    ClosePixel(_x - 1, _y - 1);
+}
+
+inline int irtkSliceCoeffs::GetX() const
+{
+  return _x;
+}
+
+inline int irtkSliceCoeffs::GetY() const
+{
+  return _y;
+}
+
+inline unsigned int irtkSliceCoeffs::Size(int i, int j) const
+{
+  int index = i * _y + j;
+  return _offsets[index + 1] - _offsets[index];
+}
+
+inline const POINT3D* irtkSliceCoeffs::Begin(int i, int j) const
+{
+  return (_spilled ? _spill_data : _coeffs.data()) + _offsets[i * _y + j];
+}
+
+inline size_t irtkSliceCoeffs::GetNumberOfCoefficients() const
+{
+  return _spilled ? _offsets.back() : _coeffs.size();
+}
+
+inline size_t irtkSliceCoeffs::GetMemorySize() const
+{
+  return _coeffs.capacity() * sizeof(POINT3D) + _offsets.capacity() * sizeof(unsigned int);
+}
+
+inline void irtkSliceCoeffs::Spill(irtkSpillFile& file)
+{
+  if (_offsets.empty())
+    return;
+  //also moves spilled coefficients from an older file
+  const POINT3D *data = _spilled ? _spill_data : _coeffs.data();
+  _spill_offset = file.Append(data, GetDataSize());
+  _spilled = true;
+  _spill_data = NULL;
+  std::vector<POINT3D>().swap(_coeffs);
+}
+
+inline void irtkSliceCoeffs::Attach(const irtkSpillFile& file)
+{
+  if (_spilled)
+    _spill_data = reinterpret_cast<const POINT3D*>(file.Pointer(_spill_offset));
+}
+
+inline bool irtkSliceCoeffs::IsSpilled() const
+{
+  return _spilled;
+}
+
+inline size_t irtkSliceCoeffs::GetSpillOffset() const
+{
+  return _spill_offset;
+}
+
+inline size_t irtkSliceCoeffs::GetDataSize() const
+{
+  return GetNumberOfCoefficients() * sizeof(POINT3D);
+}
+
+#endif
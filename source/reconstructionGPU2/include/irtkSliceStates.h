@@ -0,0 +1,287 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+
+#ifndef _irtkSliceStates_H
+#define _irtkSliceStates_H
+
+#include <irtkImage.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+
+EM state of all slices in one arena
+
+The voxel weights, bias fields, simulated slices and simulated weights of
+all slices are float fields of one contiguous array, field after field.
+Within a field the slices follow each other, each starting at a multiple
+of 32 pixels, and the pixels of a slice are in the order of the voxels of
+an irtkRealImage, so pixel (i,j) of slice s is at Offset(s) + j*X + i.
+Whether a simulated pixel sees the mask is one bit per pixel in a separate
+bitmask, laid out like a field. As slices start on a word of the bitmask,
+slices can be processed in parallel.
+
+The kernels access a field of a slice through an irtkSliceField or its
+pointer. GetImage() and PutImage() copy a field of a slice from and to an
+irtkRealImage for saving, checkpointing and debugging.
+
+*/
+
+/// Field of one slice, indexed like the slice image
+class irtkSliceField
+{
+
+protected:
+
+  float *_data;
+  int _x, _y;
+
+public:
+
+  irtkSliceField(float *data, int x, int y) : _data(data), _x(x), _y(y) { }
+
+  /// Value of pixel (i,j,k)
+  inline float& operator()(int i, int j, int k) const;
+
+  /// Pointer to the first pixel
+  inline float* GetPointer() const;
+
+};
+
+class irtkSliceStates
+{
+
+public:
+
+  /// Fields of a slice, INSIDE is kept in the bitmask
+  enum Field { WEIGHTS, BIAS, SIMULATED, SIMULATED_WEIGHTS, INSIDE };
+
+protected:
+
+  /// Number of float fields
+  static const int FIELDS = 4;
+
+  /// Slice dimensions
+  std::vector<int> _x, _y, _z;
+
+  /// Start of each slice in a field, slices+1 entries
+  std::vector<size_t> _offsets;
+
+  /// All float fields of all slices
+  std::vector<float> _data;
+
+  /// One bit per pixel of all slices, set if the pixel sees the mask
+  std::vector<unsigned int> _inside;
+
+  /// Address of field f of slice s
+  inline float* Pointer(int f, int s);
+  inline const float* Pointer(int f, int s) const;
+
+public:
+
+  /// Allocate the fields for the slices, all values are zero
+  inline void Initialize(const std::vector<irtkRealImage>& slices);
+
+  /// Whether the fields were allocated for slices of these sizes
+  inline bool Matches(const std::vector<irtkRealImage>& slices) const;
+
+  /// Number of slices
+  inline int GetNumberOfSlices() const;
+
+  /// Number of pixels of slice s
+  inline int GetNumberOfPixels(int s) const;
+
+  /// Fields of slice s
+  inline irtkSliceField Weights(int s);
+  inline irtkSliceField Bias(int s);
+  inline irtkSliceField Simulated(int s);
+  inline irtkSliceField SimulatedWeights(int s);
+
+  /// Whether pixel (i,j) of slice s sees the mask
+  inline bool Inside(int s, int i, int j) const;
+  inline void SetInside(int s, int i, int j);
+
+  /// Zero the simulated slice, its weights and inside bits of slice s
+  inline void ClearSimulation(int s);
+
+  /// Copy of field f of slice s with the attributes of the slice
+  inline irtkRealImage GetImage(Field f, int s, const irtkImageAttributes& attr) const;
+
+  /// Overwrite field f of slice s with the voxels of image
+  inline void PutImage(Field f, int s, const irtkRealImage& image);
+
+  /// Memory used by the fields and the bitmask in bytes
+  inline size_t GetMemorySize() const;
+
+};
+
+inline float& irtkSliceField::operator()(int i, int j, int k) const
+{
+  return _data[(k * _y + j) * _x + i];
+}
+
+inline float* irtkSliceField::GetPointer() const
+{
+  return _data;
+}
+
+inline float* irtkSliceStates::Pointer(int f, int s)
+{
+  return &_data[f * _offsets.back() + _offsets[s]];
+}
+
+inline const float* irtkSliceStates::Pointer(int f, int s) const
+{
+  return &_data[f * _offsets.back() + _offsets[s]];
+}
+
+inline void irtkSliceStates::Initialize(const std::vector<irtkRealImage>& slices)
+{
+  int n = slices.size();
+  _x.resize(n);
+  _y.resize(n);
+  _z.resize(n);
+  _offsets.assign(n + 1, 0);
+  for (int s = 0; s < n; s++) {
+    _x[s] = slices[s].GetX();
+    _y[s] = slices[s].GetY();
+    _z[s] = slices[s].GetZ();
+    //slices start on a word of the bitmask
+    size_t size = _x[s] * _y[s] * _z[s];
+    _offsets[s + 1] = _offsets[s] + (size + 31) / 32 * 32;
+  }
+  _data.assign(FIELDS * _offsets.back(), 0);
+  _inside.assign(_offsets.back() / 32, 0);
+}
+
+inline bool irtkSliceStates::Matches(const std::vector<irtkRealImage>& slices) const
+{
+  if (slices.size() != _x.size())
+    return false;
+  for (size_t s = 0; s < slices.size(); s++)
+    if ((slices[s].GetX() != _x[s]) || (slices[s].GetY() != _y[s]) || (slices[s].GetZ() != _z[s]))
+      return false;
+  return true;
+}
+
+inline int irtkSliceStates::GetNumberOfSlices() const
+{
+  return _x.size();
+}
+
+inline int irtkSliceStates::GetNumberOfPixels(int s) const
+{
+  return _x[s] * _y[s] * _z[s];
+}
+
+inline irtkSliceField irtkSliceStates::Weights(int s)
+{
+  return irtkSliceField(Pointer(WEIGHTS, s), _x[s], _y[s]);
+}
+
+inline irtkSliceField irtkSliceStates::Bias(int s)
+{
+  return irtkSliceField(Pointer(BIAS, s), _x[s], _y[s]);
+}
+
+inline irtkSliceField irtkSliceStates::Simulated(int s)
+{
+  return irtkSliceField(Pointer(SIMULATED, s), _x[s], _y[s]);
+}
+
+inline irtkSliceField irtkSliceStates::SimulatedWeights(int s)
+{
+  return irtkSliceField(Pointer(SIMULATED_WEIGHTS, s), _x[s], _y[s]);
+}
+
+inline bool irtkSliceStates::Inside(int s, int i, int j) const
+{
+  size_t index = _offsets[s] + j * _x[s] + i;
+  return (_inside[index / 32] >> (index % 32)) & 1;
+}
+
+inline void irtkSliceStates::SetInside(int s, int i, int j)
+{
+  size_t index = _offsets[s] + j * _x[s] + i;
+  _inside[index / 32] |= 1u << (index % 32);
+}
+
+inline void irtkSliceStates::ClearSimulation(int s)
+{
+  int n = GetNumberOfPixels(s);
+  std::fill(Pointer(SIMULATED, s), Pointer(SIMULATED, s) + n, 0.0f);
+  std::fill(Pointer(SIMULATED_WEIGHTS, s), Pointer(SIMULATED_WEIGHTS, s) + n, 0.0f);
+  std::fill(_inside.begin() + _offsets[s] / 32, _inside.begin() + _offsets[s + 1] / 32, 0u);
+}
+
+inline irtkRealImage irtkSliceStates::GetImage(Field f, int s, const irtkImageAttributes& attr) const
+{
+  irtkRealImage image(attr);
+  irtkRealPixel *ptr = image.GetPointerToVoxels();
+  int n = GetNumberOfPixels(s);
+  if (f == INSIDE) {
+    for (int i = 0; i < n; i++) {
+      size_t index = _offsets[s] + i;
+      ptr[i] = (_inside[index / 32] >> (index % 32)) & 1;
+    }
+  }
+  else {
+    const float *data = Pointer(f, s);
+    for (int i = 0; i < n; i++)
+      ptr[i] = data[i];
+  }
+  return image;
+}
+
+inline void irtkSliceStates::PutImage(Field f, int s, const irtkRealImage& image)
+{
+  const irtkRealPixel *ptr = image.GetPointerToVoxels();
+  int n = GetNumberOfPixels(s);
+  if (f == INSIDE) {
+    for (int i = 0; i < n; i++) {
+      size_t index = _offsets[s] + i;
+      if (ptr[i] == 1)
+        _inside[index / 32] |= 1u << (index % 32);
+      else
+        _inside[index / 32] &= ~(1u << (index % 32));
+    }
+  }
+  else {
+    float *data = Pointer(f, s);
+    for (int i = 0; i < n; i++)
+      data[i] = ptr[i];
+  }
+}
+
+inline size_t irtkSliceStates::GetMemorySize() const
+{
+  return _data.capacity() * sizeof(float) + _inside.capacity() * sizeof(unsigned int)
+    + _offsets.capacity() * sizeof(size_t) + 3 * _x.capacity() * sizeof(int);
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#ifndef _irtkSpillFile_H
+#define _irtkSpillFile_H
+
+#include <string>
+
+/*
+
+Temporary file that holds data which does not fit the memory budget
+
+Data is appended with Append() and read back through a read-only memory
+mapping of the whole file. The file is unlinked right after creation, so it
+disappears when it is closed or the process ends. Prefetch() and Release()
+let a caller stream through the mapping in batches: the OS reads the next
+batch ahead while the current one is processed, and pages of finished
+batches are dropped instead of accumulating in the resident set.
+
+*/
+
+class irtkSpillFile
+{
+
+protected:
+
+  /// File descriptor, -1 if not open
+  int _fd;
+
+  /// Bytes written
+  size_t _size;
+
+  /// Read-only mapping of the first _mapped bytes
+  char *_map;
+  size_t _mapped;
+
+  /// Remove the mapping
+  void Unmap();
+
+private:
+
+  irtkSpillFile(const irtkSpillFile&);
+  irtkSpillFile& operator=(const irtkSpillFile&);
+
+public:
+
+  irtkSpillFile();
+  ~irtkSpillFile();
+
+  /// Create an empty spill file in directory dir, false on failure
+  bool Open(const std::string& dir);
+
+  /// Unmap and close, all data is lost
+  void Close();
+
+  /// Whether the file is open
+  inline bool IsOpen() const;
+
+  /// Append bytes and return their offset in the file
+  size_t Append(const void *data, size_t bytes);
+
+  /// Map all data written so far, invalidates pointers of an earlier mapping
+  void Map();
+
+  /// Pointer to the mapped byte at offset
+  inline const char* Pointer(size_t offset) const;
+
+  /// Ask the OS to read a mapped range ahead of its use
+  void Prefetch(size_t offset, size_t bytes) const;
+
+  /// Drop the pages of a mapped range from memory, they are read again on access
+  void Release(size_t offset, size_t bytes) const;
+
+  /// Bytes written
+  inline size_t GetSize() const;
+
+  /// Exchange the contents with another spill file
+  void Swap(irtkSpillFile& file);
+
+};
+
+inline bool irtkSpillFile::IsOpen() const
+{
+  return _fd >= 0;
+}
+
+inline const char* irtkSpillFile::Pointer(size_t offset) const
+{
+  return _map + offset;
+}
+
+inline size_t irtkSpillFile::GetSize() const
+{
+  return _size;
+}
+
+#endif
@@ -0,0 +1,177 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#ifndef _irtkVolumeCoeffs_H
+#define _irtkVolumeCoeffs_H
+
+#include "irtkSliceCoeffs.h"
+
+#include <vector>
+
+/*
+
+Transposed slice to volume matrix
+
+For every voxel of the reconstructed volume the slice pixels it receives
+contributions from, in compressed sparse row layout. Pixels are addressed by
+a global index into all slices concatenated, see GetSliceOffset. Rows are
+ordered by slice and pixel, so sums over a row do not depend on threading.
+
+*/
+
+struct PIXELCOEFF
+{
+  unsigned int pixel;
+  float value;
+};
+
+class irtkVolumeCoeffs
+{
+
+protected:
+
+  /// Start of each voxel in _coeffs, number of voxels + 1 entries
+  std::vector<size_t> _offsets;
+
+  /// Coefficients of all voxels of the volume
+  std::vector<PIXELCOEFF> _coeffs;
+
+  /// Global index of the first pixel of each slice, number of slices + 1 entries
+  std::vector<unsigned int> _slice_offsets;
+
+public:
+
+  /// Build the transpose of the slice coefficients for a volume of size x,y,z
+  inline void Initialize(const std::vector<irtkSliceCoeffs>& slicecoeffs, int x, int y, int z);
+
+  /// Release memory
+  inline void Clear();
+
+  /// Number of voxels
+  inline int GetNumberOfVoxels() const;
+
+  /// Number of slice pixels over all slices
+  inline unsigned int GetNumberOfPixels() const;
+
+  /// Global index of pixel (0,0) of slice inputIndex
+  inline unsigned int GetSliceOffset(int inputIndex) const;
+
+  /// Number of coefficients of voxel index
+  inline size_t Size(int index) const;
+
+  /// Pointer to the first coefficient of voxel index
+  inline const PIXELCOEFF* Begin(int index) const;
+
+  /// Memory used in bytes
+  inline size_t GetMemorySize() const;
+
+};
+
+inline void irtkVolumeCoeffs::Initialize(const std::vector<irtkSliceCoeffs>& slicecoeffs, int x, int y, int z)
+{
+  int inputIndex, i, j, index;
+  unsigned int k, n;
+  const POINT3D *p;
+
+  _slice_offsets.resize(slicecoeffs.size() + 1);
+  _slice_offsets[0] = 0;
+  for (inputIndex = 0; inputIndex < slicecoeffs.size(); inputIndex++)
+    _slice_offsets[inputIndex + 1] = _slice_offsets[inputIndex]
+      + slicecoeffs[inputIndex].GetX() * slicecoeffs[inputIndex].GetY();
+
+  //count coefficients per voxel
+  _offsets.assign(x * y * z + 1, 0);
+  for (inputIndex = 0; inputIndex < slicecoeffs.size(); inputIndex++) {
+    const irtkSliceCoeffs& sc = slicecoeffs[inputIndex];
+    for (i = 0; i < sc.GetX(); i++)
+      for (j = 0; j < sc.GetY(); j++) {
+        p = sc.Begin(i, j);
+        n = sc.Size(i, j);
+        for (k = 0; k < n; k++)
+          _offsets[p[k].x + x * (p[k].y + y * p[k].z) + 1]++;
+      }
+  }
+  for (index = 0; index < x * y * z; index++)
+    _offsets[index + 1] += _offsets[index];
+
+  //fill rows, in order of slices and pixels
+  _coeffs.resize(_offsets[x * y * z]);
+  std::vector<size_t> cursor(_offsets.begin(), _offsets.end() - 1);
+  PIXELCOEFF c;
+  for (inputIndex = 0; inputIndex < slicecoeffs.size(); inputIndex++) {
+    const irtkSliceCoeffs& sc = slicecoeffs[inputIndex];
+    for (i = 0; i < sc.GetX(); i++)
+      for (j = 0; j < sc.GetY(); j++) {
+        p = sc.Begin(i, j);
+        n = sc.Size(i, j);
+        c.pixel = _slice_offsets[inputIndex] + i * sc.GetY() + j;
+        for (k = 0; k < n; k++) {
+          c.value = p[k].value;
+          _coeffs[cursor[p[k].x + x * (p[k].y + y * p[k].z)]++] = c;
+        }
+      }
+  }
+}
+
+inline void irtkVolumeCoeffs::Clear()
+{
+  std::vector<size_t>().swap(_offsets);
+  std::vector<PIXELCOEFF>().swap(_coeffs);
+  std::vector<unsigned int>().swap(_slice_offsets);
+}
+
+inline int irtkVolumeCoeffs::GetNumberOfVoxels() const
+{
+  return _offsets.empty() ? 0 : _offsets.size() - 1;
+}
+
+inline unsigned int irtkVolumeCoeffs::GetNumberOfPixels() const
+{
+  return _slice_offsets.empty() ? 0 : _slice_offsets.back();
+}
+
+inline unsigned int irtkVolumeCoeffs::GetSliceOffset(int inputIndex) const
+{
+  return _slice_offsets[inputIndex];
+}
+
+inline size_t irtkVolumeCoeffs::Size(int index) const
+{
+  return _offsets[index + 1] - _offsets[index];
+}
+
+inline const PIXELCOEFF* irtkVolumeCoeffs::Begin(int index) const
+{
+  return _coeffs.data() + _offsets[index];
+}
+
+inline size_t irtkVolumeCoeffs::GetMemorySize() const
+{
+  return _coeffs.capacity() * sizeof(PIXELCOEFF) + _offsets.capacity() * sizeof(size_t)
+    + _slice_offsets.capacity() * sizeof(unsigned int);
+}
+
+#endif
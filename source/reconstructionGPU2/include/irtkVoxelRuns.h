@@ -0,0 +1,238 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#ifndef _irtkVoxelRuns_H
+#define _irtkVoxelRuns_H
+
+#include <irtkImage.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+
+Active voxels of a volume as runs along x
+
+A run covers voxels x ... x+length-1 of row (y,z). Runs are ordered by z, y
+and x, so their linear indices increase. The runs of slice z are
+GetSliceBegin(z) ... GetSliceEnd(z)-1. Volume-wide passes that only change
+voxels inside a mask loop over the runs instead of the whole grid.
+
+*/
+
+struct VOXELRUN
+{
+  int x, y, z, length;
+};
+
+class irtkVoxelRuns
+{
+
+protected:
+
+  /// Volume dimensions
+  int _x, _y, _z;
+
+  /// Bounding box of the active voxels, empty if _x1 < _x0
+  int _x0, _x1, _y0, _y1, _z0, _z1;
+
+  /// Number of active voxels
+  size_t _voxels;
+
+  /// Runs of all slices
+  std::vector<VOXELRUN> _runs;
+
+  /// First run of each slice, z+1 entries
+  std::vector<int> _slice_offsets;
+
+public:
+
+  irtkVoxelRuns() : _x(0), _y(0), _z(0), _x0(0), _x1(-1), _y0(0), _y1(-1), _z0(0), _z1(-1), _voxels(0) { }
+
+  /// Runs of the voxels equal to 1 in mask, grown by dilation voxels in
+  /// each direction (a box of 2*dilation+1 voxels)
+  template <class VoxelType> inline void Initialize(const irtkGenericImage<VoxelType>& mask, int dilation = 0);
+
+  /// Volume dimensions
+  inline int GetX() const;
+  inline int GetY() const;
+  inline int GetZ() const;
+
+  /// Whether the runs were built for a volume of this size
+  inline bool Matches(const irtkBaseImage& image) const;
+
+  /// Number of runs and active voxels
+  inline int GetNumberOfRuns() const;
+  inline size_t GetNumberOfVoxels() const;
+
+  /// Run i
+  inline const VOXELRUN& GetRun(int i) const;
+
+  /// Runs of slice z
+  inline int GetSliceBegin(int z) const;
+  inline int GetSliceEnd(int z) const;
+
+  /// Linear index of the first voxel of a run
+  inline int Index(const VOXELRUN& run) const;
+
+  /// Bounding box of the active voxels, returns false if there are none
+  inline bool GetBoundingBox(int& x0, int& x1, int& y0, int& y1, int& z0, int& z1) const;
+
+  /// Set all voxels outside the runs to value
+  template <class VoxelType> inline void FillOutside(VoxelType *data, VoxelType value) const;
+
+};
+
+template <class VoxelType> inline void irtkVoxelRuns::Initialize(const irtkGenericImage<VoxelType>& mask, int dilation)
+{
+  int x, y, z, i, d;
+
+  _x = mask.GetX();
+  _y = mask.GetY();
+  _z = mask.GetZ();
+
+  //dilate with a separable box filter, one axis after the other
+  std::vector<unsigned char> active(_x * _y * _z), tmp(_x * _y * _z);
+  const VoxelType *pm = mask.GetPointerToVoxels();
+  for (i = 0; i < _x * _y * _z; i++)
+    active[i] = (pm[i] == 1);
+  if (dilation > 0) {
+    int dim[3] = { _x, _y, _z };
+    int stride[3] = { 1, _x, _x * _y };
+    for (int axis = 0; axis < 3; axis++) {
+      tmp.swap(active);
+      for (i = 0; i < _x * _y * _z; i++) {
+        int c = (i / stride[axis]) % dim[axis];
+        int d0 = std::max(-dilation, -c);
+        int d1 = std::min(dilation, dim[axis] - 1 - c);
+        unsigned char a = 0;
+        for (d = d0; (d <= d1) && !a; d++)
+          a = tmp[i + d * stride[axis]];
+        active[i] = a;
+      }
+    }
+  }
+
+  _runs.clear();
+  _slice_offsets.assign(_z + 1, 0);
+  _voxels = 0;
+  _x0 = _x; _y0 = _y; _z0 = _z;
+  _x1 = _y1 = _z1 = -1;
+  const unsigned char *pa = active.data();
+  VOXELRUN run;
+  for (z = 0; z < _z; z++) {
+    _slice_offsets[z] = _runs.size();
+    for (y = 0; y < _y; y++)
+      for (x = 0; x < _x; x++) {
+        if (!pa[x + _x * (y + _y * z)])
+          continue;
+        run.x = x;
+        run.y = y;
+        run.z = z;
+        while ((x < _x) && pa[x + _x * (y + _y * z)])
+          x++;
+        run.length = x - run.x;
+        _runs.push_back(run);
+        _voxels += run.length;
+        _x0 = std::min(_x0, run.x); _x1 = std::max(_x1, x - 1);
+        _y0 = std::min(_y0, y); _y1 = std::max(_y1, y);
+        _z0 = std::min(_z0, z); _z1 = std::max(_z1, z);
+      }
+  }
+  _slice_offsets[_z] = _runs.size();
+}
+
+inline int irtkVoxelRuns::GetX() const
+{
+  return _x;
+}
+
+inline int irtkVoxelRuns::GetY() const
+{
+  return _y;
+}
+
+inline int irtkVoxelRuns::GetZ() const
+{
+  return _z;
+}
+
+inline bool irtkVoxelRuns::Matches(const irtkBaseImage& image) const
+{
+  return (image.GetX() == _x) && (image.GetY() == _y) && (image.GetZ() == _z);
+}
+
+inline int irtkVoxelRuns::GetNumberOfRuns() const
+{
+  return _runs.size();
+}
+
+inline size_t irtkVoxelRuns::GetNumberOfVoxels() const
+{
+  return _voxels;
+}
+
+inline const VOXELRUN& irtkVoxelRuns::GetRun(int i) const
+{
+  return _runs[i];
+}
+
+inline int irtkVoxelRuns::GetSliceBegin(int z) const
+{
+  return _slice_offsets[z];
+}
+
+inline int irtkVoxelRuns::GetSliceEnd(int z) const
+{
+  return _slice_offsets[z + 1];
+}
+
+inline int irtkVoxelRuns::Index(const VOXELRUN& run) const
+{
+  return run.x + _x * (run.y + _y * run.z);
+}
+
+inline bool irtkVoxelRuns::GetBoundingBox(int& x0, int& x1, int& y0, int& y1, int& z0, int& z1) const
+{
+  x0 = _x0; x1 = _x1;
+  y0 = _y0; y1 = _y1;
+  z0 = _z0; z1 = _z1;
+  return _x1 >= _x0;
+}
+
+template <class VoxelType> inline void irtkVoxelRuns::FillOutside(VoxelType *data, VoxelType value) const
+{
+  //the gaps between consecutive runs
+  int end = 0;
+  for (size_t r = 0; r < _runs.size(); r++) {
+    int index = Index(_runs[r]);
+    std::fill(data + end, data + index, value);
+    end = index + _runs[r].length;
+  }
+  std::fill(data + end, data + _x * _y * _z, value);
+}
+
+#endif
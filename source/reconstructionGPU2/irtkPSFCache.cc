@@ -0,0 +1,148 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#include "irtkPSFCache.h"
+
+bool irtkPSFCache::Key::operator<(const Key& k) const
+{
+  if (dx != k.dx) return dx < k.dx;
+  if (dy != k.dy) return dy < k.dy;
+  if (dz != k.dz) return dz < k.dz;
+  if (res != k.res) return res < k.res;
+  return quality < k.quality;
+}
+
+const irtkPSFKernel& irtkPSFCache::Get(double dx, double dy, double dz, double res, double quality)
+{
+  Key key;
+  key.dx = dx;
+  key.dy = dy;
+  key.dz = dz;
+  key.res = res;
+  key.quality = quality;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::map<Key, irtkPSFKernel>::iterator it = _kernels.find(key);
+  if (it == _kernels.end()) {
+    it = _kernels.insert(std::make_pair(key, irtkPSFKernel())).first;
+    Build(it->second, dx, dy, dz, res, quality);
+  }
+  return it->second;
+}
+
+int irtkPSFCache::GetNumberOfKernels()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _kernels.size();
+}
+
+void irtkPSFCache::Build(irtkPSFKernel& kernel, double dx, double dy, double dz, double res, double quality)
+{
+  //sigma of 3D Gaussian (sinc with FWHM=dx or dy in-plane, Gaussian with FWHM = dz through-plane)
+  double sigmax = 1.2 * dx / 2.3548;
+  double sigmay = 1.2 * dy / 2.3548;
+  double sigmaz = dz / 2.3548;
+
+  //isotropic voxel size of PSF - derived from resolution of reconstructed volume
+  double size = res / quality;
+
+  //number of voxels in each direction
+  //the ROI is 2*voxel dimension
+  int xDim = round(2 * dx / size);
+  int yDim = round(2 * dy / size);
+  int zDim = round(2 * dz / size);
+
+  //image corresponding to PSF
+  irtkImageAttributes attr;
+  attr._x = xDim;
+  attr._y = yDim;
+  attr._z = zDim;
+  attr._dx = size;
+  attr._dy = size;
+  attr._dz = size;
+  irtkRealImage& PSF = kernel.PSF;
+  PSF.Initialize(attr);
+
+  //centre of PSF
+  double cx, cy, cz;
+  cx = 0.5 * (xDim - 1);
+  cy = 0.5 * (yDim - 1);
+  cz = 0.5 * (zDim - 1);
+  PSF.ImageToWorld(cx, cy, cz);
+
+  double x, y, z;
+  double sum = 0;
+  int i, j, k;
+  for (i = 0; i < xDim; i++)
+    for (j = 0; j < yDim; j++)
+      for (k = 0; k < zDim; k++) {
+    x = i;
+    y = j;
+    z = k;
+    PSF.ImageToWorld(x, y, z);
+    x -= cx;
+    y -= cy;
+    z -= cz;
+    //continuous PSF does not need to be normalized as discrete will be
+    PSF(i, j, k) = exp(
+      -x * x / (2 * sigmax * sigmax) - y * y / (2 * sigmay * sigmay)
+      - z * z / (2 * sigmaz * sigmaz));
+    sum += PSF(i, j, k);
+      }
+  PSF /= sum;
+
+  //maximum dim of rotated kernel - the next higher odd integer plus two to accound for rounding error of tx,ty,tz.
+  //Note conversion from PSF image coordinates to tPSF image coordinates *size/res
+  kernel.dim = (floor(ceil(sqrt(double(xDim * xDim + yDim * yDim + zDim * zDim)) * size / res) / 2))
+    * 2 + 1 + 2;
+  kernel.xDim = xDim;
+  kernel.yDim = yDim;
+  kernel.zDim = zDim;
+
+  //offsets of the PSF samples from the centre of a slice voxel, in slice image coordinates
+  kernel.values.resize(xDim * yDim * zDim);
+  kernel.offsets.resize(3 * xDim * yDim * zDim);
+  int n = 0;
+  for (i = 0; i < xDim; i++)
+    for (j = 0; j < yDim; j++)
+      for (k = 0; k < zDim; k++) {
+    x = i;
+    y = j;
+    z = k;
+    //change to PSF world coordinates - now real sizes in mm
+    PSF.ImageToWorld(x, y, z);
+    //centre around the centrepoint of the PSF
+    x -= cx;
+    y -= cy;
+    z -= cz;
+    //adjust according to voxel size
+    kernel.offsets[3 * n] = x / dx;
+    kernel.offsets[3 * n + 1] = y / dy;
+    kernel.offsets[3 * n + 2] = z / dz;
+    kernel.values[n] = PSF(i, j, k);
+    n++;
+      }
+}
@@ -0,0 +1,202 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#include "irtkProfiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <thread>
+
+bool irtkProfiler::_enabled = false;
+std::mutex irtkProfiler::_mutex;
+std::map<std::string, irtkProfiler::Stage> irtkProfiler::_stages;
+std::vector<irtkProfiler::Event> irtkProfiler::_events;
+
+static std::chrono::steady_clock::time_point profiler_origin = std::chrono::steady_clock::now();
+
+std::vector<std::string>& irtkProfilerDetail::Stack()
+{
+  static thread_local std::vector<std::string> stack;
+  return stack;
+}
+
+static std::string JSONString(const std::string& s)
+{
+  std::string out = "\"";
+  for (size_t i = 0; i < s.size(); i++) {
+    if ((s[i] == '"') || (s[i] == '\\'))
+      out += '\\';
+    out += s[i];
+  }
+  return out + "\"";
+}
+
+void irtkProfiler::Enable()
+{
+  //the thread enabling the profiler becomes thread 0
+  ThreadId();
+  profiler_origin = std::chrono::steady_clock::now();
+  _enabled = true;
+}
+
+bool irtkProfiler::IsEnabled()
+{
+  return _enabled;
+}
+
+double irtkProfiler::Now()
+{
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - profiler_origin).count();
+}
+
+int irtkProfiler::ThreadId()
+{
+  static std::atomic<int> next(0);
+  static thread_local int id = next++;
+  return id;
+}
+
+const std::string& irtkProfiler::CurrentPath()
+{
+  static const std::string none;
+  std::vector<std::string>& stack = irtkProfilerDetail::Stack();
+  return stack.empty() ? none : stack.back();
+}
+
+void irtkProfiler::Count(const char* counter, double value)
+{
+  if (!_enabled)
+    return;
+  const std::string& path = CurrentPath();
+  if (path.empty())
+    return;
+  std::lock_guard<std::mutex> lock(_mutex);
+  _stages[path].counters[counter] += value;
+}
+
+void irtkProfiler::WriteJSON(const char* filename)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::ofstream out(filename);
+  out << std::setprecision(12);
+  out << "{\n  \"stages\": [";
+  for (std::map<std::string, Stage>::const_iterator it = _stages.begin(); it != _stages.end(); ++it) {
+    const Stage& s = it->second;
+    out << (it == _stages.begin() ? "\n" : ",\n");
+    out << "    {\"path\": " << JSONString(it->first) << ", \"calls\": " << s.calls
+      << ", \"total_ms\": " << s.total / 1000 << ", \"mean_ms\": " << s.total / std::max(s.calls, 1) / 1000
+      << ", \"min_ms\": " << s.min / 1000 << ", \"max_ms\": " << s.max / 1000;
+
+    out << ", \"counters\": {";
+    for (std::map<std::string, double>::const_iterator c = s.counters.begin(); c != s.counters.end(); ++c)
+      out << (c == s.counters.begin() ? "" : ", ") << JSONString(c->first) << ": " << c->second;
+    out << "}";
+
+    if (!s.busy.empty()) {
+      //load imbalance is the busiest thread relative to the average one
+      double sum = 0, max = 0;
+      out << ", \"busy_ms\": {";
+      for (std::map<int, double>::const_iterator b = s.busy.begin(); b != s.busy.end(); ++b) {
+        out << (b == s.busy.begin() ? "" : ", ") << "\"" << b->first << "\": " << b->second / 1000;
+        sum += b->second;
+        max = std::max(max, b->second);
+      }
+      out << "}, \"idle_ms\": " << s.idle / 1000 << ", \"imbalance\": ";
+      //stages too short for the clock have no busy time and no imbalance
+      if (sum > 0)
+        out << max / (sum / s.busy.size());
+      else
+        out << "null";
+    }
+    out << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+void irtkProfiler::WriteChromeTrace(const char* filename)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::ofstream out(filename);
+  out << std::setprecision(12);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  for (size_t i = 0; i < _events.size(); i++) {
+    const Event& e = _events[i];
+    out << (i == 0 ? "\n" : ",\n") << "{\"name\": " << JSONString(e.name) << ", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+      << e.thread << ", \"ts\": " << e.start << ", \"dur\": " << e.duration << "}";
+  }
+  out << "\n]}\n";
+}
+
+irtkProfileScope::irtkProfileScope(const char* name, int threads) :
+  _active(irtkProfiler::IsEnabled()), _start(0), _threads(0)
+{
+  if (!_active)
+    return;
+  const std::string& parent = irtkProfiler::CurrentPath();
+  _name = parent.empty() ? std::string(name) : parent + "/" + name;
+  irtkProfilerDetail::Stack().push_back(_name);
+  if (threads != 0) {
+#ifdef HAS_TBB
+    _threads = (threads > 0) ? threads : std::max(int(std::thread::hardware_concurrency()), 1);
+#else
+    _threads = 1;
+#endif
+  }
+  _start = irtkProfiler::Now();
+}
+
+irtkProfileScope::~irtkProfileScope()
+{
+  if (!_active)
+    return;
+  double duration = irtkProfiler::Now() - _start;
+  irtkProfilerDetail::Stack().pop_back();
+
+  std::lock_guard<std::mutex> lock(irtkProfiler::_mutex);
+  irtkProfiler::Stage& stage = irtkProfiler::_stages[_name];
+  stage.min = (stage.calls == 0) ? duration : std::min(stage.min, duration);
+  stage.max = std::max(stage.max, duration);
+  stage.total += duration;
+  stage.calls++;
+  if (_threads > 0) {
+    double busy = 0;
+    for (std::map<int, double>::const_iterator it = _busy.begin(); it != _busy.end(); ++it) {
+      stage.busy[it->first] += it->second;
+      busy += it->second;
+    }
+    stage.idle += std::max(duration * _threads - busy, 0.0);
+  }
+
+  irtkProfiler::Event event;
+  event.name = _name.substr(_name.rfind('/') + 1);
+  event.thread = irtkProfiler::ThreadId();
+  event.start = _start;
+  event.duration = duration;
+  irtkProfiler::_events.push_back(event);
+}
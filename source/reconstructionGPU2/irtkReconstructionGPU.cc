@@ -28,6 +28,7 @@
 #define _USE_MATH_DEFINES
 
 #include <irtkReconstructionGPU.h>
+#include <irtkProfiler.h>
 #include <irtkResampling.h>
 #include <irtkRegistration.h>
 #include <irtkImageRigidRegistration.h>
@@ -177,10 +178,30 @@ irtkReconstruction::irtkReconstruction(std::vector<int> dev, bool useCPUReg)
   _have_mask = false;
   _low_intensity_cutoff = 0.01f;
   _global_bias_correction = false;
+  _recursive_bias_blurring = false;
   _adaptive = false;
   _patchBased = false;
   _disableBiasC = false;
   _useNMI = false;
+  _gather_superresolution = false;
+  _coeffs_quality_factor = 0;
+  _coeffs_translation_tolerance = 0;
+  _coeffs_rotation_tolerance = 0;
+  _coeffs_reused = 0;
+  _slice_allocations = 0;
+  _memory_budget = 0;
+  _spill_dir = ".";
+  _cg_superresolution = false;
+  _cg_max_iterations = 10;
+  _cg_tolerance = 1e-3;
+  _cg_iterations = 0;
+  _adaptive_stopping = false;
+  _stop_update_tolerance = 1e-3;
+  _stop_em_tolerance = 1e-3;
+  _sr_update = voxel_limits<double>::max();
+  _em_change = voxel_limits<double>::max();
+  _em_objective = 0;
+  _em_objective_valid = false;
   //--------------------------------------------------------------------------------------------
   // superpixel (spx)
    _superpixelBased = false;
@@ -440,6 +461,96 @@ void irtkReconstruction::CenterStacks(vector<irtkRealImage>& stacks,
 
 }
 
+/* Parallel loops of the functors, run in the persistent arena of the reconstruction */
+
+//stages of the loops below, a new stage has to be added here to be tunable
+static const char* irtkGrainSizeStages[] = {
+  "AdaptiveRegularization", "Average", "Bias", "CoeffInit", "EStep", "EStepBiasScale",
+  "GaussianReconstruction", "MStep", "NormaliseBias", "Scale", "SimulateSlices", "SliceAverage",
+  "SliceToVolumeRegistration", "StackRegistrations", "Superresolution", "SuperresolutionCGDiagonal",
+  "SuperresolutionCGNormal", "SuperresolutionCGRegularization", "SuperresolutionGather",
+  "SuperresolutionResidual"
+};
+
+size_t irtkReconstruction::GetGrainSize(const char* stage)
+{
+  map<string, size_t>::const_iterator it = _grain_sizes.find(stage);
+  return (it != _grain_sizes.end()) ? it->second : 1;
+}
+
+void irtkReconstruction::SetGrainSize(const string& stage, size_t grain)
+{
+  const size_t n = sizeof(irtkGrainSizeStages) / sizeof(irtkGrainSizeStages[0]);
+  if (find(irtkGrainSizeStages, irtkGrainSizeStages + n, stage) == irtkGrainSizeStages + n) {
+    cerr << "Unknown stage " << stage << " for the grain size, valid stages are:";
+    for (size_t i = 0; i < n; i++)
+      cerr << " " << irtkGrainSizeStages[i];
+    cerr << endl;
+    exit(1);
+  }
+  _grain_sizes[stage] = max(grain, size_t(1));
+}
+
+template <class Body>
+void irtkReconstruction::ParallelFor(const char* stage, size_t begin, size_t end, const Body& body)
+{
+  blocked_range<size_t> range(begin, end, GetGrainSize(stage));
+  if (!irtkProfiler::IsEnabled()) {
+    _arena.ParallelFor(range, body);
+    return;
+  }
+  irtkProfileScope scope((string("Parallel") + stage).c_str(), _arena.GetNumberOfThreads());
+  _arena.ParallelFor(range, irtkProfiledBody<Body>(body, scope));
+}
+
+template <class Body>
+void irtkReconstruction::ParallelReduce(const char* stage, size_t begin, size_t end, Body& body)
+{
+  blocked_range<size_t> range(begin, end, GetGrainSize(stage));
+  if (!irtkProfiler::IsEnabled()) {
+    _arena.ParallelReduce(range, body);
+    return;
+  }
+  irtkProfileScope scope((string("Parallel") + stage).c_str(), _arena.GetNumberOfThreads());
+  irtkProfiledReduceBody<Body> profiled(body, scope);
+  _arena.ParallelReduce(range, profiled);
+}
+
+//batched when the slice-volume matrix is spilled
+template <class Body>
+void irtkReconstruction::ParallelForSlices(const char* stage, const Body& body)
+{
+  if (!SliceBatchesValid()) {
+    ParallelFor(stage, 0, _slices.size(), body);
+    return;
+  }
+  //the OS reads the next batch while the current one is processed
+  PrefetchSliceBatch(0);
+  for (size_t b = 0; b + 1 < _slice_batches.size(); b++) {
+    if (b + 2 < _slice_batches.size())
+      PrefetchSliceBatch(b + 1);
+    ParallelFor(stage, _slice_batches[b], _slice_batches[b + 1], body);
+    ReleaseSliceBatch(b);
+  }
+}
+
+template <class Body>
+void irtkReconstruction::ParallelReduceSlices(const char* stage, Body& body)
+{
+  if (!SliceBatchesValid()) {
+    ParallelReduce(stage, 0, _slices.size(), body);
+    return;
+  }
+  //body keeps accumulating over the batches
+  PrefetchSliceBatch(0);
+  for (size_t b = 0; b + 1 < _slice_batches.size(); b++) {
+    if (b + 2 < _slice_batches.size())
+      PrefetchSliceBatch(b + 1);
+    ParallelReduce(stage, _slice_batches[b], _slice_batches[b + 1], body);
+    ReleaseSliceBatch(b);
+  }
+}
+
 class ParallelAverage{
   irtkReconstruction* reconstructor;
   vector<irtkRealImage> &stacks;
@@ -546,10 +657,7 @@ public:
 
   // execute
   void operator() () {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_reduce(blocked_range<size_t>(0, stacks.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelReduce("Average", 0, stacks.size(), *this);
   }
 };
 
@@ -616,10 +724,7 @@ public:
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, average.GetZ()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelFor("SliceAverage", 0, average.GetZ(), *this);
   }
 };
 
@@ -757,6 +862,7 @@ void irtkReconstruction::SetMask(irtkRealImage * mask, double sigma, double thre
   }
 
   _mask = _reconstructed;
+  InvalidateCoeffs();
 
   if (mask != NULL) {
     //if sigma is nonzero first smooth the mask
@@ -797,11 +903,89 @@ void irtkReconstruction::SetMask(irtkRealImage * mask, double sigma, double thre
   }
   //set flag that mask was created
   _have_mask = true;
+  //keep the mask at template resolution for SetReconstructionResolution
+  _template_mask = _mask;
+  InitializeMaskRuns();
 
   if (_debug)
     _mask.Write("mask.nii");
 }
 
+void irtkReconstruction::InitializeMaskRuns()
+{
+  _mask_runs.Initialize(_mask);
+  //CoeffInit spreads each PSF point over its 8 neighbouring voxels
+  //if one of them is inside the mask
+  _active_runs.Initialize(_mask, 1);
+
+  if (_debug)
+    cout << "Mask has " << _mask_runs.GetNumberOfVoxels() << " voxels in " << _mask_runs.GetNumberOfRuns()
+      << " runs, the slices reach " << _active_runs.GetNumberOfVoxels() << " of "
+      << _mask.GetNumberOfVoxels() << " voxels" << endl;
+}
+
+void irtkReconstruction::SetReconstructionResolution(double resolution)
+{
+  if (!_have_mask) {
+    cerr << "Please set the mask before changing the resolution of the reconstruction." << endl;
+    exit(1);
+  }
+
+  //the mask at template resolution defines the field of view of all levels,
+  //same geometry as irtkResampling with isotropic voxel size resolution
+  irtkImageAttributes attr = _template_mask.GetImageAttributes();
+  if (resolution != attr._dx) {
+    int x = int(attr._x * attr._dx / resolution);
+    int y = int(attr._y * attr._dy / resolution);
+    int z = int(attr._z * attr._dz / resolution);
+    if (x >= 1) { attr._x = x; attr._dx = resolution; }
+    if (y >= 1) { attr._y = y; attr._dy = resolution; }
+    if (z >= 1) { attr._z = z; attr._dz = resolution; }
+  }
+
+  if (attr == _reconstructed.GetImageAttributes())
+    return;
+
+  cout << "Reconstructing with isotropic voxel size " << resolution << endl;
+
+  irtkRigidTransformation transformation;
+  irtkImageTransformation imagetransformation;
+  imagetransformation.PutTargetPaddingValue(-1);
+  imagetransformation.PutSourcePaddingValue(0);
+
+  //interpolate the current reconstruction
+  irtkRealImage reconstructed(attr);
+  irtkLinearInterpolateImageFunction interpolator;
+  imagetransformation.SetInput(&_reconstructed, &transformation);
+  imagetransformation.SetOutput(&reconstructed);
+  imagetransformation.PutInterpolator(&interpolator);
+  imagetransformation.Run();
+
+  _reconstructed = reconstructed;
+  InitializeResolution(attr);
+}
+
+void irtkReconstruction::InitializeResolution(const irtkImageAttributes& attr)
+{
+  //resample the mask from template resolution, so it does not degrade
+  irtkRigidTransformation transformation;
+  irtkImageTransformation imagetransformation;
+  irtkRealImage mask(attr);
+  irtkNearestNeighborInterpolateImageFunction nn;
+  imagetransformation.PutTargetPaddingValue(-1);
+  imagetransformation.PutSourcePaddingValue(0);
+  imagetransformation.SetInput(&_template_mask, &transformation);
+  imagetransformation.SetOutput(&mask);
+  imagetransformation.PutInterpolator(&nn);
+  imagetransformation.Run();
+
+  _mask = mask;
+  InitializeMaskRuns();
+  //volume sized images of the previous level are recomputed by CoeffInit and Superresolution
+  _volume_weights.Initialize(attr);
+  _confidence_map.Initialize(attr);
+}
+
 void irtkReconstruction::TransformMask(irtkRealImage& image, irtkRealImage& mask,
   irtkRigidTransformation& transformation)
 {
@@ -851,7 +1035,7 @@ class ParallelStackRegistrations {
   vector<irtkRealImage>& stacks;
   vector<irtkRigidTransformation>& stack_transformations;
   int templateNumber;
-  irtkGreyImage& target;
+  irtkRealImage& target;
   irtkRigidTransformation& offset;
   bool _externalTemplate;
 
@@ -860,7 +1044,7 @@ public:
     vector<irtkRealImage>& _stacks,
     vector<irtkRigidTransformation>& _stack_transformations,
     int _templateNumber,
-    irtkGreyImage& _target,
+    irtkRealImage& _target,
     irtkRigidTransformation& _offset,
     bool externalTemplate = false) :
     reconstructor(_reconstructor),
@@ -883,17 +1067,15 @@ public:
       irtkImageRigidRegistrationWithPadding registration;
       //irtkRigidTransformation transformation = stack_transformations[i];
 
-      //set target and source (need to be converted to irtkGreyImage)
-      irtkGreyImage source = stacks[i];
-
       //include offset in trasformation   
       irtkMatrix mo = offset.GetMatrix();
       irtkMatrix m = stack_transformations[i].GetMatrix();
       m = m*mo;
       stack_transformations[i].PutMatrix(m);
 
-      //perform rigid registration
-      registration.SetInput(&target, &source);
+      //perform rigid registration, target and source are converted with a
+      //common intensity scale
+      registration.SetInput(&target, &stacks[i]);
       registration.SetOutput(&stack_transformations[i]);
       if (_externalTemplate)
       {
@@ -929,10 +1111,7 @@ public:
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, stacks.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelFor("StackRegistrations", 0, stacks.size(), *this);
   }
 
 };
@@ -946,7 +1125,7 @@ void irtkReconstruction::StackRegistrations(vector<irtkRealImage>& stacks,
   InvertStackTransformations(stack_transformations);
 
   //template is set as the target
-  irtkGreyImage target;
+  irtkRealImage target;
   if (!useExternalTarget)
   {
     target = stacks[templateNumber];
@@ -1045,16 +1224,17 @@ void irtkReconstruction::ScaleVolume()
     irtkRealImage& slice = _slices[inputIndex];
 
     //alias for the current weight image
-    irtkRealImage& w = _weights[inputIndex];
+    irtkSliceField w = _slice_states.Weights(inputIndex);
 
     // alias for the current simulated slice
-    irtkRealImage& sim = _simulated_slices[inputIndex];
+    irtkSliceField sim = _slice_states.Simulated(inputIndex);
+    irtkSliceField simw = _slice_states.SimulatedWeights(inputIndex);
 
     for (i = 0; i < slice.GetX(); i++)
       for (j = 0; j < slice.GetY(); j++)
         if (slice(i, j, 0) != -1) {
       //scale - intensity matching
-      if (_simulated_weights[inputIndex](i, j, 0) > 0.99) {
+      if (simw(i, j, 0) > 0.99) {
         scalenum += w(i, j, 0) * _slice_weight_cpu[inputIndex] * slice(i, j, 0) * sim(i, j, 0);
         scaleden += w(i, j, 0) * _slice_weight_cpu[inputIndex] * sim(i, j, 0) * sim(i, j, 0);
       }
@@ -1068,10 +1248,13 @@ void irtkReconstruction::ScaleVolume()
   if (_debug)
     cout << " scale = " << scale;
 
+  //voxels the slices do not reach are not positive
   irtkRealPixel *ptr = _reconstructed.GetPointerToVoxels();
-  for (i = 0; i < _reconstructed.GetNumberOfVoxels(); i++) {
-    if (*ptr>0) *ptr = *ptr * scale;
-    ptr++;
+  for (int r = 0; r < _active_runs.GetNumberOfRuns(); r++) {
+    const VOXELRUN& run = _active_runs.GetRun(r);
+    irtkRealPixel *p = ptr + _active_runs.Index(run);
+    for (i = 0; i < run.length; i++)
+      if (p[i] > 0) p[i] = p[i] * scale;
   }
   cout << endl;
 }
@@ -1097,14 +1280,10 @@ public:
   void operator() (const blocked_range<size_t> &r) const {
     for (size_t inputIndex = r.begin(); inputIndex != r.end(); ++inputIndex) {
       //Calculate simulated slice
-      reconstructor->_simulated_slices[inputIndex].Initialize(reconstructor->_slices[inputIndex].GetImageAttributes());
-      reconstructor->_simulated_slices[inputIndex] = 0;
-
-      reconstructor->_simulated_weights[inputIndex].Initialize(reconstructor->_slices[inputIndex].GetImageAttributes());
-      reconstructor->_simulated_weights[inputIndex] = 0;
-
-      reconstructor->_simulated_inside[inputIndex].Initialize(reconstructor->_slices[inputIndex].GetImageAttributes());
-      reconstructor->_simulated_inside[inputIndex] = 0;
+      irtkSliceStates& states = reconstructor->_slice_states;
+      states.ClearSimulation(inputIndex);
+      irtkSliceField sim = states.Simulated(inputIndex);
+      irtkSliceField simw = states.SimulatedWeights(inputIndex);
 
       reconstructor->_slice_inside_cpu[inputIndex] = false;
 
@@ -1112,20 +1291,22 @@ public:
       for (int i = 0; i < reconstructor->_slices[inputIndex].GetX(); i++)
         for (int j = 0; j < reconstructor->_slices[inputIndex].GetY(); j++)
           if (reconstructor->_slices[inputIndex](i, j, 0) != -1) {
+        double value = 0;
         double weight = 0;
-        size_t n = reconstructor->_volcoeffs[inputIndex][i][j].size();
+        const POINT3D *coeffs = reconstructor->_volcoeffs[inputIndex].Begin(i, j);
+        size_t n = reconstructor->_volcoeffs[inputIndex].Size(i, j);
         for (int k = 0; k < n; k++) {
-          p = reconstructor->_volcoeffs[inputIndex][i][j][k];
-          reconstructor->_simulated_slices[inputIndex](i, j, 0) += p.value * reconstructor->_reconstructed(p.x, p.y, p.z);
+          p = coeffs[k];
+          value += p.value * reconstructor->_reconstructed(p.x, p.y, p.z);
           weight += p.value;
           if (reconstructor->_mask(p.x, p.y, p.z) == 1) {
-            reconstructor->_simulated_inside[inputIndex](i, j, 0) = 1;
+            states.SetInside(inputIndex, i, j);
             reconstructor->_slice_inside_cpu[inputIndex] = true;
           }
         }
         if (weight > 0) {
-          reconstructor->_simulated_slices[inputIndex](i, j, 0) /= weight;
-          reconstructor->_simulated_weights[inputIndex](i, j, 0) = weight;
+          sim(i, j, 0) = value / weight;
+          simw(i, j, 0) = weight;
         }
           }
 
@@ -1134,10 +1315,7 @@ public:
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelForSlices("SimulateSlices", *this);
   }
 
 };
@@ -1145,9 +1323,15 @@ public:
 
 void irtkReconstruction::SimulateSlices()
 {
+  irtkProfileScope profile("SimulateSlices");
+  irtkProfiler::Count("slices", _slices.size());
+
   if (_debug)
     cout << "Simulating slices." << endl;
 
+  if (!_slice_states.Matches(_slices))
+    _slice_states.Initialize(_slices);
+
   ParallelSimulateSlices parallelSimulateSlices(this);
   parallelSimulateSlices();
 
@@ -1155,8 +1339,8 @@ void irtkReconstruction::SimulateSlices()
     cout << "done." << endl;
   if(_debugGPU)
   {
-    _simulated_weights[40].Write("testsimweights40.nii");
-    _simulated_slices[40].Write("testsimslices40.nii");
+    _slice_states.GetImage(irtkSliceStates::SIMULATED_WEIGHTS, 40, _slices[40].GetImageAttributes()).Write("testsimweights40.nii");
+    _slice_states.GetImage(irtkSliceStates::SIMULATED, 40, _slices[40].GetImageAttributes()).Write("testsimslices40.nii");
 }
 }
 
@@ -1235,9 +1419,10 @@ void irtkReconstruction::SimulateStacks(vector<irtkRealImage>& stacks)
         for (j = 0; j < slice.GetY(); j++)
           if (slice(i, j, 0) != -1) {
         weight = 0;
-        n = _volcoeffs[inputIndex][i][j].size();
+        const POINT3D *coeffs = _volcoeffs[inputIndex].Begin(i, j);
+        n = _volcoeffs[inputIndex].Size(i, j);
         for (k = 0; k < n; k++) {
-          p = _volcoeffs[inputIndex][i][j][k];
+          p = coeffs[k];
           sim(i, j, 0) += p.value * _reconstructed(p.x, p.y, p.z);
           weight += p.value;
         }
@@ -1650,9 +1835,6 @@ void irtkReconstruction::CreateSlicesAndTransformationsPatchBased(int patchSize,
             patch.PutPixelSize(attr._dx, attr._dy, thickness[i]);
             //remember the slice
             _slices.push_back(patch);
-            _simulated_slices.push_back(patch);
-            _simulated_weights.push_back(patch);
-            _simulated_inside.push_back(patch);
             //remeber stack index for this slice
             _stack_index.push_back(i);
             //initialize slice transformation with the stack transformation
@@ -1789,9 +1971,6 @@ void irtkReconstruction::CreateSlicesAndTransformationsSuperpixelBased(vector<ir
         patch.PutPixelSize(attr._dx, attr._dy, thickness[i]);
         //remember the slice
         _slices.push_back(patch);
-        _simulated_slices.push_back(patch);
-        _simulated_weights.push_back(patch);
-        _simulated_inside.push_back(patch);
         //remeber stack index for this slice
         _stack_index.push_back(i);
         //initialize slice transformation with the stack transformation
@@ -1834,9 +2013,6 @@ void irtkReconstruction::CreateSlicesAndTransformations(vector<irtkRealImage> &s
       slice.PutPixelSize(attr._dx, attr._dy, thickness[i]);
       //remember the slice
       _slices.push_back(slice);
-      _simulated_slices.push_back(slice);
-      _simulated_weights.push_back(slice);
-      _simulated_inside.push_back(slice);
       //remeber stack index for this slice
       _stack_index.push_back(i);
       //initialize slice transformation with the stack transformation
@@ -1856,6 +2032,7 @@ void irtkReconstruction::ResetSlices(vector<irtkRealImage>& stacks,
     cout << "ResetSlices" << endl;
 
   _slices.clear();
+  InvalidateCoeffs();
 
   //for each stack
   for (unsigned int i = 0; i < stacks.size(); i++) {
@@ -1874,10 +2051,7 @@ void irtkReconstruction::ResetSlices(vector<irtkRealImage>& stacks,
   }
   cout << "Number of slices: " << _slices.size() << endl;
 
-  for (int i = 0; i < _slices.size(); i++) {
-    _bias[i].Initialize(_slices[i].GetImageAttributes());
-    _weights[i].Initialize(_slices[i].GetImageAttributes());
-  }
+  _slice_states.Initialize(_slices);
 }
 
 void irtkReconstruction::SetSlicesAndTransformations(vector<irtkRealImage>& slices,
@@ -1886,13 +2060,11 @@ void irtkReconstruction::SetSlicesAndTransformations(vector<irtkRealImage>& slic
   vector<double>& thickness)
 {
   _slices.clear();
+  InvalidateCoeffs();
   _stack_index.clear();
   _transformations.clear();
   _transformations_gpu.clear();
   _slices.clear();
-  _simulated_slices.clear();
-  _simulated_weights.clear();
-  _simulated_inside.clear();
 
   //for each slice
   for (unsigned int i = 0; i < slices.size(); i++) {
@@ -1904,9 +2076,6 @@ void irtkReconstruction::SetSlicesAndTransformations(vector<irtkRealImage>& slic
     slice.PutPixelSize(slice.GetXSize(), slice.GetYSize(), thickness[i]);
     //remember the slice
     _slices.push_back(slice);
-    _simulated_slices.push_back(slice);
-    _simulated_weights.push_back(slice);
-    _simulated_inside.push_back(slice);
     //remember stack index for this slice
     _stack_index.push_back(stack_ids[i]);
     //get slice transformation
@@ -1918,6 +2087,7 @@ void irtkReconstruction::SetSlicesAndTransformations(vector<irtkRealImage>& slic
 void irtkReconstruction::UpdateSlices(vector<irtkRealImage>& stacks, vector<double>& thickness)
 {
   _slices.clear();
+  InvalidateCoeffs();
   //for each stack
   for (unsigned int i = 0; i < stacks.size(); i++) {
     //image attributes contain image and voxel size
@@ -1951,6 +2121,7 @@ void irtkReconstruction::MaskSlices()
   }
   printf("%d %d \n", _slices.size(), _transformations.size());
   //_mask.Write("mask.nii");
+  InvalidateCoeffs();
 
   //mask slices
   for (int unsigned inputIndex = 0; inputIndex < _slices.size(); inputIndex++) {
@@ -1989,19 +2160,45 @@ void irtkReconstruction::MaskSlices()
 
 
 //TODO implement non rigid registration and its evaluation in cuda...
+//counts the similarity and gradient evaluations of a registration for the
+//profiler, finite difference gradients also count their similarity evaluations
+class irtkCountingRigidRegistration : public irtkImageRigidRegistrationWithPadding {
+public:
+  int evaluations;
+  int gradients;
+
+  irtkCountingRigidRegistration() : evaluations(0), gradients(0) { }
+
+protected:
+  virtual double Evaluate() {
+    evaluations++;
+    return irtkImageRigidRegistrationWithPadding::Evaluate();
+  }
+
+  virtual double EvaluateGradient(float step, float *dx) {
+    gradients++;
+    return irtkImageRigidRegistrationWithPadding::EvaluateGradient(step, dx);
+  }
+};
+
 class ParallelSliceToVolumeRegistration {
 public:
   irtkReconstruction *reconstructor;
+  //reconstructed volume and its pyramid, shared read-only by all slices
+  irtkGreyImage *source;
+  const irtkSourcePyramid *pyramid;
+  //common intensity scale of the volume and the slices
+  double scale;
 
   ParallelSliceToVolumeRegistration(irtkReconstruction *_reconstructor) :
-    reconstructor(_reconstructor) { }
+    reconstructor(_reconstructor), source(NULL), pyramid(NULL), scale(1) { }
 
   void operator() (const blocked_range<size_t> &r) const {
 
     irtkImageAttributes attr = reconstructor->_reconstructed.GetImageAttributes();
 
     for (size_t inputIndex = r.begin(); inputIndex != r.end(); ++inputIndex) {
-      irtkImageRigidRegistrationWithPadding registration;
+      irtkCountingRigidRegistration registration;
       irtkGreyPixel smin, smax;
       irtkGreyImage target;
       irtkRealImage slice, w, b, t;
@@ -2013,7 +2210,7 @@ public:
       resampling.SetInput(&reconstructor->_slices[inputIndex]);
       resampling.SetOutput(&t);
       resampling.Run();
-      target = t;
+      irtkConvertToGrey(&t, &target, scale);
 
       target.GetMinMax(&smin, &smax);
 
@@ -2029,12 +2226,14 @@ public:
         //std::cout << " ofsMatrix: " << inputIndex << std::endl;
         //reconstructor->_transformations[inputIndex].GetMatrix().Print();
 
-        irtkGreyImage source = reconstructor->_reconstructed;
-        registration.SetInput(&target, &source);
+        registration.SetInput(&target, source);
         registration.SetOutput(&reconstructor->_transformations[inputIndex]);
         registration.GuessParameterSliceToVolume(reconstructor->_useNMI);
         registration.SetTargetPadding(-1);
+        registration.SetSourcePyramid(pyramid);
         registration.Run();
+        irtkProfiler::Count("cost evaluations", registration.evaluations);
+        irtkProfiler::Count("gradient evaluations", registration.gradients);
 
         reconstructor->_slices_regCertainty[inputIndex] = registration.last_similarity;
         //undo the offset
@@ -2050,10 +2249,23 @@ public:
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    //blur and resample the reconstructed volume once for all slices, with
+    //the source parameters the slice registrations guess for it. The slices
+    //are on the intensity scale of the volume and converted with its scale
+    irtkGreyImage volume;
+    double volume_scale = irtkCalculateIntensityScale(&reconstructor->_reconstructed);
+    irtkConvertToGrey(&reconstructor->_reconstructed, &volume, volume_scale);
+    irtkImageRigidRegistrationWithPadding registration;
+    registration.SetInput(&volume, &volume);
+    registration.GuessParameterSliceToVolume(reconstructor->_useNMI);
+    irtkSourcePyramid levels;
+    levels.Initialize(&registration, &volume);
+
+    ParallelSliceToVolumeRegistration body(*this);
+    body.source = &volume;
+    body.pyramid = &levels;
+    body.scale = volume_scale;
+    reconstructor->ParallelFor("SliceToVolumeRegistration", 0, reconstructor->_slices.size(), body);
   }
 
 };
@@ -2206,11 +2418,10 @@ public:
 
   // execute
   void operator() () const {
-    task_scheduler_init init(reconstructor->reconstructionGPU->devicesToUse.size());
-    //tbb_no_threads
-    parallel_for(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    //one thread per GPU
+    irtkTaskArena& arena = reconstructor->_device_arena;
+    arena.SetNumberOfThreads(reconstructor->reconstructionGPU->devicesToUse.size());
+    arena.ParallelFor(blocked_range<size_t>(0, reconstructor->_slices.size()), *this);
   }
 
 };
@@ -2290,6 +2501,9 @@ void irtkReconstruction::SliceToVolumeRegistrationGPU()
 
 void irtkReconstruction::SliceToVolumeRegistration()
 {
+  irtkProfileScope profile("SliceToVolumeRegistration");
+  irtkProfiler::Count("slices", _slices.size());
+
   if (_slices_regCertainty.size() == 0) _slices_regCertainty.resize(_slices.size());
   if (_debug)
     cout << "SliceToVolumeRegistration" << endl;
@@ -2305,13 +2519,17 @@ void irtkReconstruction::SliceToVolumeRegistration()
 class ParallelCoeffInit {
 public:
   irtkReconstruction *reconstructor;
+  //slices to compute the matrix for
+  const vector<int>& slices;
 
-  ParallelCoeffInit(irtkReconstruction *_reconstructor) :
-    reconstructor(_reconstructor) { }
+  ParallelCoeffInit(irtkReconstruction *_reconstructor, const vector<int>& _slices) :
+    reconstructor(_reconstructor), slices(_slices) { }
 
   void operator() (const blocked_range<size_t> &r) const {
 
-    for (size_t inputIndex = r.begin(); inputIndex != r.end(); ++inputIndex) {
+    for (size_t index = r.begin(); index != r.end(); ++index) {
+
+      int inputIndex = slices[index];
 
       bool slice_inside;
 
@@ -2332,8 +2550,8 @@ public:
 
       //prepare structures for storage
       POINT3D p;
-      VOXELCOEFFS empty;
-      SLICECOEFFS slicecoeffs(slice.GetX(), vector < VOXELCOEFFS >(slice.GetY(), empty));
+      irtkSliceCoeffs& slicecoeffs = reconstructor->_volcoeffs[inputIndex];
+      slicecoeffs.Initialize(slice.GetX(), slice.GetY());
 
       //to check whether the slice has an overlap with mask ROI
       slice_inside = false;
@@ -2344,92 +2562,22 @@ public:
       double dx, dy, dz;
       slice.GetPixelSize(&dx, &dy, &dz);
 
-      //sigma of 3D Gaussian (sinc with FWHM=dx or dy in-plane, Gaussian with FWHM = dz through-plane)
-      double sigmax = 1.2 * dx / 2.3548;
-      double sigmay = 1.2 * dy / 2.3548;
-      double sigmaz = dz / 2.3548;
-      /*
-      cout<<"Original sigma"<<sigmax<<" "<<sigmay<<" "<<sigmaz<<endl;
-
-      //readjust for resolution of the volume
-      //double sigmax,sigmay,sigmaz;
-      double sigmamin = res/(3*2.3548);
-
-      if((dx-res)>sigmamin)
-      sigmax = 1.2 * sqrt(dx*dx-res*res) / 2.3548;
-      else sigmax = sigmamin;
-
-      if ((dy-res)>sigmamin)
-      sigmay = 1.2 * sqrt(dy*dy-res*res) / 2.3548;
-      else
-      sigmay=sigmamin;
-      if ((dz-1.2*res)>sigmamin)
-      sigmaz = sqrt(dz*dz-1.2*1.2*res*res) / 2.3548;
-      else sigmaz=sigmamin;
-
-      cout<<"Adjusted sigma:"<<sigmax<<" "<<sigmay<<" "<<sigmaz<<endl;
-      */
-
-      //calculate discretized PSF
-
-      //isotropic voxel size of PSF - derived from resolution of reconstructed volume
-      double size = res / reconstructor->_quality_factor;
-
-      //number of voxels in each direction
-      //the ROI is 2*voxel dimension
-
-      int xDim = round(2 * dx / size);
-      int yDim = round(2 * dy / size);
-      int zDim = round(2 * dz / size);
-
-      //image corresponding to PSF
-      irtkImageAttributes attr;
-      attr._x = xDim;
-      attr._y = yDim;
-      attr._z = zDim;
-      attr._dx = size;
-      attr._dy = size;
-      attr._dz = size;
-      irtkRealImage PSF(attr);
-
-      //centre of PSF
-      double cx, cy, cz;
-      cx = 0.5 * (xDim - 1);
-      cy = 0.5 * (yDim - 1);
-      cz = 0.5 * (zDim - 1);
-      PSF.ImageToWorld(cx, cy, cz);
-
-      double x, y, z;
-      double sum = 0;
-      int i, j, k;
-      for (i = 0; i < xDim; i++)
-        for (j = 0; j < yDim; j++)
-          for (k = 0; k < zDim; k++) {
-        x = i;
-        y = j;
-        z = k;
-        PSF.ImageToWorld(x, y, z);
-        x -= cx;
-        y -= cy;
-        z -= cz;
-        //continuous PSF does not need to be normalized as discrete will be
-        PSF(i, j, k) = exp(
-          -x * x / (2 * sigmax * sigmax) - y * y / (2 * sigmay * sigmay)
-          - z * z / (2 * sigmaz * sigmaz));
-        sum += PSF(i, j, k);
-          }
-      PSF /= sum;
+      //discretized PSF and its sample offsets are shared by slices of equal voxel size
+      const irtkPSFKernel& kernel = reconstructor->_psf_cache.Get(dx, dy, dz, res, reconstructor->_quality_factor);
+      int nsamples = kernel.values.size();
+      const double *offsets = kernel.offsets.data();
+      const double *values = kernel.values.data();
 
       if (reconstructor->_debug)
-        if (inputIndex == 0)
+        if (inputIndex == 0) {
+          irtkRealImage PSF = kernel.PSF;
           PSF.Write("PSF.nii.gz");
+        }
 
       //prepare storage for PSF transformed and resampled to the space of reconstructed volume
-      //maximum dim of rotated kernel - the next higher odd integer plus two to accound for rounding error of tx,ty,tz.
-      //Note conversion from PSF image coordinates to tPSF image coordinates *size/res
-      int dim = (floor(ceil(sqrt(double(xDim * xDim + yDim * yDim + zDim * zDim)) * size / res) / 2))
-        * 2 + 1 + 2;
+      int dim = kernel.dim;
       //prepare image attributes. Voxel dimension will be taken from the reconstructed volume
+      irtkImageAttributes attr;
       attr._x = dim;
       attr._y = dim;
       attr._z = dim;
@@ -2441,6 +2589,10 @@ public:
       //calculate centre of tPSF in image coordinates
       int centre = (dim - 1) / 2;
 
+      double x, y, z;
+      double sum;
+      int i, j;
+
       //for each voxel in current slice calculate matrix coefficients
       int ii, jj, kk;
       int tx, ty, tz;
@@ -2468,36 +2620,17 @@ public:
               tPSF(ii, jj, kk) = 0;
 
         //for each POINT3D of the PSF
-        for (ii = 0; ii < xDim; ii++)
-          for (jj = 0; jj < yDim; jj++)
-            for (kk = 0; kk < zDim; kk++) {
+        for (int sample = 0; sample < nsamples; sample++) {
           //Calculate the position of the POINT3D of
           //PSF centered over current slice voxel                            
           //This is a bit complicated because slices
           //can be oriented in any direction 
 
-          //PSF image coordinates
-          x = ii;
-          y = jj;
-          z = kk;
-          //change to PSF world coordinates - now real sizes in mm
-          PSF.ImageToWorld(x, y, z);
-          //centre around the centrepoint of the PSF
-          x -= cx;
-          y -= cy;
-          z -= cz;
-
-          //Need to convert (x,y,z) to slice image
-          //coordinates because slices can have
-          //transformations included in them (they are
-          //nifti)  and those are not reflected in
-          //PSF. In slice image coordinates we are
-          //sure that z is through-plane 
-
-          //adjust according to voxel size
-          x /= dx;
-          y /= dy;
-          z /= dz;
+          //PSF sample offset in slice image coordinates,
+          //in which we are sure that z is through-plane
+          x = offsets[3 * sample];
+          y = offsets[3 * sample + 1];
+          z = offsets[3 * sample + 2];
           //center over current voxel
           x += i;
           y += j;
@@ -2560,7 +2693,7 @@ public:
             cc = n - tz + centre;
 
             //resulting value
-            double value = PSF(ii, jj, kk) * weight / sum;
+            double value = values[sample] * weight / sum;
 
             //Check that we are in tPSF
             if ((aa < 0) || (aa >= dim) || (bb < 0) || (bb >= dim) || (cc < 0)
@@ -2588,16 +2721,16 @@ public:
           p.y = jj + ty - centre;
           p.z = kk + tz - centre;
           p.value = (float)tPSF(ii, jj, kk);
-          slicecoeffs[i][j].push_back(p);
+          slicecoeffs.Push(p);
               }
-        //cout << " n = " << slicecoeffs[i][j].size() << std::endl;
+        slicecoeffs.ClosePixel(i, j);
+        //cout << " n = " << slicecoeffs.Size(i, j) << std::endl;
           } //end of loop for slice voxels
+      slicecoeffs.Finalize();
 
       //tPSF.Write("tPSF.nii");
       //PSF.Write("PSF.nii");
 
-
-      reconstructor->_volcoeffs[inputIndex] = slicecoeffs;
       reconstructor->_slice_inside_cpu[inputIndex] = slice_inside;
 
     }  //end of loop through the slices                            
@@ -2606,63 +2739,148 @@ public:
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelFor("CoeffInit", 0, slices.size(), *this);
   }
 
 };
 
+bool irtkReconstruction::CoeffsMoved(int inputIndex)
+{
+  irtkRigidTransformation& current = _transformations[inputIndex];
+  irtkRigidTransformation& previous = _coeffs_transformations[inputIndex];
+
+  //parameters 0-2 are translations in mm, 3-5 rotations in degrees
+  for (int i = 0; i < 6; i++) {
+    double tolerance = (i < 3) ? _coeffs_translation_tolerance : _coeffs_rotation_tolerance;
+    if (fabs(current.Get(i) - previous.Get(i)) > tolerance)
+      return true;
+  }
+  return false;
+}
+
 void irtkReconstruction::CoeffInit()
 {
+  irtkProfileScope profile("CoeffInit");
+
   if (_debug)
     cout << "CoeffInit" << endl;
 
-  //clear slice-volume matrix from previous iteration
-  _volcoeffs.clear();
-  _volcoeffs.resize(_slices.size());
+  int inputIndex, i, j, n, k;
+
+  //slices whose matrix has to be computed
+  vector<int> update;
+
+  if ((_coeffs_transformations.size() != _slices.size())
+    || (_coeffs_quality_factor != _quality_factor)
+    || !(_coeffs_attr == _reconstructed.GetImageAttributes())) {
+    //clear slice-volume matrix from previous iteration
+    _volcoeffs.clear();
+    _volcoeffs.resize(_slices.size());
+    _coeff_spill.Close();
 
-  //clear indicator of slice having and overlap with volumetric mask
-  _slice_inside_cpu.clear();
-  _slice_inside_cpu.resize(_slices.size());
+    //clear indicator of slice having and overlap with volumetric mask
+    _slice_inside_cpu.clear();
+    _slice_inside_cpu.resize(_slices.size());
+
+    _coeffs_transformations = _transformations;
+    _coeffs_quality_factor = _quality_factor;
+    _coeffs_attr = _reconstructed.GetImageAttributes();
+    for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex)
+      update.push_back(inputIndex);
+  }
+  else {
+    //only recompute slices which moved since their matrix was computed
+    for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex)
+      if (CoeffsMoved(inputIndex)) {
+        _coeffs_transformations[inputIndex] = _transformations[inputIndex];
+        update.push_back(inputIndex);
+      }
+  }
+  _coeffs_reused = _slices.size() - update.size();
 
   cout << "Initialising matrix coefficients...";
-  ParallelCoeffInit coeffinit(this);
-  coeffinit();
-  cout << " ... done." << endl;
+  if (_memory_budget > 0) {
+    //compute the matrix in chunks and move the coefficients to the spill file
+    //whenever the ones in memory exceed half of the budget
+    size_t chunk = 64;
+    for (size_t start = 0; start < update.size(); start += chunk) {
+      vector<int> part(update.begin() + start, update.begin() + min(start + chunk, update.size()));
+      ParallelCoeffInit coeffinit(this, part);
+      coeffinit();
+      if (ResidentCoeffsSize() > _memory_budget / 2)
+        SpillResidentCoeffs();
+    }
+    if (_coeff_spill.IsOpen()) {
+      SpillResidentCoeffs();
+      MapSpilledCoeffs();
+    }
+  }
+  else {
+    ParallelCoeffInit coeffinit(this, update);
+    coeffinit();
+  }
+  cout << " ... done. Reused " << _coeffs_reused << " of " << _slices.size() << " slices." << endl;
+  irtkProfiler::Count("slices", update.size());
+
+  if (_debug || irtkProfiler::IsEnabled()) {
+    size_t num_coeffs = 0, mem_coeffs = 0;
+    for (inputIndex = 0; inputIndex < _volcoeffs.size(); ++inputIndex) {
+      num_coeffs += _volcoeffs[inputIndex].GetNumberOfCoefficients();
+      mem_coeffs += _volcoeffs[inputIndex].GetMemorySize();
+    }
+    irtkProfiler::Count("coefficients", num_coeffs);
+    irtkProfiler::Count("bytes", mem_coeffs);
+    if (_debug) {
+      cout << "Matrix coefficients: " << num_coeffs << " (" << mem_coeffs / (1024 * 1024) << " MB";
+      if (_coeff_spill.IsOpen())
+        cout << " in memory, " << _coeff_spill.GetSize() / (1024 * 1024) << " MB spilled in "
+          << _slice_batches.size() - 1 << " batches";
+      cout << ")" << endl;
+    }
+  }
 
   //prepare image for volume weights, will be needed for Gaussian Reconstruction
-  _volume_weights.Initialize(_reconstructed.GetImageAttributes());
-  _volume_weights = 0;
+  irtkAccumImage volume_weights(_reconstructed.GetImageAttributes());
 
-  int inputIndex, i, j, n, k;
   POINT3D p;
   for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex) {
     for (i = 0; i < _slices[inputIndex].GetX(); i++)
       for (j = 0; j < _slices[inputIndex].GetY(); j++) {
-      n = _volcoeffs[inputIndex][i][j].size();
+      const POINT3D *coeffs = _volcoeffs[inputIndex].Begin(i, j);
+      n = _volcoeffs[inputIndex].Size(i, j);
       for (k = 0; k < n; k++) {
-        p = _volcoeffs[inputIndex][i][j][k];
-        _volume_weights(p.x, p.y, p.z) += p.value;
+        p = coeffs[k];
+        volume_weights(p.x, p.y, p.z) += p.value;
       }
       }
   }
+  _volume_weights = volume_weights;
   if (_debug || _debugGPU)
     _volume_weights.Write("volume_weightsCPU.nii");
 
+  //volume-major copy of the matrix for gather-based superresolution
+  if (_gather_superresolution) {
+    if (_coeff_spill.IsOpen())
+      cout << "Warning: the transposed matrix for gather superresolution is kept in memory regardless of the memory budget." << endl;
+    _voxelcoeffs.Initialize(_volcoeffs, _reconstructed.GetX(), _reconstructed.GetY(), _reconstructed.GetZ());
+    if (_debug)
+      cout << "Transposed matrix coefficients: " << _voxelcoeffs.GetMemorySize() / (1024 * 1024) << " MB" << endl;
+  }
+
+  //drop the spilled coefficients read above from memory
+  if (SliceBatchesValid())
+    for (size_t b = 0; b + 1 < _slice_batches.size(); b++)
+      ReleaseSliceBatch(b);
+
   //find average volume weight to modify alpha parameters accordingly
   irtkRealPixel *ptr = _volume_weights.GetPointerToVoxels();
-  irtkRealPixel *pm = _mask.GetPointerToVoxels();
   double sum = 0;
-  int num = 0;
-  for (int i = 0; i < _volume_weights.GetNumberOfVoxels(); i++) {
-    if (*pm == 1) {
-      sum += *ptr;
-      num++;
-    }
-    ptr++;
-    pm++;
+  int num = _mask_runs.GetNumberOfVoxels();
+  for (int r = 0; r < _mask_runs.GetNumberOfRuns(); r++) {
+    const VOXELRUN& run = _mask_runs.GetRun(r);
+    irtkRealPixel *pw = ptr + _mask_runs.Index(run);
+    for (int i = 0; i < run.length; i++)
+      sum += pw[i];
   }
   _average_volume_weight = sum / num;
 
@@ -2672,6 +2890,86 @@ void irtkReconstruction::CoeffInit()
 
 }  //end of CoeffInit()
 
+size_t irtkReconstruction::ResidentCoeffsSize()
+{
+  size_t bytes = 0;
+  for (size_t inputIndex = 0; inputIndex < _volcoeffs.size(); ++inputIndex)
+    if (!_volcoeffs[inputIndex].IsSpilled())
+      bytes += _volcoeffs[inputIndex].GetDataSize();
+  return bytes;
+}
+
+void irtkReconstruction::SpillResidentCoeffs()
+{
+  if (!_coeff_spill.IsOpen() && !_coeff_spill.Open(_spill_dir)) {
+    cerr << "Could not create a spill file for the slice-volume matrix." << endl;
+    exit(1);
+  }
+  for (size_t inputIndex = 0; inputIndex < _volcoeffs.size(); ++inputIndex)
+    if (!_volcoeffs[inputIndex].IsSpilled())
+      _volcoeffs[inputIndex].Spill(_coeff_spill);
+}
+
+void irtkReconstruction::MapSpilledCoeffs()
+{
+  size_t live = 0;
+  _coeff_spill.Map();
+  for (size_t inputIndex = 0; inputIndex < _volcoeffs.size(); ++inputIndex) {
+    _volcoeffs[inputIndex].Attach(_coeff_spill);
+    if (_volcoeffs[inputIndex].IsSpilled())
+      live += _volcoeffs[inputIndex].GetDataSize();
+  }
+
+  //rewrite the file once most of it belongs to slices that were recomputed
+  if (_coeff_spill.GetSize() > 2 * live) {
+    irtkSpillFile compact;
+    if (!compact.Open(_spill_dir)) {
+      cerr << "Could not create a spill file for the slice-volume matrix." << endl;
+      exit(1);
+    }
+    for (size_t inputIndex = 0; inputIndex < _volcoeffs.size(); ++inputIndex)
+      if (_volcoeffs[inputIndex].IsSpilled())
+        _volcoeffs[inputIndex].Spill(compact);
+    _coeff_spill.Swap(compact);
+    _coeff_spill.Map();
+    for (size_t inputIndex = 0; inputIndex < _volcoeffs.size(); ++inputIndex)
+      _volcoeffs[inputIndex].Attach(_coeff_spill);
+  }
+
+  //batches of slices whose coefficients fit half of the budget, the other
+  //half is for prefetching the next batch
+  _slice_batches.assign(1, 0);
+  size_t bytes = 0;
+  for (size_t inputIndex = 0; inputIndex < _volcoeffs.size(); ++inputIndex) {
+    size_t size = _volcoeffs[inputIndex].GetDataSize();
+    if ((bytes > 0) && (bytes + size > _memory_budget / 2)) {
+      _slice_batches.push_back(inputIndex);
+      bytes = 0;
+    }
+    bytes += size;
+  }
+  _slice_batches.push_back(_volcoeffs.size());
+}
+
+bool irtkReconstruction::SliceBatchesValid()
+{
+  return _coeff_spill.IsOpen() && (_slice_batches.size() > 1) && (_slice_batches.back() == _slices.size());
+}
+
+void irtkReconstruction::PrefetchSliceBatch(size_t batch)
+{
+  for (size_t inputIndex = _slice_batches[batch]; inputIndex < _slice_batches[batch + 1]; ++inputIndex)
+    if (_volcoeffs[inputIndex].IsSpilled())
+      _coeff_spill.Prefetch(_volcoeffs[inputIndex].GetSpillOffset(), _volcoeffs[inputIndex].GetDataSize());
+}
+
+void irtkReconstruction::ReleaseSliceBatch(size_t batch)
+{
+  for (size_t inputIndex = _slice_batches[batch]; inputIndex < _slice_batches[batch + 1]; ++inputIndex)
+    if (_volcoeffs[inputIndex].IsSpilled())
+      _coeff_spill.Release(_volcoeffs[inputIndex].GetSpillOffset(), _volcoeffs[inputIndex].GetDataSize());
+}
+
 void irtkReconstruction::SyncCPU()
 {
   irtkGenericImage<float> trecon = _reconstructed_gpu;
@@ -2762,73 +3060,103 @@ void irtkReconstruction::GaussianReconstructionGPU()
 }
 
 
-void irtkReconstruction::GaussianReconstruction()
-{
-  //vector<int> voxel_num_;  
-  //reconstructionGPU->GaussianReconstruction(voxel_num_);
+class ParallelGaussianReconstruction {
+  irtkReconstruction* reconstructor;
+  vector<int>& voxel_num;
+public:
+  irtkAccumImage reconstructed;
 
-  cout << "Gaussian reconstruction ... ";
-  unsigned int inputIndex;
-  int i, j, k, n;
-  irtkRealImage slice;
-  double scale;
-  POINT3D p;
-  vector<int> voxel_num;
-  int slice_vox_num;
+  void operator()(const blocked_range<size_t>& r) {
+    for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
+      //alias the current slice
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
+      //alias the current bias image
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+      //read current scale factor
+      double scale = reconstructor->_scale_cpu[inputIndex];
 
-  //clear _reconstructed image
-  _reconstructed = 0;
+      int slice_vox_num = 0;
 
-  //std::cout << "voxel_num CPU: ";
-  //CPU
-  for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex) {
-    //copy the current slice
-    slice = _slices[inputIndex];
-    //alias the current bias image
-    irtkRealImage& b = _bias[inputIndex];
-    //read current scale factor
-    scale = _scale_cpu[inputIndex];
+      //Distribute slice intensities to the volume
+      POINT3D p;
+      for (int i = 0; i < slice.GetX(); i++)
+        for (int j = 0; j < slice.GetY(); j++)
+          if (slice(i, j, 0) != -1) {
+        //biascorrect and scale the slice
+        double value = slice(i, j, 0) * exp(-b(i, j, 0)) * scale;
 
-    slice_vox_num = 0;
+        //number of volume voxels with non-zero coefficients
+        //for current slice voxel
+        const POINT3D *coeffs = reconstructor->_volcoeffs[inputIndex].Begin(i, j);
+        size_t n = reconstructor->_volcoeffs[inputIndex].Size(i, j);
 
-    //Distribute slice intensities to the volume
-    for (i = 0; i < slice.GetX(); i++)
-      for (j = 0; j < slice.GetY(); j++)
-        if (slice(i, j, 0) != -1) {
-      //biascorrect and scale the slice
-      slice(i, j, 0) *= exp(-b(i, j, 0)) * scale;
+        //calculate num of vox in a slice that have overlap with roi
+        if (n > 0)
+          slice_vox_num++;
 
-      //number of volume voxels with non-zero coefficients
-      //for current slice voxel
-      n = _volcoeffs[inputIndex][i][j].size();
+        //add contribution of current slice voxel to all voxel volumes
+        //to which it contributes
+        for (size_t k = 0; k < n; k++) {
+          p = coeffs[k];
+          reconstructed(p.x, p.y, p.z) += p.value * value;
+        }
+          }
+      voxel_num[inputIndex] = slice_vox_num;
+      //end of loop for a slice inputIndex
+    }
+  }
 
-      //if given voxel is not present in reconstructed volume at all,
-      //pad it
+  ParallelGaussianReconstruction(ParallelGaussianReconstruction& x, split) :
+    reconstructor(x.reconstructor), voxel_num(x.voxel_num)
+  {
+    reconstructed.Initialize(reconstructor->_reconstructed.GetImageAttributes());
+    reconstructed = 0;
+  }
 
-      //if (n == 0)
-      //_slices[inputIndex].PutAsDouble(i, j, 0, -1);
-      //calculate num of vox in a slice that have overlap with roi
-      if (n > 0)
-        slice_vox_num++;
+  void join(const ParallelGaussianReconstruction& y) {
+    reconstructed += y.reconstructed;
+  }
 
-      //add contribution of current slice voxel to all voxel volumes
-      //to which it contributes
-      for (k = 0; k < n; k++) {
-        p = _volcoeffs[inputIndex][i][j][k];
-        _reconstructed(p.x, p.y, p.z) += p.value * slice(i, j, 0);
-      }
-      //debug
-      //p = _volcoeffs[inputIndex][i][j][0];
-      //_reconstructed(p.x, p.y, p.z) += slice(i, j, 0);
-        }
-    voxel_num.push_back(slice_vox_num);
-    //std::cout << voxel_num[inputIndex] << " ";
-    //end of loop for a slice inputIndex
+  ParallelGaussianReconstruction(irtkReconstruction *reconstructor, vector<int>& voxel_num) :
+    reconstructor(reconstructor), voxel_num(voxel_num)
+  {
+    reconstructed.Initialize(reconstructor->_reconstructed.GetImageAttributes());
+    reconstructed = 0;
   }
 
+  // execute
+  void operator() () {
+    reconstructor->ParallelReduceSlices("GaussianReconstruction", *this);
+  }
+};
+
+void irtkReconstruction::GaussianReconstruction()
+{
+  irtkProfileScope profile("GaussianReconstruction");
+  irtkProfiler::Count("slices", _slices.size());
+
+  //vector<int> voxel_num_;  
+  //reconstructionGPU->GaussianReconstruction(voxel_num_);
+
+  cout << "Gaussian reconstruction ... ";
+  int i;
+  //number of voxels of each slice that overlap with the ROI
+  vector<int> voxel_num(_slices.size(), 0);
+
+  ParallelGaussianReconstruction parallelGaussianReconstruction(this, voxel_num);
+  parallelGaussianReconstruction();
+  _reconstructed = parallelGaussianReconstruction.reconstructed;
+
   //normalize the volume by proportion of contributing slice voxels
-  //for each volume voxe
-  _reconstructed /= _volume_weights;
+  //for each volume voxe, voxels the slices do not reach stay 0
+  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  irtkRealPixel *pw = _volume_weights.GetPointerToVoxels();
+  for (int r = 0; r < _active_runs.GetNumberOfRuns(); r++) {
+    const VOXELRUN& run = _active_runs.GetRun(r);
+    int index = _active_runs.Index(run);
+    for (i = index; i < index + run.length; i++)
+      pr[i] = (pw[i] != 0) ? pr[i] / pw[i] : 0;
+  }
 
   cout << "done." << endl;
 
@@ -2864,16 +3192,13 @@ void irtkReconstruction::InitializeEM()
   if (_debug)
     cout << "InitializeEM" << endl;
 
-  _weights.clear();
-  _bias.clear();
   _scale_cpu.clear();
   _slice_weight_cpu.clear();
 
-  for (unsigned int i = 0; i < _slices.size(); i++) {
-    //Create images for voxel weights and bias fields
-    _weights.push_back(_slices[i]);
-    _bias.push_back(_slices[i]);
+  //Create voxel weights and bias fields
+  _slice_states.Initialize(_slices);
 
+  for (unsigned int i = 0; i < _slices.size(); i++) {
     //Create and initialize scales
     _scale_cpu.push_back(1);
     //_scale_gpu.push_back(1);
@@ -2959,10 +3284,10 @@ void irtkReconstruction::InitializeEMValues()
 
   for (unsigned int i = 0; i < _slices.size(); i++) {
     //Initialise voxel weights and bias values
-    irtkRealPixel *pw = _weights[i].GetPointerToVoxels();
-    irtkRealPixel *pb = _bias[i].GetPointerToVoxels();
+    float *pw = _slice_states.Weights(i).GetPointer();
+    float *pb = _slice_states.Bias(i).GetPointer();
     irtkRealPixel *pi = _slices[i].GetPointerToVoxels();
-    for (int j = 0; j < _weights[i].GetNumberOfVoxels(); j++) {
+    for (int j = 0; j < _slices[i].GetNumberOfVoxels(); j++) {
       if (*pi != -1) {
         *pw = 1;
         *pb = 0;
@@ -3017,22 +3342,27 @@ void irtkReconstruction::InitializeRobustStatisticsGPU()
 
   reconstructionGPU->UpdateScaleVector(_scale_gpu, _slice_weight_gpu);
 
+  _em_objective_valid = false;
 }
 
 void irtkReconstruction::InitializeRobustStatistics()
 {
+  irtkProfileScope profile("InitializeRobustStatistics");
+  irtkProfiler::Count("slices", _slices.size());
+
   if (_debug)
     cout << "InitializeRobustStatistics" << endl;
 
   //Initialise parameter of EM robust statistics
   int i, j;
-  irtkRealImage slice, sim;
   double sigma = 0;
   int num = 0;
 
   //for each slice
   for (unsigned int inputIndex = 0; inputIndex < _slices.size(); inputIndex++) {
-    slice = _slices[inputIndex];
+    irtkRealImage& slice = _slices[inputIndex];
+    irtkSliceField sim = _slice_states.Simulated(inputIndex);
+    irtkSliceField simw = _slice_states.SimulatedWeights(inputIndex);
 
     //Voxel-wise sigma will be set to stdev of volumetric errors
     //For each slice voxel
@@ -3040,10 +3370,9 @@ void irtkReconstruction::InitializeRobustStatistics()
       for (j = 0; j < slice.GetY(); j++)
         if (slice(i, j, 0) != -1) {
       //calculate stev of the errors
-      if ((_simulated_inside[inputIndex](i, j, 0) == 1)
-        && (_simulated_weights[inputIndex](i, j, 0) > 0.99)) {
-        slice(i, j, 0) -= _simulated_slices[inputIndex](i, j, 0);
-        sigma += slice(i, j, 0) * slice(i, j, 0);
+      if (_slice_states.Inside(inputIndex, i, j) && (simw(i, j, 0) > 0.99)) {
+        irtkRealPixel e = slice(i, j, 0) - sim(i, j, 0);
+        sigma += e * e;
         num++;
       }
         }
@@ -3071,6 +3400,8 @@ void irtkReconstruction::InitializeRobustStatistics()
   if (_debug || _debugGPU)
     cout << "Initializing robust statistics CPU: " << "sigma=" << sqrt(_sigma_cpu) << " " << "m=" << _m_cpu
     << " " << "mix=" << _mix_cpu << " " << "mix_s=" << _mix_s_cpu << endl;
+
+  _em_objective_valid = false;
 }
 
 class ParallelEStep {
@@ -3081,14 +3412,19 @@ public:
 
   void operator()(const blocked_range<size_t>& r) const {
     for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
-      // read the current slice
-      irtkRealImage slice = reconstructor->_slices[inputIndex];
+      //alias the current slice
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
 
-      //read current weight image
-      reconstructor->_weights[inputIndex] = 0;
+      //reset the current weight image
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
+      std::fill(w.GetPointer(), w.GetPointer() + reconstructor->_slice_states.GetNumberOfPixels(inputIndex), 0.0f);
 
       //alias the current bias image
-      irtkRealImage& b = reconstructor->_bias[inputIndex];
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+
+      //alias the current simulated slice and its weights
+      irtkSliceField sim = reconstructor->_slice_states.Simulated(inputIndex);
+      irtkSliceField simw = reconstructor->_slice_states.SimulatedWeights(inputIndex);
 
       //identify scale factor
       double scale = reconstructor->_scale_cpu[inputIndex];
@@ -3099,38 +3435,38 @@ public:
         for (int j = 0; j < slice.GetY(); j++)
           if (slice(i, j, 0) != -1) {
         //bias correct and scale the slice
-        slice(i, j, 0) *= exp(-b(i, j, 0)) * scale;
+        irtkRealPixel e = slice(i, j, 0) * (exp(-b(i, j, 0)) * scale);
 
         //number of volumetric voxels to which
         // current slice voxel contributes
-        size_t n = reconstructor->_volcoeffs[inputIndex][i][j].size();
+        size_t n = reconstructor->_volcoeffs[inputIndex].Size(i, j);
 
         // if n == 0, slice voxel has no overlap with volumetric ROI,
         // do not process it
 
         if ((n>0) &&
-          (reconstructor->_simulated_weights[inputIndex](i, j, 0) > 0)) {
-          slice(i, j, 0) -= reconstructor->_simulated_slices[inputIndex](i, j, 0);
+          (simw(i, j, 0) > 0)) {
+          e -= sim(i, j, 0);
 
           //calculate norm and voxel-wise weights
 
           //Gaussian distribution for inliers (likelihood)
-          double g = reconstructor->G(slice(i, j, 0), reconstructor->_sigma_cpu);
+          double g = reconstructor->G(e, reconstructor->_sigma_cpu);
           //Uniform distribution for outliers (likelihood)
           double m = reconstructor->M(reconstructor->_m_cpu);
 
           //voxel_wise posterior
           double weight = g * reconstructor->_mix_cpu / (g *reconstructor->_mix_cpu + m * (1 - reconstructor->_mix_cpu));
-          reconstructor->_weights[inputIndex].PutAsDouble(i, j, 0, weight);
+          w(i, j, 0) = weight;
 
           //calculate slice potentials
-          if (reconstructor->_simulated_weights[inputIndex](i, j, 0) > 0.99) {
+          if (simw(i, j, 0) > 0.99) {
             slice_potential[inputIndex] += (1.0 - weight) * (1.0 - weight);
             num++;
           }
         }
         else
-          reconstructor->_weights[inputIndex].PutAsDouble(i, j, 0, 0);
+          w(i, j, 0) = 0;
           }
 
       //evaluate slice potential
@@ -3151,10 +3487,7 @@ public:
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelFor("EStep", 0, reconstructor->_slices.size(), *this);
   }
 
 };
@@ -3441,13 +3774,13 @@ void irtkReconstruction::EStepGPU()
 
 void irtkReconstruction::EStep()
 {
+  irtkProfileScope profile("EStep");
+  irtkProfiler::Count("slices", _slices.size());
+
   //EStep performs calculation of voxel-wise and slice-wise posteriors (weights)
   if (_debug)
     cout << "EStep: " << endl;
 
-  unsigned int inputIndex;
-  irtkRealImage slice, w, b, sim;
-  int num = 0;
   vector<double> slice_potential_cpu(_slices.size(), 0);
   //std::cout << "num Estp CPU: ";
   ParallelEStep parallelEStep(this, slice_potential_cpu);
@@ -3455,9 +3788,17 @@ void irtkReconstruction::EStep()
 
   if(_debugGPU)
   {
-    _weights[40].Write("testweightCPU.nii");
+    _slice_states.GetImage(irtkSliceStates::WEIGHTS, 40, _slices[40].GetImageAttributes()).Write("testweightCPU.nii");
+}
+
+  SliceRobustStatistics(slice_potential_cpu);
 }
 
+void irtkReconstruction::SliceRobustStatistics(vector<double>& slice_potential_cpu)
+{
+  unsigned int inputIndex;
+  int num = 0;
+
   //To force-exclude slices predefined by a user, set their potentials to -1
   for (unsigned int i = 0; i < _force_excluded.size(); i++)
     slice_potential_cpu[_force_excluded[i]] = -1;
@@ -3709,10 +4050,14 @@ public:
       irtkRealImage& slice = reconstructor->_slices[inputIndex];
 
       //alias the current weight image
-      irtkRealImage& w = reconstructor->_weights[inputIndex];
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
 
       //alias the current bias image
-      irtkRealImage& b = reconstructor->_bias[inputIndex];
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+
+      //alias the current simulated slice and its weights
+      irtkSliceField sim = reconstructor->_slice_states.Simulated(inputIndex);
+      irtkSliceField simw = reconstructor->_slice_states.SimulatedWeights(inputIndex);
 
       //initialise calculation of scale
       double scalenum = 0;
@@ -3721,10 +4066,10 @@ public:
       for (int i = 0; i < slice.GetX(); i++)
         for (int j = 0; j < slice.GetY(); j++)
           if (slice(i, j, 0) != -1) {
-        if (reconstructor->_simulated_weights[inputIndex](i, j, 0) > 0.99) {
+        if (simw(i, j, 0) > 0.99) {
           //scale - intensity matching
           double eb = exp(-b(i, j, 0));
-          scalenum += w(i, j, 0) * slice(i, j, 0) * eb * reconstructor->_simulated_slices[inputIndex](i, j, 0);
+          scalenum += w(i, j, 0) * slice(i, j, 0) * eb * sim(i, j, 0);
           scaleden += w(i, j, 0) * slice(i, j, 0) * eb * slice(i, j, 0) * eb;
         }
           }
@@ -3740,10 +4085,7 @@ public:
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelFor("Scale", 0, reconstructor->_slices.size(), *this);
   }
 
 };
@@ -3766,6 +4108,9 @@ void irtkReconstruction::ScaleGPU()
 
 void irtkReconstruction::Scale()
 {
+  irtkProfileScope profile("Scale");
+  irtkProfiler::Count("slices", _slices.size());
+
   if (_debug)
     cout << "Scale" << endl;
 
@@ -3793,51 +4138,82 @@ void irtkReconstruction::Scale()
   }
 }
 
+/// Per-thread images holding the weights and weighted residuals of a slice
+/// while its bias field is computed. Reused for all slices a thread processes,
+/// memory is only reallocated when the slice dimensions change.
+struct irtkBiasScratch {
+  irtkRealImage weights;
+  irtkRealImage residual;
+  irtkBatchGaussianBlurring2D<irtkRealPixel> blurring;
+  int allocations;
+
+  irtkBiasScratch() : allocations(0) { }
+
+  void Initialize(const irtkImageAttributes& attr) {
+    if ((weights.GetX() != attr._x) || (weights.GetY() != attr._y) || (weights.GetZ() != attr._z))
+      allocations += 2;
+    weights.Initialize(attr);
+    residual.Initialize(attr);
+  }
+};
+
+typedef enumerable_thread_specific<irtkBiasScratch> irtkBiasScratchPool;
+
+/// Number of images allocated by the threads of a bias field pass
+static int BiasScratchAllocations(irtkBiasScratchPool& pool)
+{
+  int allocations = 0;
+  for (irtkBiasScratchPool::iterator it = pool.begin(); it != pool.end(); ++it)
+    allocations += it->allocations;
+  return allocations;
+}
+
 class ParallelBias {
   irtkReconstruction* reconstructor;
+  irtkBiasScratchPool& scratch;
 
 public:
 
   void operator()(const blocked_range<size_t>& r) const {
+    irtkBiasScratch& local = scratch.local();
     for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
-      // read the current slice
-      irtkRealImage slice = reconstructor->_slices[inputIndex];
+      //alias the current slice
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
 
       //alias the current weight image
-      irtkRealImage& w = reconstructor->_weights[inputIndex];
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
 
       //alias the current bias image
-      irtkRealImage b = reconstructor->_bias[inputIndex];
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+
+      //alias the current simulated slice and its weights
+      irtkSliceField sim = reconstructor->_slice_states.Simulated(inputIndex);
+      irtkSliceField simw = reconstructor->_slice_states.SimulatedWeights(inputIndex);
 
       //identify scale factor
       double scale = reconstructor->_scale_cpu[inputIndex];
 
-      //prepare weight image for bias field
-      irtkRealImage wb = w;
-
-      //simulated slice
-      // irtkRealImage sim;
-      // sim.Initialize( slice.GetImageAttributes() );
-      // sim = 0;
-      irtkRealImage wresidual(slice.GetImageAttributes());
-      wresidual = 0;
+      //weight image and weighted residual image for bias field
+      local.Initialize(slice.GetImageAttributes());
+      irtkRealImage& wb = local.weights;
+      irtkRealImage& wresidual = local.residual;
 
       for (int i = 0; i < slice.GetX(); i++)
-        for (int j = 0; j < slice.GetY(); j++)
+        for (int j = 0; j < slice.GetY(); j++) {
+          wb(i, j, 0) = w(i, j, 0);
           if (slice(i, j, 0) != -1) {
-        if (reconstructor->_simulated_weights[inputIndex](i, j, 0) > 0.99) {
+        if (simw(i, j, 0) > 0.99) {
           //bias-correct and scale current slice
           double eb = exp(-b(i, j, 0));
-          slice(i, j, 0) *= (eb * scale);
+          irtkRealPixel corrected = slice(i, j, 0) * (eb * scale);
 
           //calculate weight image
-          wb(i, j, 0) = w(i, j, 0) * slice(i, j, 0);
+          wb(i, j, 0) = w(i, j, 0) * corrected;
 
           //calculate weighted residual image
           //make sure it is far from zero to avoid numerical instability
-          //if ((sim(i,j,0)>_low_intensity_cutoff*_max_intensity)&&(slice(i,j,0)>_low_intensity_cutoff*_max_intensity))
-          if ((reconstructor->_simulated_slices[inputIndex](i, j, 0) > 1) && (slice(i, j, 0) > 1)) {
-            wresidual(i, j, 0) = log(slice(i, j, 0) / reconstructor->_simulated_slices[inputIndex](i, j, 0)) * wb(i, j, 0);
+          if ((sim(i, j, 0) > 1) && (corrected > 1)) {
+            wresidual(i, j, 0) = log(corrected / sim(i, j, 0)) * wb(i, j, 0);
           }
         }
         else {
@@ -3846,18 +4222,12 @@ public:
           wb(i, j, 0) = 0;
         }
           }
+        }
 
       //calculate bias field for this slice
-      irtkGaussianBlurring<irtkRealPixel> gb(reconstructor->_sigma_bias);
-      //smooth weighted residual
-      gb.SetInput(&wresidual);
-      gb.SetOutput(&wresidual);
-      gb.Run();
-
-      //smooth weight image
-      gb.SetInput(&wb);
-      gb.SetOutput(&wb);
-      gb.Run();
+      //smooth weighted residual and weight image
+      irtkRealImage *blur[2] = { &wresidual, &wb };
+      reconstructor->BlurBiasSlices(blur, 2, local.blurring);
 
       //update bias field
       double sum = 0;
@@ -3882,21 +4252,16 @@ public:
           b(i, j, 0) -= mean;
             }
       }
-
-      reconstructor->_bias[inputIndex] = b;
     }
   }
 
-  ParallelBias(irtkReconstruction *reconstructor) :
-    reconstructor(reconstructor)
+  ParallelBias(irtkReconstruction *reconstructor, irtkBiasScratchPool& scratch) :
+    reconstructor(reconstructor), scratch(scratch)
   { }
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelFor("Bias", 0, reconstructor->_slices.size(), *this);
   }
 
 };
@@ -3925,35 +4290,203 @@ void irtkReconstruction::BiasGPU()
 
 void irtkReconstruction::Bias()
 {
+  irtkProfileScope profile("Bias");
+  irtkProfiler::Count("slices", _slices.size());
+
   if (_debug)
     cout << "Correcting bias ...";
 
-  ParallelBias parallelBias(this);
+  irtkBiasScratchPool scratch;
+  ParallelBias parallelBias(this, scratch);
   parallelBias();
+  _slice_allocations += BiasScratchAllocations(scratch);
 
-  _bias[79].Write("biasField79CPU.nii");
+  _slice_states.GetImage(irtkSliceStates::BIAS, 79, _slices[79].GetImageAttributes()).Write("biasField79CPU.nii");
 
   if (_debug)
     cout << "done. " << endl;
 }
 
+class ParallelEStepBiasScale {
+  irtkReconstruction* reconstructor;
+  vector<double> &slice_potential;
+  vector<double> &scale_next;
+  bool bias;
+  irtkBiasScratchPool& scratch;
+
+public:
+
+  void operator()(const blocked_range<size_t>& r) const {
+    irtkBiasScratch& local = scratch.local();
+    for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
+      //alias the current slice, simulated slice, weight and bias images
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
+      irtkSliceField sim = reconstructor->_slice_states.Simulated(inputIndex);
+      irtkSliceField simw = reconstructor->_slice_states.SimulatedWeights(inputIndex);
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+
+      //identify scale factor
+      double scale = reconstructor->_scale_cpu[inputIndex];
+
+      //weight and weighted residual images for the bias field
+      if (bias)
+        local.Initialize(slice.GetImageAttributes());
+      irtkRealImage& wb = local.weights;
+      irtkRealImage& wresidual = local.residual;
+
+      double num = 0;
+      double scalenum = 0;
+      double scaleden = 0;
+
+      //one sweep: bias corrected and scaled slice, residual, voxel weights,
+      //slice potential and the inputs of the bias field (or of the scale
+      //if the bias does not change)
+      for (int i = 0; i < slice.GetX(); i++)
+        for (int j = 0; j < slice.GetY(); j++) {
+          w(i, j, 0) = 0;
+          if (slice(i, j, 0) == -1)
+            continue;
+
+          irtkRealPixel corrected = slice(i, j, 0) * (exp(-b(i, j, 0)) * scale);
+
+          if ((reconstructor->_volcoeffs[inputIndex].Size(i, j) > 0) && (simw(i, j, 0) > 0)) {
+            irtkRealPixel residual = corrected - sim(i, j, 0);
+            double g = reconstructor->G(residual, reconstructor->_sigma_cpu);
+            double m = reconstructor->M(reconstructor->_m_cpu);
+            double weight = g * reconstructor->_mix_cpu / (g *reconstructor->_mix_cpu + m * (1 - reconstructor->_mix_cpu));
+            w(i, j, 0) = weight;
+
+            if (simw(i, j, 0) > 0.99) {
+              slice_potential[inputIndex] += (1.0 - weight) * (1.0 - weight);
+              num++;
+            }
+          }
+
+          if (simw(i, j, 0) > 0.99) {
+            if (bias) {
+              wb(i, j, 0) = w(i, j, 0) * corrected;
+              if ((sim(i, j, 0) > 1) && (corrected > 1))
+                wresidual(i, j, 0) = log(corrected / sim(i, j, 0)) * wb(i, j, 0);
+            }
+            else {
+              double eb = exp(-b(i, j, 0));
+              scalenum += w(i, j, 0) * slice(i, j, 0) * eb * sim(i, j, 0);
+              scaleden += w(i, j, 0) * slice(i, j, 0) * eb * slice(i, j, 0) * eb;
+            }
+          }
+        }
+
+      //evaluate slice potential
+      if (num > 0)
+        slice_potential[inputIndex] = sqrt(slice_potential[inputIndex] / num);
+      else
+        slice_potential[inputIndex] = -1; // slice has no unpadded voxels
+
+      if (bias) {
+        //calculate bias field for this slice
+        irtkRealImage *blur[2] = { &wresidual, &wb };
+        reconstructor->BlurBiasSlices(blur, 2, local.blurring);
+
+        //update bias field
+        double sum = 0;
+        double count = 0;
+        for (int i = 0; i < slice.GetX(); i++)
+          for (int j = 0; j < slice.GetY(); j++)
+            if (slice(i, j, 0) != -1) {
+              if (wb(i, j, 0) > 0)
+                b(i, j, 0) += wresidual(i, j, 0) / wb(i, j, 0);
+              sum += b(i, j, 0);
+              count++;
+            }
+
+        //normalize bias field to have zero mean and calculate the scale
+        //with the updated bias field
+        double mean = 0;
+        if ((!reconstructor->_global_bias_correction) && (count > 0))
+          mean = sum / count;
+        for (int i = 0; i < slice.GetX(); i++)
+          for (int j = 0; j < slice.GetY(); j++)
+            if (slice(i, j, 0) != -1) {
+              b(i, j, 0) -= mean;
+              if (simw(i, j, 0) > 0.99) {
+                double eb = exp(-b(i, j, 0));
+                scalenum += w(i, j, 0) * slice(i, j, 0) * eb * sim(i, j, 0);
+                scaleden += w(i, j, 0) * slice(i, j, 0) * eb * slice(i, j, 0) * eb;
+              }
+            }
+      }
+
+      //calculate scale for this slice
+      if (scaleden > 0)
+        scale_next[inputIndex] = scalenum / scaleden;
+      else
+        scale_next[inputIndex] = 1;
+    }
+  }
+
+  ParallelEStepBiasScale(irtkReconstruction *reconstructor,
+    vector<double> &slice_potential, vector<double> &scale_next, bool bias,
+    irtkBiasScratchPool& scratch) :
+    reconstructor(reconstructor), slice_potential(slice_potential),
+    scale_next(scale_next), bias(bias), scratch(scratch)
+  { }
+
+  // execute
+  void operator() () const {
+    reconstructor->ParallelFor("EStepBiasScale", 0, reconstructor->_slices.size(), *this);
+  }
+
+};
+
+void irtkReconstruction::EStepBiasScale(bool bias)
+{
+  irtkProfileScope profile("EStepBiasScale");
+  irtkProfiler::Count("slices", _slices.size());
+
+  if (_debug)
+    cout << "EStep with bias and scale: " << endl;
+
+  vector<double> slice_potential_cpu(_slices.size(), 0);
+  vector<double> scale_next(_slices.size(), 1);
+  irtkBiasScratchPool scratch;
+  ParallelEStepBiasScale parallelEStepBiasScale(this, slice_potential_cpu, scale_next, bias, scratch);
+  parallelEStepBiasScale();
+  _slice_allocations += BiasScratchAllocations(scratch);
+
+  //slice statistics exclude slices with the scales of this iteration
+  SliceRobustStatistics(slice_potential_cpu);
+  _scale_cpu = scale_next;
+
+  if (_debug || _debugGPU) {
+    cout << setprecision(3);
+    cout << "Slice scale CPU= ";
+    for (unsigned int inputIndex = 0; inputIndex < _slices.size(); ++inputIndex)
+      cout << inputIndex << ":" << _scale_cpu[inputIndex] << " ";
+    cout << endl;
+  }
+}
+
 class ParallelSuperresolution {
   
   irtkReconstruction* reconstructor;
 public:
-  irtkRealImage confidence_map;
-  irtkRealImage addon;
+  irtkAccumImage confidence_map;
+  irtkAccumImage addon;
 
   void operator()(const blocked_range<size_t>& r) {
     for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
-      // read the current slice
-      irtkRealImage slice = reconstructor->_slices[inputIndex];
+      //alias the current slice
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
 
       //read the current weight image
-      irtkRealImage& w = reconstructor->_weights[inputIndex];
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
 
       //read the current bias image
-      irtkRealImage& b = reconstructor->_bias[inputIndex];
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+
+      //read the current simulated slice
+      irtkSliceField sim = reconstructor->_slice_states.Simulated(inputIndex);
 
       //identify scale factor
       double scale = reconstructor->_scale_cpu[inputIndex];
@@ -3966,17 +4499,18 @@ public:
         for (int j = 0; j < slice.GetY(); j++)
           if (slice(i, j, 0) != -1) {
         //bias correct and scale the slice
-        slice(i, j, 0) *= exp(-b(i, j, 0)) * scale;
+        irtkRealPixel e = slice(i, j, 0) * (exp(-b(i, j, 0)) * scale);
 
-        if (reconstructor->_simulated_slices[inputIndex](i, j, 0) > 0)
-          slice(i, j, 0) -= reconstructor->_simulated_slices[inputIndex](i, j, 0);
+        if (sim(i, j, 0) > 0)
+          e -= sim(i, j, 0);
         else
-          slice(i, j, 0) = 0;
+          e = 0;
 
-        size_t n = reconstructor->_volcoeffs[inputIndex][i][j].size();
+        const POINT3D *coeffs = reconstructor->_volcoeffs[inputIndex].Begin(i, j);
+        size_t n = reconstructor->_volcoeffs[inputIndex].Size(i, j);
         for (int k = 0; k < n; k++) {
-          p = reconstructor->_volcoeffs[inputIndex][i][j][k];
-          addon(p.x, p.y, p.z) += p.value * slice(i, j, 0) * w(i, j, 0) * reconstructor->_slice_weight_cpu[inputIndex];
+          p = coeffs[k];
+          addon(p.x, p.y, p.z) += p.value * e * w(i, j, 0) * reconstructor->_slice_weight_cpu[inputIndex];
           confidence_map(p.x, p.y, p.z) += p.value * w(i, j, 0) * reconstructor->_slice_weight_cpu[inputIndex];
         }
           }
@@ -4014,10 +4548,87 @@ public:
 
   // execute
   void operator() () {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_reduce(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelReduceSlices("Superresolution", *this);
+  }
+};
+
+class ParallelSuperresolutionResidual {
+  irtkReconstruction* reconstructor;
+  vector<double>& residual;
+  vector<double>& confidence;
+public:
+
+  ParallelSuperresolutionResidual(irtkReconstruction *_reconstructor,
+    vector<double>& _residual, vector<double>& _confidence) :
+    reconstructor(_reconstructor), residual(_residual), confidence(_confidence) { }
+
+  void operator()(const blocked_range<size_t>& r) const {
+    for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+      irtkSliceField sim = reconstructor->_slice_states.Simulated(inputIndex);
+      double scale = reconstructor->_scale_cpu[inputIndex];
+      double slice_weight = reconstructor->_slice_weight_cpu[inputIndex];
+
+      //weighted error and weight of each slice pixel, same as in ParallelSuperresolution
+      unsigned int offset = reconstructor->_voxelcoeffs.GetSliceOffset(inputIndex);
+      for (int i = 0; i < slice.GetX(); i++)
+        for (int j = 0; j < slice.GetY(); j++) {
+        unsigned int pixel = offset + i * slice.GetY() + j;
+        if (slice(i, j, 0) != -1) {
+          double e = 0;
+          if (sim(i, j, 0) > 0)
+            e = slice(i, j, 0) * exp(-b(i, j, 0)) * scale - sim(i, j, 0);
+          residual[pixel] = e * w(i, j, 0) * slice_weight;
+          confidence[pixel] = w(i, j, 0) * slice_weight;
+        }
+        else {
+          residual[pixel] = 0;
+          confidence[pixel] = 0;
+        }
+        }
+    }
+  }
+
+  // execute
+  void operator() () const {
+    reconstructor->ParallelFor("SuperresolutionResidual", 0, reconstructor->_slices.size(), *this);
+  }
+};
+
+class ParallelSuperresolutionGather {
+  irtkReconstruction* reconstructor;
+  const vector<double>& residual;
+  const vector<double>& confidence;
+  irtkRealPixel *addon;
+  irtkRealPixel *confidence_map;
+public:
+
+  ParallelSuperresolutionGather(irtkReconstruction *_reconstructor,
+    const vector<double>& _residual, const vector<double>& _confidence,
+    irtkRealImage& _addon, irtkRealImage& _confidence_map) :
+    reconstructor(_reconstructor), residual(_residual), confidence(_confidence),
+    addon(_addon.GetPointerToVoxels()), confidence_map(_confidence_map.GetPointerToVoxels()) { }
+
+  void operator()(const blocked_range<size_t>& r) const {
+    const irtkVolumeCoeffs& voxelcoeffs = reconstructor->_voxelcoeffs;
+    for (size_t index = r.begin(); index < r.end(); ++index) {
+      const PIXELCOEFF *coeffs = voxelcoeffs.Begin(index);
+      size_t n = voxelcoeffs.Size(index);
+      double a = 0, c = 0;
+      for (size_t k = 0; k < n; k++) {
+        a += coeffs[k].value * residual[coeffs[k].pixel];
+        c += coeffs[k].value * confidence[coeffs[k].pixel];
+      }
+      addon[index] = a;
+      confidence_map[index] = c;
+    }
+  }
+
+  // execute
+  void operator() () const {
+    reconstructor->ParallelFor("SuperresolutionGather", 0, reconstructor->_voxelcoeffs.GetNumberOfVoxels(), *this);
   }
 };
 
@@ -4031,9 +4642,22 @@ void irtkReconstruction::SuperresolutionGPU(int iter)
   //Remember current reconstruction for edge-preserving smoothing
   original = _reconstructed;
 
+  //the volume lives on the GPU, compare copies from before and after the step
+  irtkGenericImage<float> before, after;
+  if (_adaptive_stopping) {
+    before = _reconstructed_gpu;
+    reconstructionGPU->syncCPU(before.GetPointerToVoxels());
+  }
+
   reconstructionGPU->Superresolution(iter, _slice_weight_gpu, _adaptive, _alpha, _min_intensity, _max_intensity, _delta,
     _lambda, _global_bias_correction, _sigma_bias, _low_intensity_cutoff); //assuming isotrop constant voxel size
 
+  if (_adaptive_stopping) {
+    after = _reconstructed_gpu;
+    reconstructionGPU->syncCPU(after.GetPointerToVoxels());
+    _sr_update = RelativeChange(before, after);
+  }
+
   //TODO debug confidence map and addon
   if(_debugGPU)
   {
@@ -4054,19 +4678,41 @@ void irtkReconstruction::SuperresolutionGPU(int iter)
 
 void irtkReconstruction::Superresolution(int iter)
 {
+  irtkProfileScope profile("Superresolution");
+  irtkProfiler::Count("voxels", _active_runs.GetNumberOfVoxels());
+
   if (_debug)
     cout << "Superresolution " << iter << endl;
 
-  int i, j, k;
+  if (_cg_superresolution) {
+    SuperresolutionCG(iter);
+    return;
+  }
+
+  int i;
   irtkRealImage addon, original;
 
   //Remember current reconstruction for edge-preserving smoothing
   original = _reconstructed;
 
-  ParallelSuperresolution parallelSuperresolution(this);
-  parallelSuperresolution();
-  addon = parallelSuperresolution.addon;
-  _confidence_map = parallelSuperresolution.confidence_map;
+  if (_gather_superresolution) {
+    //each voxel gathers from the slice pixels it sees, no per-thread volumes
+    vector<double> residual(_voxelcoeffs.GetNumberOfPixels());
+    vector<double> confidence(_voxelcoeffs.GetNumberOfPixels());
+    ParallelSuperresolutionResidual parallelResidual(this, residual, confidence);
+    parallelResidual();
+
+    addon.Initialize(_reconstructed.GetImageAttributes());
+    _confidence_map.Initialize(_reconstructed.GetImageAttributes());
+    ParallelSuperresolutionGather parallelGather(this, residual, confidence, addon, _confidence_map);
+    parallelGather();
+  }
+  else {
+    ParallelSuperresolution parallelSuperresolution(this);
+    parallelSuperresolution();
+    addon = parallelSuperresolution.addon;
+    _confidence_map = parallelSuperresolution.confidence_map;
+  }
   //_confidence4mask = _confidence_map;
 
   if (_debug) {
@@ -4077,29 +4723,32 @@ void irtkReconstruction::Superresolution(int iter)
     addon.Write(buffer);
   }
 
-  if (!_adaptive)
-    for (i = 0; i < addon.GetX(); i++)
-      for (j = 0; j < addon.GetY(); j++)
-        for (k = 0; k < addon.GetZ(); k++)
-          if (_confidence_map(i, j, k) > 0) {
-    // ISSUES if _confidence_map(i, j, k) is too small leading
-    // to bright pixels
-    addon(i, j, k) /= _confidence_map(i, j, k);
-    //this is to revert to normal (non-adaptive) regularisation
-    _confidence_map(i, j, k) = 1;
-          }
+  //addon and confidence are 0 where the slices do not reach, the voxels
+  //there are set to 0 by AdaptiveRegularization
+  irtkRealPixel *pa = addon.GetPointerToVoxels();
+  irtkRealPixel *pc = _confidence_map.GetPointerToVoxels();
+  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  for (int r = 0; r < _active_runs.GetNumberOfRuns(); r++) {
+    const VOXELRUN& run = _active_runs.GetRun(r);
+    int index = _active_runs.Index(run);
+    for (i = index; i < index + run.length; i++) {
+      if (!_adaptive && (pc[i] > 0)) {
+        // ISSUES if the confidence is too small leading
+        // to bright pixels
+        pa[i] /= pc[i];
+        //this is to revert to normal (non-adaptive) regularisation
+        pc[i] = 1;
+      }
 
-  _reconstructed += addon * _alpha; //_average_volume_weight;
+      pr[i] += pa[i] * _alpha; //_average_volume_weight;
 
-  //bound the intensities
-  for (i = 0; i < _reconstructed.GetX(); i++)
-    for (j = 0; j < _reconstructed.GetY(); j++)
-      for (k = 0; k < _reconstructed.GetZ(); k++) {
-    if (_reconstructed(i, j, k) < _min_intensity * 0.9)
-      _reconstructed(i, j, k) = _min_intensity * 0.9;
-    if (_reconstructed(i, j, k) > _max_intensity * 1.1)
-      _reconstructed(i, j, k) = _max_intensity * 1.1;
-      }
+      //bound the intensities
+      if (pr[i] < _min_intensity * 0.9)
+        pr[i] = _min_intensity * 0.9;
+      if (pr[i] > _max_intensity * 1.1)
+        pr[i] = _max_intensity * 1.1;
+    }
+  }
 
   //Smooth the reconstructed image
   AdaptiveRegularization(iter, original);
@@ -4107,6 +4756,9 @@ void irtkReconstruction::Superresolution(int iter)
   if (_global_bias_correction)
     BiasCorrectVolume(original);
 
+  if (_adaptive_stopping)
+    _sr_update = RelativeChange(original, _reconstructed);
+
   if(_debugGPU)
   {
     char buffer[256];
@@ -4118,6 +4770,349 @@ void irtkReconstruction::Superresolution(int iter)
 }
 }
 
+class ParallelSuperresolutionCGNormal {
+  irtkReconstruction* reconstructor;
+  //volume the operator is applied to
+  irtkAccumImage &volume;
+  //compute the right hand side minus the operator applied to volume
+  bool rhs;
+public:
+  irtkAccumImage result;
+
+  void operator()(const blocked_range<size_t>& r) {
+    for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+      double scale = reconstructor->_scale_cpu[inputIndex];
+      double slice_weight = reconstructor->_slice_weight_cpu[inputIndex];
+
+      POINT3D p;
+      for (int i = 0; i < slice.GetX(); i++)
+        for (int j = 0; j < slice.GetY(); j++)
+          if (slice(i, j, 0) != -1) {
+        double weight = w(i, j, 0) * slice_weight;
+        if (weight <= 0)
+          continue;
+
+        //forward project the volume, normalised by the PSF weight as in SimulateSlices
+        const POINT3D *coeffs = reconstructor->_volcoeffs[inputIndex].Begin(i, j);
+        size_t n = reconstructor->_volcoeffs[inputIndex].Size(i, j);
+        double sim = 0;
+        double sum = 0;
+        for (int k = 0; k < n; k++) {
+          p = coeffs[k];
+          sim += p.value * volume(p.x, p.y, p.z);
+          sum += p.value;
+        }
+        if (sum <= 0)
+          continue;
+
+        //weighted pixel value to distribute back to the volume
+        double u;
+        if (rhs)
+          u = weight * (slice(i, j, 0) * exp(-b(i, j, 0)) * scale - sim / sum) / sum;
+        else
+          u = weight * sim / (sum * sum);
+
+        for (int k = 0; k < n; k++) {
+          p = coeffs[k];
+          result(p.x, p.y, p.z) += p.value * u;
+        }
+          }
+    }
+  }
+
+  ParallelSuperresolutionCGNormal(ParallelSuperresolutionCGNormal& x, split) :
+    reconstructor(x.reconstructor), volume(x.volume), rhs(x.rhs)
+  {
+    result.Initialize(reconstructor->_reconstructed.GetImageAttributes());
+  }
+
+  void join(const ParallelSuperresolutionCGNormal& y) {
+    result += y.result;
+  }
+
+  ParallelSuperresolutionCGNormal(irtkReconstruction *reconstructor,
+    irtkAccumImage &volume, bool rhs) :
+    reconstructor(reconstructor), volume(volume), rhs(rhs)
+  {
+    result.Initialize(reconstructor->_reconstructed.GetImageAttributes());
+  }
+
+  // execute
+  void operator() () {
+    reconstructor->ParallelReduceSlices("SuperresolutionCGNormal", *this);
+  }
+};
+
+class ParallelSuperresolutionCGDiagonal {
+  irtkReconstruction* reconstructor;
+public:
+  //diagonal of the data term of the normal equations
+  irtkAccumImage diagonal;
+  //same confidence map as computed by ParallelSuperresolution
+  irtkAccumImage confidence_map;
+
+  void operator()(const blocked_range<size_t>& r) {
+    for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
+      double slice_weight = reconstructor->_slice_weight_cpu[inputIndex];
+
+      POINT3D p;
+      for (int i = 0; i < slice.GetX(); i++)
+        for (int j = 0; j < slice.GetY(); j++)
+          if (slice(i, j, 0) != -1) {
+        double weight = w(i, j, 0) * slice_weight;
+        const POINT3D *coeffs = reconstructor->_volcoeffs[inputIndex].Begin(i, j);
+        size_t n = reconstructor->_volcoeffs[inputIndex].Size(i, j);
+        double sum = 0;
+        for (int k = 0; k < n; k++)
+          sum += coeffs[k].value;
+        if ((weight <= 0) || (sum <= 0))
+          continue;
+
+        for (int k = 0; k < n; k++) {
+          p = coeffs[k];
+          diagonal(p.x, p.y, p.z) += weight * p.value * p.value / (sum * sum);
+          confidence_map(p.x, p.y, p.z) += p.value * weight;
+        }
+          }
+    }
+  }
+
+  ParallelSuperresolutionCGDiagonal(ParallelSuperresolutionCGDiagonal& x, split) :
+    reconstructor(x.reconstructor)
+  {
+    diagonal.Initialize(reconstructor->_reconstructed.GetImageAttributes());
+    confidence_map.Initialize(reconstructor->_reconstructed.GetImageAttributes());
+  }
+
+  void join(const ParallelSuperresolutionCGDiagonal& y) {
+    diagonal += y.diagonal;
+    confidence_map += y.confidence_map;
+  }
+
+  ParallelSuperresolutionCGDiagonal(irtkReconstruction *reconstructor) :
+    reconstructor(reconstructor)
+  {
+    diagonal.Initialize(reconstructor->_reconstructed.GetImageAttributes());
+    confidence_map.Initialize(reconstructor->_reconstructed.GetImageAttributes());
+  }
+
+  // execute
+  void operator() () {
+    reconstructor->ParallelReduceSlices("SuperresolutionCGDiagonal", *this);
+  }
+};
+
+class ParallelSuperresolutionCGRegularization {
+  irtkReconstruction *reconstructor;
+  vector<double> &factor;
+  //volume defining the edges, fixed during the solve
+  irtkRealImage &original;
+  irtkAccumImage &confidence_map;
+  irtkAccumImage &volume;
+  irtkAccumImage &result;
+  //factor of the term added to result
+  double weight;
+  //add the diagonal of the term instead of applying it to volume
+  bool diagonal;
+
+public:
+  ParallelSuperresolutionCGRegularization(irtkReconstruction *_reconstructor,
+    vector<double> &_factor,
+    irtkRealImage &_original,
+    irtkAccumImage &_confidence_map,
+    irtkAccumImage &_volume,
+    irtkAccumImage &_result,
+    double _weight,
+    bool _diagonal) :
+    reconstructor(_reconstructor),
+    factor(_factor),
+    original(_original),
+    confidence_map(_confidence_map),
+    volume(_volume),
+    result(_result),
+    weight(_weight),
+    diagonal(_diagonal) { }
+
+  void operator() (const blocked_range<size_t> &r) const {
+    int dx = reconstructor->_reconstructed.GetX();
+    int dy = reconstructor->_reconstructed.GetY();
+    int dz = reconstructor->_reconstructed.GetZ();
+    double delta = reconstructor->_delta;
+
+    for (size_t z = r.begin(); z != r.end(); ++z)
+      for (int y = 0; y < dy; y++)
+        for (int x = 0; x < dx; x++) {
+        if (confidence_map(x, y, z) <= 0)
+          continue;
+
+        //edge weights as in AdaptiveRegularization, towards both neighbours
+        //of each of the 13 directions
+        double sum = 0;
+        for (int i = 0; i < 13; i++)
+          for (int sign = -1; sign <= 1; sign += 2) {
+          int *d = reconstructor->_directions[i];
+          int xx = x + sign * d[0];
+          int yy = y + sign * d[1];
+          int zz = z + sign * d[2];
+          if ((xx < 0) || (xx >= dx) || (yy < 0) || (yy >= dy) || (zz < 0) || (zz >= dz)
+            || (confidence_map(xx, yy, zz) <= 0))
+            continue;
+          double diff = (original(xx, yy, zz) - original(x, y, z)) * sqrt(factor[i]) / delta;
+          double b = factor[i] / sqrt(1 + diff * diff);
+          if (diagonal)
+            sum += b;
+          else
+            sum += b * (volume(x, y, z) - volume(xx, yy, zz));
+          }
+        result(x, y, z) += weight * sum;
+        }
+  }
+
+  // execute
+  void operator() () const {
+    reconstructor->ParallelFor("SuperresolutionCGRegularization", 0, reconstructor->_reconstructed.GetZ(), *this);
+  }
+
+};
+
+/// Scalar product of two volumes
+static double CGDot(irtkAccumImage& a, irtkAccumImage& b)
+{
+  double *pa = a.GetPointerToVoxels();
+  double *pb = b.GetPointerToVoxels();
+  double sum = 0;
+  for (int i = 0; i < a.GetNumberOfVoxels(); i++)
+    sum += pa[i] * pb[i];
+  return sum;
+}
+
+void irtkReconstruction::SuperresolutionCG(int iter)
+{
+  if (_debug)
+    cout << "Superresolution CG " << iter << endl;
+
+  //Remember current reconstruction, defines the edges during the solve
+  irtkRealImage original = _reconstructed;
+
+  vector<double> factor(13, 0);
+  for (int i = 0; i < 13; i++) {
+    for (int j = 0; j < 3; j++)
+      factor[i] += fabs(double(_directions[i][j]));
+    factor[i] = 1 / factor[i];
+  }
+  double mu = _lambda / (_delta * _delta);
+
+  //Jacobi preconditioner and confidence map, voxels without confidence
+  //are not part of the system
+  ParallelSuperresolutionCGDiagonal parallelDiagonal(this);
+  parallelDiagonal();
+  irtkAccumImage &confidence = parallelDiagonal.confidence_map;
+  irtkAccumImage &precond = parallelDiagonal.diagonal;
+  irtkAccumImage x = _reconstructed;
+  ParallelSuperresolutionCGRegularization regDiagonal(this, factor, original,
+    confidence, x, precond, mu, true);
+  regDiagonal();
+
+  //residual r = A^T W (y - A x) - mu L x of the weighted least squares
+  //system with the robust statistics weights and edges held fixed
+  ParallelSuperresolutionCGNormal parallelRhs(this, x, true);
+  parallelRhs();
+  irtkAccumImage r = parallelRhs.result;
+  ParallelSuperresolutionCGRegularization regResidual(this, factor, original,
+    confidence, x, r, -mu, false);
+  regResidual();
+
+  int nvoxels = x.GetNumberOfVoxels();
+  double *px = x.GetPointerToVoxels();
+  double *pr = r.GetPointerToVoxels();
+  double *pm = precond.GetPointerToVoxels();
+
+  irtkAccumImage z = r;
+  irtkAccumImage p;
+  double *pz = z.GetPointerToVoxels();
+  for (int i = 0; i < nvoxels; i++)
+    pz[i] = (pm[i] > 0) ? pr[i] / pm[i] : 0;
+  p = z;
+  double *pp = p.GetPointerToVoxels();
+
+  double rz = CGDot(r, z);
+  double norm0 = sqrt(CGDot(r, r));
+  double norm = norm0;
+  _cg_iterations = 0;
+  while ((norm0 > 0) && (_cg_iterations < _cg_max_iterations)) {
+    //q = (A^T W A + mu L) p
+    ParallelSuperresolutionCGNormal parallelNormal(this, p, false);
+    parallelNormal();
+    irtkAccumImage &q = parallelNormal.result;
+    ParallelSuperresolutionCGRegularization regNormal(this, factor, original,
+      confidence, p, q, mu, false);
+    regNormal();
+    double *pq = q.GetPointerToVoxels();
+
+    double pAp = CGDot(p, q);
+    if (pAp <= 0)
+      break;
+    double step = rz / pAp;
+    for (int i = 0; i < nvoxels; i++) {
+      px[i] += step * pp[i];
+      pr[i] -= step * pq[i];
+    }
+    _cg_iterations++;
+
+    norm = sqrt(CGDot(r, r));
+    if (norm < _cg_tolerance * norm0)
+      break;
+
+    for (int i = 0; i < nvoxels; i++)
+      pz[i] = (pm[i] > 0) ? pr[i] / pm[i] : 0;
+    double rz_new = CGDot(r, z);
+    double beta = rz_new / rz;
+    rz = rz_new;
+    for (int i = 0; i < nvoxels; i++)
+      pp[i] = pz[i] + beta * pp[i];
+  }
+
+  if (_debug)
+    cout << "CG iterations: " << _cg_iterations << " relative residual: "
+      << ((norm0 > 0) ? norm / norm0 : 0) << endl;
+
+  _reconstructed = x;
+
+  //bound the intensities, voxels without confidence are set to 0
+  //as by AdaptiveRegularization
+  for (int k = 0; k < _reconstructed.GetZ(); k++)
+    for (int j = 0; j < _reconstructed.GetY(); j++)
+      for (int i = 0; i < _reconstructed.GetX(); i++) {
+    if (_reconstructed(i, j, k) < _min_intensity * 0.9)
+      _reconstructed(i, j, k) = _min_intensity * 0.9;
+    if (_reconstructed(i, j, k) > _max_intensity * 1.1)
+      _reconstructed(i, j, k) = _max_intensity * 1.1;
+    if (confidence(i, j, k) <= 0)
+      _reconstructed(i, j, k) = 0;
+      }
+
+  _confidence_map = confidence;
+  //this is to revert to normal (non-adaptive) regularisation
+  if (!_adaptive) {
+    irtkRealPixel *pc = _confidence_map.GetPointerToVoxels();
+    for (int i = 0; i < _confidence_map.GetNumberOfVoxels(); i++)
+      if (pc[i] > 0)
+        pc[i] = 1;
+  }
+
+  //Remove the bias in the reconstructed volume compared to previous iteration
+  if (_global_bias_correction)
+    BiasCorrectVolume(original);
+
+  if (_adaptive_stopping)
+    _sr_update = RelativeChange(original, _reconstructed);
+}
+
 class ParallelMStep{
   irtkReconstruction* reconstructor;
 public:
@@ -4126,17 +5121,23 @@ public:
   double num;
   double min;
   double max;
+  //log-likelihood of the residuals under the current parameters
+  double loglik;
 
   void operator()(const blocked_range<size_t>& r) {
     for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
-      // read the current slice
-      irtkRealImage slice = reconstructor->_slices[inputIndex];
+      //alias the current slice
+      irtkRealImage& slice = reconstructor->_slices[inputIndex];
 
       //alias the current weight image
-      irtkRealImage& w = reconstructor->_weights[inputIndex];
+      irtkSliceField w = reconstructor->_slice_states.Weights(inputIndex);
 
       //alias the current bias image
-      irtkRealImage& b = reconstructor->_bias[inputIndex];
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
+
+      //alias the current simulated slice and its weights
+      irtkSliceField sim = reconstructor->_slice_states.Simulated(inputIndex);
+      irtkSliceField simw = reconstructor->_slice_states.SimulatedWeights(inputIndex);
 
       //identify scale factor
       double scale = reconstructor->_scale_cpu[inputIndex];
@@ -4146,15 +5147,15 @@ public:
         for (int j = 0; j < slice.GetY(); j++)
           if (slice(i, j, 0) != -1) {
         //bias correct and scale the slice
-        slice(i, j, 0) *= exp(-b(i, j, 0)) * scale;
+        irtkRealPixel corrected = slice(i, j, 0) * (exp(-b(i, j, 0)) * scale);
 
         //otherwise the error has no meaning - it is equal to slice intensity
-        if (reconstructor->_simulated_weights[inputIndex](i, j, 0) > 0.99) {
+        if (simw(i, j, 0) > 0.99) {
 
-          slice(i, j, 0) -= reconstructor->_simulated_slices[inputIndex](i, j, 0);
+          irtkRealPixel residual = corrected - sim(i, j, 0);
 
           //sigma and mix
-          double e = slice(i, j, 0);
+          double e = residual;
           sigma += e * e * w(i, j, 0);
           mix += w(i, j, 0);
 
@@ -4164,6 +5165,12 @@ public:
           if (e > max)
             max = e;
 
+          if (reconstructor->_adaptive_stopping) {
+            double s = reconstructor->_sigma_cpu;
+            double inlier = exp(-e * e / (2 * s)) / sqrt(6.28 * s);
+            loglik += log(reconstructor->_mix_cpu * inlier + (1 - reconstructor->_mix_cpu) * reconstructor->_m_cpu);
+          }
+
           num++;
         }
           }
@@ -4178,6 +5185,7 @@ public:
     num = 0;
     min = 0;
     max = 0;
+    loglik = 0;
   }
 
   void join(const ParallelMStep& y) {
@@ -4189,6 +5197,7 @@ public:
     sigma += y.sigma;
     mix += y.mix;
     num += y.num;
+    loglik += y.loglik;
   }
 
   ParallelMStep(irtkReconstruction *reconstructor) :
@@ -4197,16 +5206,14 @@ public:
     sigma = 0;
     mix = 0;
     num = 0;
+    loglik = 0;
     min = voxel_limits<irtkRealPixel>::max();
     max = voxel_limits<irtkRealPixel>::min();
   }
 
   // execute
   void operator() () {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_reduce(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelReduce("MStep", 0, reconstructor->_slices.size(), *this);
   }
 };
 
@@ -4214,6 +5221,10 @@ public:
 void irtkReconstruction::MStepGPU(int iter)
 {
   reconstructionGPU->MStep(iter, _step, _sigma_gpu, _mix_gpu, _m_gpu);
+  //the kernels only return the parameters, the log-likelihood of the inlier
+  //class at its estimated sigma is -log(sigma)/2 up to a constant
+  if (_adaptive_stopping && (_sigma_gpu > 0))
+    UpdateEMObjective(-0.5 * log(_sigma_gpu));
   std::cout.precision(10);
   if (_debug || _debugGPU) {
     cout << "Voxel-wise robust statistics parameters GPU: ";
@@ -4225,6 +5236,9 @@ void irtkReconstruction::MStepGPU(int iter)
 
 void irtkReconstruction::MStep(int iter)
 {
+  irtkProfileScope profile("MStep");
+  irtkProfiler::Count("slices", _slices.size());
+
   if (_debug)
     cout << "MStep" << endl;
 
@@ -4235,6 +5249,8 @@ void irtkReconstruction::MStep(int iter)
   double num = parallelMStep.num;
   double min = parallelMStep.min;
   double max = parallelMStep.max;
+  if (_adaptive_stopping && (num > 0))
+    UpdateEMObjective(parallelMStep.loglik / num);
   //printf("CPU sigma %f, mix %f, num %f, min_ %f, max_ %f\n", sigma, mix, num, min, max);
   std::cout.precision(6);
   std::cout << "CPU sigma " << sigma << " mix " << mix << " num " << num << " min_ " << min << " max_ " << max << std::endl;
@@ -4262,137 +5278,164 @@ void irtkReconstruction::MStep(int iter)
 
 }
 
-class ParallelAdaptiveRegularization1 {
-  irtkReconstruction *reconstructor;
-  vector<irtkRealImage> &b;
-  vector<double> &factor;
-  irtkRealImage &original;
-
-public:
-  ParallelAdaptiveRegularization1(irtkReconstruction *_reconstructor,
-    vector<irtkRealImage> &_b,
-    vector<double> &_factor,
-    irtkRealImage &_original) :
-    reconstructor(_reconstructor),
-    b(_b),
-    factor(_factor),
-    original(_original) { }
-
-  void operator() (const blocked_range<size_t> &r) const {
-    int dx = reconstructor->_reconstructed.GetX();
-    int dy = reconstructor->_reconstructed.GetY();
-    int dz = reconstructor->_reconstructed.GetZ();
-    for (size_t i = r.begin(); i != r.end(); ++i) {
-      //b[i] = reconstructor->_reconstructed;
-      // b[i].Initialize( reconstructor->_reconstructed.GetImageAttributes() );
-
-      int x, y, z, xx, yy, zz;
-      double diff;
-      for (x = 0; x < dx; x++)
-        for (y = 0; y < dy; y++)
-          for (z = 0; z < dz; z++) {
-        xx = x + reconstructor->_directions[i][0];
-        yy = y + reconstructor->_directions[i][1];
-        zz = z + reconstructor->_directions[i][2];
-        if ((xx >= 0) && (xx < dx) && (yy >= 0) && (yy < dy) && (zz >= 0) && (zz < dz)
-          && (reconstructor->_confidence_map(x, y, z) > 0) && (reconstructor->_confidence_map(xx, yy, zz) > 0)) {
-          diff = (original(xx, yy, zz) - original(x, y, z)) * sqrt(factor[i]) / reconstructor->_delta;
-          b[i](x, y, z) = factor[i] / sqrt(1 + diff * diff);
-
-        }
-        else
-          b[i](x, y, z) = 0;
-          }
-    }
-  }
+template <class VoxelType>
+double irtkReconstruction::RelativeChange(const irtkGenericImage<VoxelType>& before, const irtkGenericImage<VoxelType>& after)
+{
+  const VoxelType *pb = before.GetPointerToVoxels();
+  const VoxelType *pa = after.GetPointerToVoxels();
+  double change = 0, norm = 0;
+  for (int i = 0; i < before.GetNumberOfVoxels(); i++) {
+    double d = double(pa[i]) - double(pb[i]);
+    change += d * d;
+    norm += double(pb[i]) * double(pb[i]);
+  }
+  return (norm > 0) ? sqrt(change / norm) : 0;
+}
 
-  // execute
-  void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, 13),
-      *this);
-    init.terminate();
-  }
+void irtkReconstruction::UpdateEMObjective(double objective)
+{
+  //no change can be measured by the first M step after InitializeRobustStatistics
+  _em_change = _em_objective_valid ? fabs(objective - _em_objective) : voxel_limits<double>::max();
+  _em_objective = objective;
+  _em_objective_valid = true;
+}
 
-};
+bool irtkReconstruction::SuperresolutionConverged()
+{
+  if (_debug)
+    cout << "Relative volume update " << _sr_update << ", change of EM log-likelihood " << _em_change << endl;
+  return (_sr_update < _stop_update_tolerance) && (_em_change < _stop_em_tolerance);
+}
 
-class ParallelAdaptiveRegularization2 {
+class ParallelAdaptiveRegularization {
   irtkReconstruction *reconstructor;
-  vector<irtkRealImage> &b;
   vector<double> &factor;
+  //volume before the superresolution step, defines the edges
   irtkRealImage &original;
+  //volume after the superresolution step, gets smoothed
+  irtkRealImage &original2;
+  //z range of the voxels the slices reach, voxels without confidence end up as 0
+  int z0, z1;
 
 public:
-  ParallelAdaptiveRegularization2(irtkReconstruction *_reconstructor,
-    vector<irtkRealImage> &_b,
+  ParallelAdaptiveRegularization(irtkReconstruction *_reconstructor,
     vector<double> &_factor,
-    irtkRealImage &_original) :
+    irtkRealImage &_original,
+    irtkRealImage &_original2,
+    int _z0, int _z1) :
     reconstructor(_reconstructor),
-    b(_b),
     factor(_factor),
-    original(_original) { }
+    original(_original),
+    original2(_original2),
+    z0(_z0), z1(_z1) { }
 
   void operator() (const blocked_range<size_t> &r) const {
     int dx = reconstructor->_reconstructed.GetX();
     int dy = reconstructor->_reconstructed.GetY();
     int dz = reconstructor->_reconstructed.GetZ();
-    for (size_t x = r.begin(); x != r.end(); ++x) {
-      int xx, yy, zz;
-      for (int y = 0; y < dy; y++)
-        for (int z = 0; z < dz; z++) {
-        double val = 0;
-        double valW = 0;
-        double sum = 0;
-        for (int i = 0; i < 13; i++) {
-          xx = x + reconstructor->_directions[i][0];
-          yy = y + reconstructor->_directions[i][1];
-          zz = z + reconstructor->_directions[i][2];
-          if ((xx >= 0) && (xx < dx) && (yy >= 0) && (yy < dy) && (zz >= 0) && (zz < dz)) {
-            val += b[i](x, y, z) * original(xx, yy, zz) * reconstructor->_confidence_map(xx, yy, zz);
-            valW += b[i](x, y, z) * reconstructor->_confidence_map(xx, yy, zz);
-            sum += b[i](x, y, z);
-          }
-        }
+    double delta = reconstructor->_delta;
+    double scale = reconstructor->_alpha * reconstructor->_lambda / (delta * delta);
+
+    const irtkRealPixel *po = original.GetPointerToVoxels();
+    const irtkRealPixel *po2 = original2.GetPointerToVoxels();
+    const irtkRealPixel *pc = reconstructor->_confidence_map.GetPointerToVoxels();
+    irtkRealPixel *pr = reconstructor->_reconstructed.GetPointerToVoxels();
+
+    //neighbour offsets and edge scaling for the 13 directions
+    int offset[13];
+    double sfactor[13];
+    for (int i = 0; i < 13; i++) {
+      int *d = reconstructor->_directions[i];
+      offset[i] = d[0] + dx * (d[1] + dy * d[2]);
+      sfactor[i] = sqrt(factor[i]);
+    }
 
-        for (int i = 0; i < 13; i++) {
-          xx = x - reconstructor->_directions[i][0];
-          yy = y - reconstructor->_directions[i][1];
-          zz = z - reconstructor->_directions[i][2];
-          if ((xx >= 0) && (xx < dx) && (yy >= 0) && (yy < dy) && (zz >= 0) && (zz < dz)) {
-            val += b[i](xx, yy, zz) * original(xx, yy, zz) * reconstructor->_confidence_map(xx, yy, zz);
-            valW += b[i](xx, yy, zz) * reconstructor->_confidence_map(xx, yy, zz);
-            sum += b[i](xx, yy, zz);
+    //accumulators for one run of active voxels
+    const irtkVoxelRuns &runs = reconstructor->_active_runs;
+    vector<double> val(dx), valW(dx), sum(dx);
+
+    for (size_t z = r.begin(); z != r.end(); ++z)
+      for (int run = runs.GetSliceBegin(z); run < runs.GetSliceEnd(z); run++) {
+        const int x0 = runs.GetRun(run).x;
+        const int x1 = x0 + runs.GetRun(run).length - 1;
+        const int y = runs.GetRun(run).y;
+        const int row = dx * (y + dy * z);
+        fill(val.begin(), val.begin() + x1 - x0 + 1, 0);
+        fill(valW.begin(), valW.begin() + x1 - x0 + 1, 0);
+        fill(sum.begin(), sum.begin() + x1 - x0 + 1, 0);
+
+        //the edge weight b of a voxel and its neighbour in direction i is computed
+        //on the fly, first for neighbours x+d[i] and then for x-d[i] as before
+        for (int dir = 0; dir < 2; dir++)
+          for (int i = 0; i < 13; i++) {
+          int *d = reconstructor->_directions[i];
+          int sign = (dir == 0) ? 1 : -1;
+          int yy = y + sign * d[1];
+          int zz = z + sign * d[2];
+          if ((yy < 0) || (yy >= dy) || (zz < 0) || (zz >= dz))
+            continue;
+          int xs = max(x0, -sign * d[0]);
+          int xe = min(x1, dx - 1 - sign * d[0]);
+          int off = sign * offset[i];
+          double f = factor[i];
+          double sf = sfactor[i];
+
+          //no bounds checks or branches left, lets the compiler vectorize over x
+          const irtkRealPixel *o = po + row;
+          const irtkRealPixel *on = po + row + off;
+          const irtkRealPixel *o2n = po2 + row + off;
+          const irtkRealPixel *c = pc + row;
+          const irtkRealPixel *cn = pc + row + off;
+          double *pv = &val[0] - x0;
+          double *pw = &valW[0] - x0;
+          double *ps = &sum[0] - x0;
+          if (dir == 0) {
+            for (int x = xs; x <= xe; x++) {
+              double diff = (on[x] - o[x]) * sf / delta;
+              double b = ((c[x] > 0) && (cn[x] > 0)) ? f / sqrt(1 + diff * diff) : 0;
+              pv[x] += b * o2n[x] * cn[x];
+              pw[x] += b * cn[x];
+              ps[x] += b;
+            }
+          }
+          else {
+            for (int x = xs; x <= xe; x++) {
+              double diff = (o[x] - on[x]) * sf / delta;
+              double b = ((c[x] > 0) && (cn[x] > 0)) ? f / sqrt(1 + diff * diff) : 0;
+              pv[x] += b * o2n[x] * cn[x];
+              pw[x] += b * cn[x];
+              ps[x] += b;
+            }
+          }
           }
-        }
-
-        val -= sum * original(x, y, z) * reconstructor->_confidence_map(x, y, z);
-        valW -= sum * reconstructor->_confidence_map(x, y, z);
-        val = original(x, y, z) * reconstructor->_confidence_map(x, y, z)
-          + reconstructor->_alpha * reconstructor->_lambda / (reconstructor->_delta * reconstructor->_delta) * val;
-        valW = reconstructor->_confidence_map(x, y, z) + reconstructor->_alpha * reconstructor->_lambda / (reconstructor->_delta * reconstructor->_delta) * valW;
 
-        if (valW > 0) {
-          reconstructor->_reconstructed(x, y, z) = val / valW;
+        for (int x = x0; x <= x1; x++) {
+          int index = row + x;
+          double c = pc[index];
+          double v = val[x - x0] - sum[x - x0] * po2[index] * c;
+          double w = valW[x - x0] - sum[x - x0] * c;
+          v = po2[index] * c + scale * v;
+          w = c + scale * w;
+
+          if (w > 0)
+            pr[index] = v / w;
+          else
+            pr[index] = 0;
         }
-        else
-          reconstructor->_reconstructed(x, y, z) = 0;
-        }
-
-    }
+      }
   }
 
   // execute
   void operator() () const {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_for(blocked_range<size_t>(0, reconstructor->_reconstructed.GetX()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelFor("AdaptiveRegularization", z0, z1 + 1, *this);
   }
 
 };
 
 void irtkReconstruction::AdaptiveRegularization(int iter, irtkRealImage& original)
 {
+  irtkProfileScope profile("AdaptiveRegularization");
+
   if (_debug)
     cout << "AdaptiveRegularization" << endl;
 
@@ -4403,22 +5446,20 @@ void irtkReconstruction::AdaptiveRegularization(int iter, irtkRealImage& origina
     factor[i] = 1 / factor[i];
   }
 
-  vector<irtkRealImage> b;//(13);
-  for (int i = 0; i < 13; i++)
-    b.push_back(_reconstructed);
-
-  ParallelAdaptiveRegularization1 parallelAdaptiveRegularization1(this,
-    b,
-    factor,
-    original);
-  parallelAdaptiveRegularization1();
-
+  //voxels without confidence end up as 0, only the voxels the slices
+  //reach can have confidence
+  int x0, x1, y0, y1, z0, z1;
   irtkRealImage original2 = _reconstructed;
-  ParallelAdaptiveRegularization2 parallelAdaptiveRegularization2(this,
-    b,
-    factor,
-    original2);
-  parallelAdaptiveRegularization2();
+  _reconstructed = 0;
+  if (_active_runs.GetBoundingBox(x0, x1, y0, y1, z0, z1)) {
+    irtkProfiler::Count("voxels", _active_runs.GetNumberOfVoxels());
+    ParallelAdaptiveRegularization parallelAdaptiveRegularization(this,
+      factor,
+      original,
+      original2,
+      z0, z1);
+    parallelAdaptiveRegularization();
+  }
 
   if (_alpha * _lambda / (_delta * _delta) > 0.068) {
     cerr
@@ -4430,8 +5471,9 @@ void irtkReconstruction::AdaptiveRegularization(int iter, irtkRealImage& origina
 void irtkReconstruction::BiasCorrectVolume(irtkRealImage& original)
 {
   //remove low-frequancy component in the reconstructed image which might have accured due to overfitting of the biasfield
-  irtkRealImage residual = _reconstructed;
-  irtkRealImage weights = _mask;
+  //residual and weights are 0 outside the mask
+  irtkRealImage residual(_reconstructed.GetImageAttributes());
+  irtkRealImage weights(_reconstructed.GetImageAttributes());
 
   //_reconstructed.Write("super-notbiascor.nii.gz");
 
@@ -4439,60 +5481,42 @@ void irtkReconstruction::BiasCorrectVolume(irtkRealImage& original)
   irtkRealPixel *pr = residual.GetPointerToVoxels();
   irtkRealPixel *po = original.GetPointerToVoxels();
   irtkRealPixel *pw = weights.GetPointerToVoxels();
-  for (int i = 0; i < _reconstructed.GetNumberOfVoxels(); i++) {
-    //second and term to avoid numerical problems
-    if ((*pw == 1) && (*po > _low_intensity_cutoff * _max_intensity)
-      && (*pr > _low_intensity_cutoff * _max_intensity)) {
-      *pr /= *po;
-      *pr = log(*pr);
-    }
-    else {
-      *pw = 0;
-      *pr = 0;
-    }
-    pr++;
-    po++;
-    pw++;
+  irtkRealPixel *pi = _reconstructed.GetPointerToVoxels();
+  for (int r = 0; r < _mask_runs.GetNumberOfRuns(); r++) {
+    const VOXELRUN& run = _mask_runs.GetRun(r);
+    int index = _mask_runs.Index(run);
+    for (int i = index; i < index + run.length; i++)
+      //second and term to avoid numerical problems
+      if ((po[i] > _low_intensity_cutoff * _max_intensity)
+        && (pi[i] > _low_intensity_cutoff * _max_intensity)) {
+        pr[i] = log(pi[i] / po[i]);
+        pw[i] = 1;
+      }
   }
   //residual.Write("residual.nii.gz");
   //blurring needs to be same as for slices
-  irtkGaussianBlurring<irtkRealPixel> gb(_sigma_bias);
   //blur weigted residual
-  gb.SetInput(&residual);
-  gb.SetOutput(&residual);
-  gb.Run();
+  BlurBias(residual);
   //blur weight image
-  gb.SetInput(&weights);
-  gb.SetOutput(&weights);
-  gb.Run();
-
-  //calculate the bias field
-  pr = residual.GetPointerToVoxels();
-  pw = weights.GetPointerToVoxels();
-  irtkRealPixel *pm = _mask.GetPointerToVoxels();
-  irtkRealPixel *pi = _reconstructed.GetPointerToVoxels();
-  for (int i = 0; i < _reconstructed.GetNumberOfVoxels(); i++) {
+  BlurBias(weights);
 
-    if (*pm == 1) {
+  //calculate the bias field inside the mask
+  for (int r = 0; r < _mask_runs.GetNumberOfRuns(); r++) {
+    const VOXELRUN& run = _mask_runs.GetRun(r);
+    int index = _mask_runs.Index(run);
+    for (int i = index; i < index + run.length; i++) {
       //weighted gaussian smoothing
-      *pr /= *pw;
+      pr[i] /= pw[i];
       //exponential to recover multiplicative bias field
-      *pr = exp(*pr);
+      pr[i] = exp(pr[i]);
       //bias correct reconstructed
-      *pi /= *pr;
+      pi[i] /= pr[i];
       //clamp intensities to allowed range
-      if (*pi < _min_intensity * 0.9)
-        *pi = _min_intensity * 0.9;
-      if (*pi > _max_intensity * 1.1)
-        *pi = _max_intensity * 1.1;
-    }
-    else {
-      *pr = 0;
+      if (pi[i] < _min_intensity * 0.9)
+        pi[i] = _min_intensity * 0.9;
+      if (pi[i] > _max_intensity * 1.1)
+        pi[i] = _max_intensity * 1.1;
     }
-    pr++;
-    pw++;
-    pm++;
-    pi++;
   }
 
   //residual.Write("biasfield.nii.gz");
@@ -4578,7 +5602,7 @@ void irtkReconstruction::Evaluate(int iter)
 class ParallelNormaliseBias{
   irtkReconstruction* reconstructor;
 public:
-  irtkRealImage bias;
+  irtkAccumImage bias;
 
   void operator()(const blocked_range<size_t>& r) {
     for (size_t inputIndex = r.begin(); inputIndex < r.end(); ++inputIndex) {
@@ -4590,33 +5614,29 @@ public:
       // alias the current slice
       irtkRealImage& slice = reconstructor->_slices[inputIndex];
 
-      //read the current bias image
-      irtkRealImage b = reconstructor->_bias[inputIndex];
+      //alias the current bias image
+      irtkSliceField b = reconstructor->_slice_states.Bias(inputIndex);
 
       //read current scale factor
       double scale = reconstructor->_scale_cpu[inputIndex];
 
-      irtkRealPixel *pi = slice.GetPointerToVoxels();
-      irtkRealPixel *pb = b.GetPointerToVoxels();
-      for (int i = 0; i<slice.GetNumberOfVoxels(); i++) {
-        if ((*pi>-1) && (scale > 0))
-          *pb -= log(scale);
-        pb++;
-        pi++;
-      }
-
       //Distribute slice intensities to the volume
       POINT3D p;
       for (int i = 0; i < slice.GetX(); i++)
         for (int j = 0; j < slice.GetY(); j++)
           if (slice(i, j, 0) != -1) {
         //number of volume voxels with non-zero coefficients for current slice voxel
-        size_t n = reconstructor->_volcoeffs[inputIndex][i][j].size();
+        const POINT3D *coeffs = reconstructor->_volcoeffs[inputIndex].Begin(i, j);
+        size_t n = reconstructor->_volcoeffs[inputIndex].Size(i, j);
         //add contribution of current slice voxel to all voxel volumes
         //to which it contributes
+        //bias including the scale of the slice
+        irtkRealPixel value = b(i, j, 0);
+        if ((slice(i, j, 0) > -1) && (scale > 0))
+          value -= log(scale);
         for (int k = 0; k < n; k++) {
-          p = reconstructor->_volcoeffs[inputIndex][i][j][k];
-          bias(p.x, p.y, p.z) += p.value * b(i, j, 0);
+          p = coeffs[k];
+          bias(p.x, p.y, p.z) += p.value * value;
         }
           }
       //end of loop for a slice inputIndex                
@@ -4643,10 +5663,7 @@ public:
 
   // execute
   void operator() () {
-    task_scheduler_init init(tbb_no_threads);
-    parallel_reduce(blocked_range<size_t>(0, reconstructor->_slices.size()),
-      *this);
-    init.terminate();
+    reconstructor->ParallelReduceSlices("NormaliseBias", *this);
   }
 };
 
@@ -4672,8 +5689,40 @@ void irtkReconstruction::NormaliseBiasGPU(int iter)
 }
 }
 
+void irtkReconstruction::BlurBias(irtkRealImage& image)
+{
+  if (_recursive_bias_blurring) {
+    irtkRecursiveGaussianBlurring<irtkRealPixel> gb(_sigma_bias);
+    gb.SetInput(&image);
+    gb.SetOutput(&image);
+    gb.Run();
+  }
+  else {
+    irtkGaussianBlurring<irtkRealPixel> gb(_sigma_bias);
+    gb.SetInput(&image);
+    gb.SetOutput(&image);
+    gb.Run();
+  }
+}
+
+void irtkReconstruction::BlurBiasSlices(irtkRealImage** slices, int n, irtkBatchGaussianBlurring2D<irtkRealPixel>& blurring)
+{
+  if (_recursive_bias_blurring) {
+    for (int i = 0; i < n; i++)
+      BlurBias(*slices[i]);
+  }
+  else {
+    //same result as irtkGaussianBlurring without its 3D setup per call
+    blurring.SetSigma(_sigma_bias);
+    blurring.Run(slices, n);
+  }
+}
+
 void irtkReconstruction::NormaliseBias(int iter)
 {
+  irtkProfileScope profile("NormaliseBias");
+  irtkProfiler::Count("slices", _slices.size());
+
   if (_debug)
     cout << "Normalise Bias ... ";
 
@@ -4689,13 +5738,8 @@ void irtkReconstruction::NormaliseBias(int iter)
 
   MaskImage(bias, 0);
   irtkRealImage m = _mask;
-  irtkGaussianBlurring<irtkRealPixel> gb(_sigma_bias);
-  gb.SetInput(&bias);
-  gb.SetOutput(&bias);
-  gb.Run();
-  gb.SetInput(&m);
-  gb.SetOutput(&m);
-  gb.Run();
+  BlurBias(bias);
+  BlurBias(m);
   bias /= m;
 
   if (_debugGPU)
@@ -4872,7 +5916,7 @@ void irtkReconstruction::SaveBiasFields()
   char buffer[256];
   for (unsigned int inputIndex = 0; inputIndex < _slices.size(); inputIndex++) {
     sprintf(buffer, "bias%i.nii.gz", inputIndex);
-    _bias[inputIndex].Write(buffer);
+    _slice_states.GetImage(irtkSliceStates::BIAS, inputIndex, _slices[inputIndex].GetImageAttributes()).Write(buffer);
   }
 }
 
@@ -4896,7 +5940,7 @@ void irtkReconstruction::SaveWeights()
   char buffer[256];
   for (unsigned int inputIndex = 0; inputIndex < _slices.size(); inputIndex++) {
     sprintf(buffer, "weights%i.nii.gz", inputIndex);
-    _weights[inputIndex].Write(buffer);
+    _slice_states.GetImage(irtkSliceStates::WEIGHTS, inputIndex, _slices[inputIndex].GetImageAttributes()).Write(buffer);
   }
 }
 
@@ -4927,6 +5971,155 @@ void irtkReconstruction::GetTransformations(vector<irtkRigidTransformation> &tra
   }
 }
 
+/* Checkpoints of the interleaved registration/reconstruction iterations */
+
+//raw binary layout, only meant to be read back by the same build
+static const char irtkCheckpointMagic[8] = { 'S', 'V', 'R', 'C', 'K', 'P', 'T', '2' };
+
+template <class T>
+static void CheckpointWrite(std::ofstream& out, const T& value)
+{
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <class T>
+static void CheckpointRead(std::ifstream& in, T& value)
+{
+  in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+static void CheckpointWriteTransformations(std::ofstream& out, const vector<irtkRigidTransformation>& transformations)
+{
+  for (size_t i = 0; i < transformations.size(); i++)
+    for (int j = 0; j < transformations[i].NumberOfDOFs(); j++)
+      CheckpointWrite(out, transformations[i].Get(j));
+}
+
+static void CheckpointReadTransformations(std::ifstream& in, vector<irtkRigidTransformation>& transformations)
+{
+  double value;
+  for (size_t i = 0; i < transformations.size(); i++)
+    for (int j = 0; j < transformations[i].NumberOfDOFs(); j++) {
+      CheckpointRead(in, value);
+      transformations[i].Put(j, value);
+    }
+}
+
+static void CheckpointWriteImage(std::ofstream& out, const irtkRealImage& image)
+{
+  out.write(reinterpret_cast<const char*>(image.GetPointerToVoxels()), image.GetNumberOfVoxels() * sizeof(irtkRealPixel));
+}
+
+static void CheckpointReadImage(std::ifstream& in, irtkRealImage& image)
+{
+  in.read(reinterpret_cast<char*>(image.GetPointerToVoxels()), image.GetNumberOfVoxels() * sizeof(irtkRealPixel));
+}
+
+//opens a checkpoint and reads its header and stack registrations
+static int CheckpointOpen(std::ifstream& in, const char* filename, vector<irtkRigidTransformation>& initial_stack_transformations,
+  vector<irtkRigidTransformation>& stack_transformations, int& number_of_slices)
+{
+  char magic[8];
+  int iter, number_of_stacks, pixel_size;
+
+  in.open(filename, ios::in | ios::binary);
+  if (!in) {
+    cerr << "Could not open checkpoint " << filename << endl;
+    exit(1);
+  }
+  in.read(magic, sizeof(magic));
+  CheckpointRead(in, pixel_size);
+  if (!in || !equal(magic, magic + sizeof(magic), irtkCheckpointMagic) || (pixel_size != sizeof(irtkRealPixel))) {
+    cerr << filename << " is not a checkpoint of this build" << endl;
+    exit(1);
+  }
+  CheckpointRead(in, iter);
+  CheckpointRead(in, number_of_stacks);
+  CheckpointRead(in, number_of_slices);
+  initial_stack_transformations.resize(number_of_stacks);
+  stack_transformations.resize(number_of_stacks);
+  CheckpointReadTransformations(in, initial_stack_transformations);
+  CheckpointReadTransformations(in, stack_transformations);
+  return iter;
+}
+
+void irtkReconstruction::WriteCheckpoint(const char* filename, int iter, vector<irtkRigidTransformation>& initial_stack_transformations,
+  vector<irtkRigidTransformation>& stack_transformations)
+{
+  //write next to the old checkpoint and replace it once complete, so that
+  //an interrupted write leaves the previous one intact
+  string tmp = string(filename) + ".tmp";
+  std::ofstream out(tmp.c_str(), ios::out | ios::binary | ios::trunc);
+
+  out.write(irtkCheckpointMagic, sizeof(irtkCheckpointMagic));
+  CheckpointWrite(out, int(sizeof(irtkRealPixel)));
+  CheckpointWrite(out, iter);
+  CheckpointWrite(out, int(stack_transformations.size()));
+  CheckpointWrite(out, int(_slices.size()));
+  CheckpointWriteTransformations(out, initial_stack_transformations);
+  CheckpointWriteTransformations(out, stack_transformations);
+
+  //scales, slice weights, bias fields and EM parameters are initialized
+  //again at the start of the next iteration and need not be stored
+
+  //reconstructed volume, whose geometry changes with the resolution schedule
+  irtkImageAttributes attr = _reconstructed.GetImageAttributes();
+  CheckpointWrite(out, attr);
+  CheckpointWriteImage(out, _reconstructed);
+
+  //slice transformations
+  CheckpointWriteTransformations(out, _transformations);
+
+  out.close();
+  if (!out || (std::rename(tmp.c_str(), filename) != 0)) {
+    cerr << "Could not write checkpoint " << filename << endl;
+    exit(1);
+  }
+}
+
+int irtkReconstruction::ReadCheckpointStacks(const char* filename, vector<irtkRigidTransformation>& initial_stack_transformations,
+  vector<irtkRigidTransformation>& stack_transformations)
+{
+  std::ifstream in;
+  int iter, number_of_slices;
+  size_t number_of_stacks = stack_transformations.size();
+  iter = CheckpointOpen(in, filename, initial_stack_transformations, stack_transformations, number_of_slices);
+  if (stack_transformations.size() != number_of_stacks) {
+    cerr << "Checkpoint " << filename << " has " << stack_transformations.size() << " stacks instead of " << number_of_stacks << endl;
+    exit(1);
+  }
+  return iter;
+}
+
+void irtkReconstruction::ReadCheckpoint(const char* filename)
+{
+  std::ifstream in;
+  int number_of_slices;
+  vector<irtkRigidTransformation> initial_stack_transformations, stack_transformations;
+  CheckpointOpen(in, filename, initial_stack_transformations, stack_transformations, number_of_slices);
+  if (number_of_slices != int(_slices.size())) {
+    cerr << "Checkpoint " << filename << " has " << number_of_slices << " slices instead of " << _slices.size() << endl;
+    exit(1);
+  }
+
+  irtkImageAttributes attr;
+  CheckpointRead(in, attr);
+  _reconstructed.Initialize(attr);
+  CheckpointReadImage(in, _reconstructed);
+
+  CheckpointReadTransformations(in, _transformations);
+
+  if (!in) {
+    cerr << "Checkpoint " << filename << " is truncated" << endl;
+    exit(1);
+  }
+
+  //the volume may be at a level of the resolution schedule, which
+  //SetReconstructionResolution keeps if the next iteration uses it too
+  if (_have_mask && !(attr == _mask.GetImageAttributes()))
+    InitializeResolution(attr);
+}
+
 void irtkReconstruction::GetSlices(vector<irtkRealImage> &slices)
 {
   slices.clear();
@@ -5093,10 +6286,23 @@ void irtkReconstruction::HalfImage(irtkRealImage image, vector<irtkRealImage>& s
 }
 
 
+//runs a registration, so that its parallel_reduce loops can be executed
+//inside the task arena of the reconstruction
+class irtkRunRegistration {
+public:
+  irtkImageRegistration *registration;
+
+  irtkRunRegistration(irtkImageRegistration *_registration) : registration(_registration) { }
+
+  void operator() () const {
+    registration->Run();
+  }
+};
+
 void irtkReconstruction::PackageToVolume(vector<irtkRealImage>& stacks, vector<int> &pack_num, bool evenodd, bool half, int half_iter)
 {
   irtkImageRigidRegistrationWithPadding rigidregistration;
-  irtkGreyImage t, s;
+  irtkRealImage t;
   //irtkRigidTransformation transformation;
   vector<irtkRealImage> packages;
   char buffer[256];
@@ -5124,7 +6330,6 @@ void irtkReconstruction::PackageToVolume(vector<irtkRealImage>& stacks, vector<i
       }
 
       t = packages[j];
-      s = _reconstructed;
 
       //find existing transformation
       double x, y, z;
@@ -5144,12 +6349,14 @@ void irtkReconstruction::PackageToVolume(vector<irtkRealImage>& stacks, vector<i
       m = m*mo;
       _transformations[firstSliceIndex].PutMatrix(m);
 
-      rigidregistration.SetInput(&t, &s);
+      rigidregistration.SetInput(&t, &_reconstructed);
       rigidregistration.SetOutput(&_transformations[firstSliceIndex]);
       rigidregistration.GuessParameterSliceToVolume(_useNMI);
       if (_debug)
         rigidregistration.Write("par-packages.rreg");
-      rigidregistration.Run();
+      //the packages are registered one after the other, the registration
+      //itself is parallel and limited to the threads of the reconstruction
+      _arena.Execute(irtkRunRegistration(&rigidregistration));
 
       //undo the offset
       mo.Invert();
@@ -5324,14 +6531,7 @@ void irtkReconstruction::MaskVolumeGPU()
 
 void irtkReconstruction::MaskVolume()
 {
-  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
-  irtkRealPixel *pm = _mask.GetPointerToVoxels();
-  for (int i = 0; i < _reconstructed.GetNumberOfVoxels(); i++) {
-    if (*pm == 0)
-      *pr = -1;
-    pm++;
-    pr++;
-  }
+  _mask_runs.FillOutside(_reconstructed.GetPointerToVoxels(), irtkRealPixel(-1));
 }
 
 void irtkReconstruction::MaskImage(irtkRealImage& image, double padding)
@@ -5340,14 +6540,7 @@ void irtkReconstruction::MaskImage(irtkRealImage& image, double padding)
     cerr << "Cannot mask the image - different dimensions" << endl;
     exit(1);
   }
-  irtkRealPixel *pr = image.GetPointerToVoxels();
-  irtkRealPixel *pm = _mask.GetPointerToVoxels();
-  for (int i = 0; i < image.GetNumberOfVoxels(); i++) {
-    if (*pm == 0)
-      *pr = padding;
-    pm++;
-    pr++;
-  }
+  _mask_runs.FillOutside(image.GetPointerToVoxels(), irtkRealPixel(padding));
 }
 
 /// Like PutMinMax but ignoring negative values (mask)
@@ -0,0 +1,145 @@
+/*=========================================================================
+* GPU accelerated motion compensation for MRI
+*
+* Copyright (c) 2016 Bernhard Kainz, Amir Alansary, Maria Kuklisova-Murgasova,
+* Kevin Keraudren, Markus Steinberger
+* (b.kainz@imperial.ac.uk)
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+=========================================================================*/
+
+#include "irtkSpillFile.h"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+irtkSpillFile::irtkSpillFile() : _fd(-1), _size(0), _map(NULL), _mapped(0)
+{
+}
+
+irtkSpillFile::~irtkSpillFile()
+{
+  Close();
+}
+
+bool irtkSpillFile::Open(const string& dir)
+{
+  Close();
+
+  string name = (dir.empty() ? string(".") : dir) + "/irtkSpillXXXXXX";
+  vector<char> buffer(name.begin(), name.end());
+  buffer.push_back(0);
+  _fd = mkstemp(&buffer[0]);
+  if (_fd < 0) {
+    cerr << "irtkSpillFile: could not create spill file in " << dir << ": " << strerror(errno) << endl;
+    return false;
+  }
+  //the file is removed once it is closed
+  unlink(&buffer[0]);
+  _size = 0;
+  return true;
+}
+
+void irtkSpillFile::Close()
+{
+  Unmap();
+  if (_fd >= 0)
+    close(_fd);
+  _fd = -1;
+  _size = 0;
+}
+
+void irtkSpillFile::Unmap()
+{
+  if (_map != NULL)
+    munmap(_map, _mapped);
+  _map = NULL;
+  _mapped = 0;
+}
+
+size_t irtkSpillFile::Append(const void *data, size_t bytes)
+{
+  size_t offset = _size;
+  const char *p = static_cast<const char*>(data);
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t n = pwrite(_fd, p + done, bytes - done, _size + done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      cerr << "irtkSpillFile: write failed: " << strerror(errno) << endl;
+      exit(1);
+    }
+    done += n;
+  }
+  _size += bytes;
+  return offset;
+}
+
+void irtkSpillFile::Map()
+{
+  Unmap();
+  if (_size == 0)
+    return;
+  void *map = mmap(NULL, _size, PROT_READ, MAP_SHARED, _fd, 0);
+  if (map == MAP_FAILED) {
+    cerr << "irtkSpillFile: mmap failed: " << strerror(errno) << endl;
+    exit(1);
+  }
+  _map = static_cast<char*>(map);
+  _mapped = _size;
+}
+
+void irtkSpillFile::Prefetch(size_t offset, size_t bytes) const
+{
+  if ((_map == NULL) || (bytes == 0))
+    return;
+  //madvise needs page aligned addresses
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = offset / page * page;
+  size_t end = min(offset + bytes, _mapped);
+  madvise(_map + start, end - start, MADV_WILLNEED);
+}
+
+void irtkSpillFile::Release(size_t offset, size_t bytes) const
+{
+  if ((_map == NULL) || (bytes == 0))
+    return;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = offset / page * page;
+  size_t end = min(offset + bytes, _mapped);
+  madvise(_map + start, end - start, MADV_DONTNEED);
+}
+
+void irtkSpillFile::Swap(irtkSpillFile& file)
+{
+  swap(_fd, file._fd);
+  swap(_size, file._size);
+  swap(_map, file._map);
+  swap(_mapped, file._mapped);
+}
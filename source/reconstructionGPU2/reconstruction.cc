@@ -31,6 +31,7 @@
 #include <vector>
 #include <string>
 #include <perfstats.h>
+#include <irtkProfiler.h>
 #include <fstream>
 #include <iostream>
 #include <time.h>  
@@ -105,6 +106,7 @@ int main(int argc, char **argv)
   double averageValue = 700;
   double smooth_mask = 4;
   bool global_bias_correction = false;
+  bool recursive_bias_blurring = false;
   double low_intensity_cutoff = 0.01;
   //folder for slice-to-volume registrations, if given
   string tfolder;
@@ -153,6 +155,28 @@ int main(int argc, char **argv)
   unsigned int patchStride = 32;
   bool saveSliceTransformations = false;
   bool useNMI = false;
+  bool srGather = false;
+  bool fusedEM = false;
+  bool srCG = false;
+  int srCGIterations = 10;
+  double srCGTolerance = 1e-3;
+  double memoryBudget = 0;
+  int threads = 0;
+  string profileName;
+  vector<string> grainSizes;
+  bool srAdaptive = false;
+  double srStopUpdate = 1e-3;
+  double srStopEM = 1e-3;
+  unsigned int srMinIterations = 3;
+  string spillDir = ".";
+  vector<double> resolutionSchedule;
+  string checkpointName;
+  bool resume = false;
+  int firstIteration = 0;
+  vector<irtkRigidTransformation> initial_stack_transformations;
+  vector<irtkRigidTransformation> resumed_stack_transformations;
+  double coeffTranslationTolerance = 0;
+  double coeffRotationTolerance = 0;
 
   //in case of manual mask transformation, it is required that the provided manual mask fits the first of the provided image stacks.
   std::string manualMaskName;
@@ -171,6 +195,9 @@ int main(int argc, char **argv)
       ("iterations", po::value<int>(&iterations)->default_value(4), "Number of registration-reconstruction iterations.")
       ("sigma", po::value< double >(&sigma)->default_value(12.0), "Stdev for bias field. [Default: 12mm]")
       ("resolution", po::value< double >(&resolution)->default_value(0.75), "Isotropic resolution of the volume. [Default: 0.75mm]")
+      ("resolutionSchedule", po::value< vector<double> >(&resolutionSchedule)->multitoken(), "[res_1] .. [res_N] Isotropic resolution of the volume in the first N iterations on CPU, e.g. 1.5 1.0. The remaining iterations and always the last one use --resolution.")
+      ("checkpoint", po::value< string >(&checkpointName), "Write the state of the reconstruction to this file after each registration-reconstruction iteration but the last (CPU only).")
+      ("resume", po::bool_switch(&resume)->default_value(false), "Continue from the iteration after the one stored in the checkpoint file. Stack registrations are taken from the checkpoint; all other options must be as in the interrupted run.")
       ("multires", po::value< int >(&levels)->default_value(3), "Multiresolution smooting with given number of levels. [Default: 3]")
       ("average", po::value< double >(&averageValue)->default_value(700), "Average intensity value for stacks [Default: 700]")
       ("delta", po::value< double >(&delta)->default_value(150), " Parameter to define what is an edge. [Default: 150]")
@@ -179,6 +206,7 @@ int main(int argc, char **argv)
       ("smooth_mask", po::value< double >(&smooth_mask)->default_value(4), "Smooth the mask to reduce artefacts of manual segmentation. [Default: 4mm]")
       ("global_bias_correction", po::value< bool >(&global_bias_correction)->default_value(false), "Correct the bias in reconstructed image against previous estimation.")
       ("low_intensity_cutoff", po::value< double >(&low_intensity_cutoff)->default_value(0.01), "Lower intensity threshold for inclusion of voxels in global bias correction.")
+      ("recursiveBiasBlurring", po::bool_switch(&recursive_bias_blurring)->default_value(false), "Smooth during bias field estimation with a recursive Gaussian whose cost does not grow with sigma. Differs from the default convolution by a fraction of a percent. (CPU only)")
       ("force_exclude", po::value< vector<int> >(&force_excluded)->multitoken(), "force_exclude [number of slices] [ind1] ... [indN]  Force exclusion of slices with these indices.")
       ("no_intensity_matching", po::value< bool >(&intensity_matching), "Switch off intensity matching.")
       ("log_prefix", po::value< string >(&log_id), "Prefix for the log file.")
@@ -186,6 +214,10 @@ int main(int argc, char **argv)
       ("debug_gpu", po::bool_switch(&debug_gpu)->default_value(false), " Debug only GPU results.")
       ("rec_iterations_first", po::value< unsigned int >(&rec_iterations_first)->default_value(4), " Set number of superresolution iterations")
       ("rec_iterations_last", po::value< unsigned int >(&rec_iterations_last)->default_value(13), " Set number of superresolution iterations for the last iteration")
+      ("srAdaptive", po::bool_switch(&srAdaptive)->default_value(false), "Stop the superresolution iterations once the volume and the EM fit stop changing. rec_iterations_first and rec_iterations_last become the maximum.")
+      ("srStopUpdate", po::value< double >(&srStopUpdate)->default_value(1e-3), "srAdaptive: relative change of the volume per iteration below which it has converged. [Default: 0.001]")
+      ("srStopEM", po::value< double >(&srStopEM)->default_value(1e-3), "srAdaptive: change of the mean EM log-likelihood per iteration below which it has converged. [Default: 0.001]")
+      ("srMinIterations", po::value< unsigned int >(&srMinIterations)->default_value(3), "srAdaptive: minimum number of superresolution iterations. [Default: 3]")
       ("num_stacks_tuner", po::value< unsigned int >(&num_input_stacks_tuner)->default_value(0), "  Set number of input stacks that are really used (for tuner evaluation, use only first x)")
       ("no_log", po::value< bool >(&no_log)->default_value(false), "  Do not redirect cout and cerr to log files.")
       ("devices,d", po::value< vector<int> >(&devicesToUse)->multitoken(), "  Select the CP > 3.0 GPUs on which the reconstruction should be executed. Default: all devices > CP 3.0")
@@ -208,6 +240,18 @@ int main(int argc, char **argv)
       //--------------------------------------------------------------------------------------------
       ("manualMask", po::value<string>(&manualMaskName), "Binary manual accurate mask to define a region accuratly slice by slice. It is required that the provided manual mask fits the *first* of the provided image stacks in -i <stacks *1*...N>! Nifti or Analyze format.")
       ("useNMI", po::bool_switch(&useNMI)->default_value(false), "use Normalized Mutual Information for slice to volume registration.")
+      ("coeffTranslationTolerance", po::value< double >(&coeffTranslationTolerance)->default_value(0), "Reuse the slice-volume matrix of slices which moved less than this translation since it was computed. [Default: 0mm]")
+      ("coeffRotationTolerance", po::value< double >(&coeffRotationTolerance)->default_value(0), "Reuse the slice-volume matrix of slices which rotated less than this since it was computed. [Default: 0 degrees]")
+      ("profile", po::value< string >(&profileName), "Write a profile of the CPU stages with work counters and per-thread busy time to [name].json and a Chrome trace to [name].trace.json.")
+      ("threads", po::value< int >(&threads)->default_value(0), "Number of CPU threads. [Default: all cores]")
+      ("grainSize", po::value< vector<string> >(&grainSizes)->multitoken(), "[stage=n] .. Minimum number of slices (or volume planes) per CPU task of a stage, e.g. EStep=4 Superresolution=8. Stages are named after their Parallel* functor.")
+      ("srGather", po::bool_switch(&srGather)->default_value(false), "gather superresolution updates per voxel on CPU instead of reducing per-thread volumes. Needs an extra transposed copy of the slice-volume matrix.")
+      ("srCG", po::bool_switch(&srCG)->default_value(false), "solve each superresolution step on CPU with preconditioned conjugate gradients instead of a single gradient step. Usually needs fewer rec_iterations.")
+      ("srCGIterations", po::value< int >(&srCGIterations)->default_value(10), "Maximum number of CG iterations per superresolution step. [Default: 10]")
+      ("srCGTolerance", po::value< double >(&srCGTolerance)->default_value(1e-3), "Stop CG when the residual dropped below this fraction of the initial residual. [Default: 0.001]")
+      ("memoryBudget", po::value< double >(&memoryBudget)->default_value(0), "Memory in MB the CPU slice-volume matrix may use. The rest is written to a temporary file in spillDir and read back in batches of slices. 0 keeps everything in memory. [Default: 0]")
+      ("spillDir", po::value< string >(&spillDir)->default_value("."), "Directory for the temporary file of memoryBudget. [Default: .]")
+      ("fusedEM", po::bool_switch(&fusedEM)->default_value(false), "compute voxel weights, bias fields and scales in one pass per slice on CPU. Gives the same result as the separate EStep, Bias and Scale steps.")
       ("saveSliceTransformations", po::bool_switch(&saveSliceTransformations)->default_value(false), "Save slice transformations and pixel to voxel mapping. Be aware that the index refers to the stacks cropped with the provided mask (not the original stack slice index).");
     po::variables_map vm;
 
@@ -246,6 +290,25 @@ int main(int argc, char **argv)
 
   if (useGPUReg) useCPUReg = false;
 
+  if (!useCPU && (resolutionSchedule.size() > 0))
+  {
+    cout << "resolutionSchedule is only supported with useCPU and will be ignored" << endl;
+    resolutionSchedule.clear();
+  }
+
+  if (!useCPU && (!checkpointName.empty() || resume))
+  {
+    cout << "checkpoint and resume are only supported with useCPU and will be ignored" << endl;
+    checkpointName.clear();
+    resume = false;
+  }
+
+  if (resume && checkpointName.empty())
+  {
+    cerr << "Please give the checkpoint to resume from." << endl;
+    exit(1);
+  }
+
   cout << "Reconstructed volume name ... " << outputName << endl;
   nStacks = inputStacks.size();
   cout << "Number of stacks ... " << nStacks << endl;
@@ -444,6 +507,29 @@ int main(int argc, char **argv)
   if (debug) reconstruction.DebugOn();
   else reconstruction.DebugOff();
 
+  if (srGather) reconstruction.GatherSuperresolutionOn();
+  if (srCG) reconstruction.SuperresolutionCGOn(srCGIterations, srCGTolerance);
+  if (memoryBudget > 0) reconstruction.SetMemoryBudget(memoryBudget, spillDir);
+  if (threads > 0)
+  {
+    //also used by the IRTK filters and registrations
+    tbb_no_threads = threads;
+    reconstruction.SetNumberOfThreads(threads);
+  }
+  for (i = 0; i < grainSizes.size(); i++)
+  {
+    size_t pos = grainSizes[i].find('=');
+    if ((pos == string::npos) || (atoi(grainSizes[i].c_str() + pos + 1) <= 0))
+    {
+      cerr << "Invalid grain size " << grainSizes[i] << ", expected stage=n." << endl;
+      exit(1);
+    }
+    reconstruction.SetGrainSize(grainSizes[i].substr(0, pos), atoi(grainSizes[i].c_str() + pos + 1));
+  }
+  if (srAdaptive) reconstruction.AdaptiveStoppingOn(srStopUpdate, srStopEM);
+
+  reconstruction.SetCoeffsTolerance(coeffTranslationTolerance, coeffRotationTolerance);
+
   //Set force excluded slices
   reconstruction.SetForceExcludedSlices(force_excluded);
 
@@ -490,6 +576,8 @@ int main(int argc, char **argv)
 
   PerfStats stats;
   stats.start();
+  if (!profileName.empty())
+    irtkProfiler::Enable();
 
   if (T1PackageSize > 0)
   {
@@ -648,6 +736,18 @@ int main(int argc, char **argv)
   cout << setprecision(3);
   cerr << setprecision(3);
 
+  //a resumed run takes both stack registrations from the checkpoint
+  if (resume)
+  {
+    resumed_stack_transformations = stack_transformations;
+    firstIteration = reconstruction.ReadCheckpointStacks(checkpointName.c_str(), initial_stack_transformations, resumed_stack_transformations) + 1;
+    if (firstIteration >= iterations)
+    {
+      cerr << "Checkpoint " << checkpointName << " is already at the last iteration." << endl;
+      exit(1);
+    }
+  }
+
   //perform volumetric registration of the stacks
   //redirect output to files
   if (!no_log) {
@@ -655,11 +755,16 @@ int main(int argc, char **argv)
     cout.rdbuf(file.rdbuf());
   }
 
-  if (T1PackageSize == 0 && sfolder.empty())
+  if (resume)
+  {
+    stack_transformations = initial_stack_transformations;
+  }
+  else if (T1PackageSize == 0 && sfolder.empty())
   {
     //volumetric registration
     reconstruction.StackRegistrations(stacks, stack_transformations, templateNumber);
   }
+  initial_stack_transformations = stack_transformations;
 
   //return EXIT_SUCCESS;
 
@@ -705,7 +810,11 @@ int main(int argc, char **argv)
     cout.rdbuf(file.rdbuf());
   }
 
-  if (T1PackageSize == 0 && sfolder.empty())
+  if (resume)
+  {
+    stack_transformations = resumed_stack_transformations;
+  }
+  else if (T1PackageSize == 0 && sfolder.empty())
   {
     //volumetric registration
     reconstruction.StackRegistrations(stacks, stack_transformations, templateNumber);
@@ -777,6 +886,9 @@ int main(int argc, char **argv)
   else
     reconstruction.GlobalBiasCorrectionOff();
 
+  if (recursive_bias_blurring)
+    reconstruction.RecursiveBiasBlurringOn();
+
   //if given read slice-to-volume registrations
   if (!tfolder.empty())
     reconstruction.ReadTransformation((char*)tfolder.c_str());
@@ -807,6 +919,24 @@ int main(int argc, char **argv)
   }
   stats.sample("InitializeEM");
 
+  if (resume)
+  {
+    reconstruction.ReadCheckpoint(checkpointName.c_str());
+    //smoothing parameters are only set in the iterations where they change
+    for (int iter = 0; iter < firstIteration; iter++)
+    {
+      double l = lambda;
+      for (i = 0; i < levels; i++)
+      {
+        if (iter == iterations*(levels - i - 1) / levels)
+          reconstruction.SetSmoothingParameters(delta, l);
+        l *= 2;
+      }
+    }
+    cout << "Resuming after iteration " << firstIteration - 1 << "." << endl;
+    stats.sample("ReadCheckpoint");
+  }
+
   if (!useCPU)
   {
     //only one update
@@ -814,14 +944,26 @@ int main(int argc, char **argv)
   }
 
   //interleaved registration-reconstruction iterations
-  for (int iter = 0; iter < iterations; iter++)
+  for (int iter = firstIteration; iter < iterations; iter++)
   {
+    irtkProfileScope profileIteration("Iteration");
+
     //Print iteration number on the screen
     if (!no_log) {
       cout.rdbuf(strm_buffer);
     }
     cout << "Iteration " << iter << ". " << endl;
 
+    //coarse to fine reconstruction, the last iteration is at full resolution
+    if (useCPU && (resolutionSchedule.size() > 0))
+    {
+      if ((iter < resolutionSchedule.size()) && (iter < (iterations - 1)))
+        reconstruction.SetReconstructionResolution(resolutionSchedule[iter]);
+      else
+        reconstruction.SetReconstructionResolution(resolution);
+      stats.sample("SetReconstructionResolution");
+    }
+
     //perform slice-to-volume registrations - skip the first iteration 
 	if (iter > 0 || !referenceVolumeName.empty())
     {
@@ -940,6 +1082,7 @@ int main(int argc, char **argv)
     if (useCPU)
     {
       reconstruction.CoeffInit();
+      stats.sample("CoeffInit reused slices", reconstruction.GetNumberOfReusedCoeffs());
     }
     else {
       reconstruction.UpdateGPUTranformationMatrices();
@@ -947,9 +1090,11 @@ int main(int argc, char **argv)
     stats.sample("CoeffInit");
 
     //Initialize reconstructed image with Gaussian weighted reconstruction
+    //the timing excludes writing the intermediate results
     if (useCPU)
     {
       reconstruction.GaussianReconstruction();
+      stats.sample("GaussianReconstruction");
       if (debug)
       {
         reconstructed = reconstruction.GetReconstructed();
@@ -959,6 +1104,7 @@ int main(int argc, char **argv)
     }
     else {
       reconstruction.GaussianReconstructionGPU();
+      stats.sample("GaussianReconstruction");
       if (true /*debug || debug_gpu*/)
       {
         reconstructedGPU = reconstruction.GetReconstructedGPU();
@@ -966,7 +1112,7 @@ int main(int argc, char **argv)
         reconstructedGPU.Write(buffer);
       }
     }
-    stats.sample("GaussianReconstruction");
+    stats.sample("GaussianReconstruction output");
 
    // return EXIT_SUCCESS;
     //Simulate slices (needs to be done after Gaussian reconstruction)
@@ -989,10 +1135,22 @@ int main(int argc, char **argv)
     }
     stats.sample("InitializeRS");
 
+    //number of reconstruction iterations
+    if (iter == (iterations - 1))
+    {
+      rec_iterations = rec_iterations_last;
+    }
+    else
+      rec_iterations = rec_iterations_first;
+
     //EStep
     if (useCPU)
     {
-      reconstruction.EStep();
+      //the fused pass also computes bias and scale of the first iteration
+      if (fusedEM && intensity_matching && (rec_iterations > 0))
+        reconstruction.EStepBiasScale(!disableBiasCorr && (sigma > 0));
+      else
+        reconstruction.EStep();
     }
     else {
       reconstruction.EStepGPU();
@@ -1000,18 +1158,11 @@ int main(int argc, char **argv)
     stats.sample("EStep");
     //return EXIT_SUCCESS; 
 
-    //number of reconstruction iterations
-    if (iter == (iterations - 1))
-    {
-      rec_iterations = rec_iterations_last;
-    }
-    else
-      rec_iterations = rec_iterations_first;
-
     //reconstruction iterations
     i = 0;
     for (i = 0; i < rec_iterations; i++)
     {
+      irtkProfileScope profileReconstruction("ReconstructionIteration");
 
       cout << endl << "  Reconstruction iteration " << i << ". " << endl;
 
@@ -1020,13 +1171,17 @@ int main(int argc, char **argv)
         //calculate bias fields
         if (useCPU)
         {
-          if (!disableBiasCorr)
+          //already calculated by the fused EStep
+          if (!fusedEM)
           {
-            if (sigma > 0)
-              reconstruction.Bias();
+            if (!disableBiasCorr)
+            {
+              if (sigma > 0)
+                reconstruction.Bias();
+            }
+            //calculate scales
+            reconstruction.Scale();
           }
-          //calculate scales
-          reconstruction.Scale();
         }
         else {
           //TODO try out N4 bias correction
@@ -1056,6 +1211,8 @@ int main(int argc, char **argv)
         reconstruction.SuperresolutionGPU(i + 1);
       }
       stats.sample("Superresolution");
+      if (useCPU && srCG)
+        stats.sample("Superresolution CG iterations", reconstruction.GetNumberOfCGIterations());
 
       //return EXIT_SUCCESS; 
 
@@ -1097,15 +1254,28 @@ int main(int argc, char **argv)
         reconstruction.MStepGPU(i + 1);
       }
       stats.sample("MStep");
+
+      //stop once neither the volume nor the EM fit change any more
+      bool converged = srAdaptive && (i + 1 >= srMinIterations) && reconstruction.SuperresolutionConverged();
+
       if (useCPU)
       {
         //E-step
-        reconstruction.EStep();
+        if (fusedEM && intensity_matching && (i + 1 < rec_iterations) && !converged)
+          reconstruction.EStepBiasScale(!disableBiasCorr && (sigma > 0));
+        else
+          reconstruction.EStep();
       }
       else {
         reconstruction.EStepGPU();
       }
       stats.sample("EStep");
+      if (useCPU)
+      {
+        stats.sample("EM slice allocations", reconstruction.GetNumberOfSliceAllocations());
+        irtkProfiler::Count("images allocated", reconstruction.GetNumberOfSliceAllocations());
+        reconstruction.ResetSliceAllocations();
+      }
 
       //Save intermediate reconstructed image
       if (debug || debug_gpu)
@@ -1123,8 +1293,16 @@ int main(int argc, char **argv)
         }
       }
       printf("%d ", i);
+      if (converged)
+      {
+        i++;
+        break;
+      }
     }//end of reconstruction iterations
 
+    cout << "Superresolution iterations used: " << i << endl;
+    stats.sample("Superresolution iterations used", i);
+
     printf("Main loop end\n");
 
     //Mask reconstructed image to ROI given by the mask
@@ -1233,6 +1411,13 @@ int main(int argc, char **argv)
     if (!no_log) {
       cout.rdbuf(strm_buffer);
     }
+
+    //the last iteration is followed by the final output instead
+    if (!checkpointName.empty() && (iter < (iterations - 1)))
+    {
+      reconstruction.WriteCheckpoint(checkpointName.c_str(), iter, initial_stack_transformations, stack_transformations);
+      stats.sample("WriteCheckpoint");
+    }
     printf("\n");
   }// end of interleaved registration-reconstruction iterations
 
@@ -1295,6 +1480,12 @@ int main(int argc, char **argv)
   perf_file.close();
   printf(".........overall time: %f s........\n", mss);
 
+  if (!profileName.empty())
+  {
+    irtkProfiler::WriteJSON((profileName + ".json").c_str());
+    irtkProfiler::WriteChromeTrace((profileName + ".trace.json").c_str());
+  }
+
   //save final result
   reconstructed = reconstruction.GetReconstructed();
   reconstructed.Write(outputName.c_str());